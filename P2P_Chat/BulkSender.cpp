@@ -0,0 +1,250 @@
+#include "BulkSender.h"
+
+#ifdef __linux__
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/udp.h>
+#include <unistd.h>
+#include <cerrno>
+
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef IP_MTU
+#define IP_MTU 14
+#endif
+#endif
+
+static const size_t GSO_SEGMENTS_MAX = 64; // datagrams. Kernel limit of segments in one GSO send.
+static const size_t GSO_PAYLOAD_MAX = 65507; // bytes. Max size of UDP payload (IPv4).
+static const size_t UDP_IPV4_HEADERS = 28; // bytes. IPv4 and UDP headers of every segment.
+static const size_t UDP_IPV6_HEADERS = 48; // bytes. IPv6 and UDP headers of every segment.
+
+atomic<bool> BulkSender::_gsoEnabled(true);
+map<UdpEndpoint, size_t> BulkSender::_segmentLimits;
+Mutex BulkSender::_segmentLimitsMutex;
+
+BulkSender::BulkSender(UdpSocket& socket) : _socket(socket), _count(0)
+{
+}
+
+void BulkSender::Add(const UdpEndpoint& endpoint, const Packet& header, cc_string data, size_t size, cc_string trailer, size_t trailerSize)
+{
+    if (trailerSize > BULK_TRAILER_MAX)
+        throw logic_error("trailer of datagram is too large");
+
+    Datagram& datagram = _datagrams[_count++];
+    datagram.endpoint = endpoint;
+    datagram.header = header;
+    datagram.data = data;
+    datagram.size = size;
+    datagram.trailerSize = trailerSize;
+    if (trailerSize > 0)
+        memcpy(datagram.trailer, trailer, trailerSize);
+
+    if (_count == BULK_DATAGRAMS_MAX)
+        Flush();
+}
+
+#ifdef __linux__
+
+void BulkSender::Flush()
+{
+    size_t single[BULK_DATAGRAMS_MAX];
+    size_t singleCount = 0;
+
+    size_t first = 0;
+    while (first < _count)
+    {
+        // find datagrams which can be one GSO send: the same endpoint and size (the last one may be shorter)
+        size_t segment = _datagrams[first].Size();
+        size_t total = segment;
+        size_t last = first + 1;
+        while (last < _count && last - first < GSO_SEGMENTS_MAX
+            && _datagrams[last].endpoint == _datagrams[first].endpoint
+            && _datagrams[last].Size() <= segment
+            && total + _datagrams[last].Size() <= GSO_PAYLOAD_MAX)
+        {
+            total += _datagrams[last].Size();
+            if (_datagrams[last++].Size() < segment)
+                break;
+        }
+
+        // segment larger than MTU of the route is rejected by the kernel, such datagrams are fragmented by sendmmsg
+        if (last - first < 2 || !_gsoEnabled || segment > GetSegmentLimit(_datagrams[first].endpoint)
+            || !SendSegmented(first, last, segment))
+        {
+            for (size_t i = first; i < last; ++i)
+                single[singleCount++] = i;
+        }
+
+        first = last;
+    }
+
+    if (singleCount > 0)
+        SendMultiple(single, singleCount);
+
+    Clear();
+}
+
+// send datagrams [first, last) by one sendmsg, kernel splits them by segment size
+
+bool BulkSender::SendSegmented(size_t first, size_t last, size_t segment)
+{
+    iovec vectors[3 * GSO_SEGMENTS_MAX];
+    size_t count = 0;
+    for (size_t i = first; i < last; ++i)
+        count += Gather(_datagrams[i], vectors + count);
+
+    char control[CMSG_SPACE(sizeof(uint16_t))];
+    memset(control, 0, sizeof(control));
+
+    msghdr message;
+    memset(&message, 0, sizeof(message));
+    message.msg_name = (void*)_datagrams[first].endpoint.data();
+    message.msg_namelen = (socklen_t)_datagrams[first].endpoint.size();
+    message.msg_iov = vectors;
+    message.msg_iovlen = count;
+    message.msg_control = control;
+    message.msg_controllen = sizeof(control);
+
+    cmsghdr* cmsg = CMSG_FIRSTHDR(&message);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    *(uint16_t*)CMSG_DATA(cmsg) = (uint16_t)segment;
+
+    if (sendmsg(_socket.native_handle(), &message, 0) < 0)
+    {
+        // old kernel or device without checksum offload: don't try it again
+        if (errno == EIO || errno == EINVAL || errno == ENOPROTOOPT || errno == EOPNOTSUPP)
+            _gsoEnabled = false;
+
+        // the route has smaller MTU now: it is read again, such segments aren't sent to this endpoint by GSO any more
+        if (errno == EMSGSIZE)
+        {
+            size_t limit = min(ReadSegmentLimit(_datagrams[first].endpoint), segment - 1);
+            ScopedLock lk(_segmentLimitsMutex);
+            _segmentLimits[_datagrams[first].endpoint] = limit;
+        }
+        return false;
+    }
+
+    return true;
+}
+
+// limit is read once for every endpoint
+
+size_t BulkSender::GetSegmentLimit(const UdpEndpoint& endpoint)
+{
+    {
+        ScopedLock lk(_segmentLimitsMutex);
+        map<UdpEndpoint, size_t>::const_iterator it = _segmentLimits.find(endpoint);
+        if (it != _segmentLimits.end())
+            return it->second;
+    }
+
+    size_t limit = ReadSegmentLimit(endpoint);
+
+    // the limit, which is lowered by the failed send meanwhile, is kept
+    ScopedLock lk(_segmentLimitsMutex);
+    return _segmentLimits.insert(make_pair(endpoint, limit)).first->second;
+}
+
+// MTU of the route is known only to a connected socket, so it is read by a temporary one
+
+size_t BulkSender::ReadSegmentLimit(const UdpEndpoint& endpoint)
+{
+    size_t limit = 0;
+    bool v6 = endpoint.address().is_v6();
+    int fd = socket(v6 ? AF_INET6 : AF_INET, SOCK_DGRAM, 0);
+    if (fd >= 0)
+    {
+        // file can be sent to the broadcast address
+        int on = 1;
+        int mtu = 0;
+        socklen_t length = sizeof(mtu);
+        size_t headers = v6 ? UDP_IPV6_HEADERS : UDP_IPV4_HEADERS;
+        setsockopt(fd, SOL_SOCKET, SO_BROADCAST, &on, sizeof(on));
+        if (connect(fd, endpoint.data(), (socklen_t)endpoint.size()) == 0
+            && getsockopt(fd, v6 ? IPPROTO_IPV6 : IPPROTO_IP, v6 ? IPV6_MTU : IP_MTU, &mtu, &length) == 0
+            && (size_t)mtu > headers)
+            limit = (size_t)mtu - headers;
+        close(fd);
+    }
+
+    return limit;
+}
+
+// send datagrams by sendmmsg (one system call for all of them)
+
+void BulkSender::SendMultiple(const size_t* datagrams, size_t count)
+{
+    mmsghdr headers[BULK_DATAGRAMS_MAX];
+    iovec vectors[3 * BULK_DATAGRAMS_MAX];
+
+    memset(headers, 0, sizeof(headers));
+    for (size_t i = 0; i < count; ++i)
+    {
+        Datagram& datagram = _datagrams[datagrams[i]];
+        headers[i].msg_hdr.msg_name = (void*)datagram.endpoint.data();
+        headers[i].msg_hdr.msg_namelen = (socklen_t)datagram.endpoint.size();
+        headers[i].msg_hdr.msg_iov = &vectors[3 * i];
+        headers[i].msg_hdr.msg_iovlen = Gather(datagram, &vectors[3 * i]);
+    }
+
+    // sendmmsg may send only a part of datagrams
+    for (size_t sent = 0; sent < count;)
+    {
+        int result = sendmmsg(_socket.native_handle(), headers + sent, (unsigned)(count - sent), 0);
+        if (result <= 0)
+            break;
+        sent += (size_t)result;
+    }
+}
+
+// parts of the datagram (2 or 3 of them), returns quantity of them
+
+size_t BulkSender::Gather(const Datagram& datagram, iovec* vectors)
+{
+    vectors[0].iov_base = (void*)datagram.header.data();
+    vectors[0].iov_len = datagram.header.size();
+    vectors[1].iov_base = (void*)datagram.data;
+    vectors[1].iov_len = datagram.size;
+    if (datagram.trailerSize == 0)
+        return 2;
+
+    vectors[2].iov_base = (void*)datagram.trailer;
+    vectors[2].iov_len = datagram.trailerSize;
+    return 3;
+}
+
+#else
+
+void BulkSender::Flush()
+{
+    for (size_t i = 0; i < _count; ++i)
+    {
+        const Datagram& datagram = _datagrams[i];
+        boost::array<boost::asio::const_buffer, 3> buffers = { {
+            boost::asio::buffer(datagram.header.data(), datagram.header.size()),
+            boost::asio::buffer(datagram.data, datagram.size),
+            boost::asio::buffer(datagram.trailer, datagram.trailerSize)
+        } };
+        ErrorCode ec;
+        _socket.send_to(buffers, datagram.endpoint, 0, ec);
+    }
+
+    Clear();
+}
+
+#endif
+
+// headers go back to the pool
+
+void BulkSender::Clear()
+{
+    for (size_t i = 0; i < _count; ++i)
+        _datagrams[i].header = Packet();
+    _count = 0;
+}
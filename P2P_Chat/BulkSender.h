@@ -0,0 +1,70 @@
+#ifndef BULK_SENDER_H
+#define BULK_SENDER_H
+
+#include "utils.h"
+#include "PacketPool.h"
+
+#include <atomic>
+
+#ifdef __linux__
+#include <sys/uio.h>
+#endif
+
+#define BULK_DATAGRAMS_MAX 64  // datagrams. Flush is called when so many datagrams are collected.
+#define BULK_TRAILER_MAX 8      // bytes. Trailer of the datagram (after the data) is copied into it.
+
+/*
+Sends many datagrams (header + data + small trailer) with as few system calls as possible.
+Datagrams are collected by Add and sent by Flush:
+on Linux consecutive datagrams to the same endpoint are coalesced into one UDP_SEGMENT (GSO) send,
+if one datagram fits into MTU of the route to it (segments aren't fragmented by the kernel),
+the rest (or everything, if GSO isn't supported) is sent by sendmmsg.
+On other platforms datagrams are sent one by one.
+Datagrams are kept in a fixed array (nothing is allocated per send), headers are pooled packets.
+*/
+class BulkSender
+{
+public:
+    BulkSender(UdpSocket& socket);
+    ~BulkSender() { }
+
+    void Add(const UdpEndpoint& endpoint, const Packet& header, cc_string data, size_t size, cc_string trailer = 0, size_t trailerSize = 0);
+    void Flush();
+private:
+    struct Datagram
+    {
+        UdpEndpoint endpoint;
+        Packet header;
+        cc_string data;
+        size_t size;
+        char trailer[BULK_TRAILER_MAX];
+        size_t trailerSize;
+
+        size_t Size() const { return header.size() + size + trailerSize; }
+    };
+
+    UdpSocket& _socket;
+    Datagram _datagrams[BULK_DATAGRAMS_MAX];
+    size_t _count;
+
+    // GSO is switched off for the whole process after the first failure
+    static atomic<bool> _gsoEnabled;
+
+    // largest GSO segment of every endpoint (MTU of the route without IP and UDP headers), 0 - no GSO for it
+    static map<UdpEndpoint, size_t> _segmentLimits;
+    static Mutex _segmentLimitsMutex;
+
+    void Clear();
+#ifdef __linux__
+    bool SendSegmented(size_t first, size_t last, size_t segment);
+    void SendMultiple(const size_t* datagrams, size_t count);
+    static size_t Gather(const Datagram& datagram, iovec* vectors);
+    static size_t GetSegmentLimit(const UdpEndpoint& endpoint);
+    static size_t ReadSegmentLimit(const UdpEndpoint& endpoint);
+#endif
+
+    BulkSender(const BulkSender& src);
+    BulkSender& operator=(const BulkSender& rval);
+};
+
+#endif // BULK_SENDER_H
@@ -6,39 +6,55 @@
 #include "ChatClient.h"
 #include "message_formats.h"
 #include "MessageBuilder.h"
+#include "BulkSender.h"
 #include "Logger.h"
 
-#define CHAT_ERROR "[Chat Core]-ERROR: "
-
 unique_ptr<ChatClient> ChatClient::_instance;
 once_flag ChatClient::_onceFlag;
 
-// Constants for FilesWatcherThread
+// Constants for timers (timeouts of blocks and M_FI are estimated by RttEstimator)
 
-static const uint8 SECONDS_TO_LOOSE_PACKET = 1; // seconds. Incoming packet is lost after this time (we decide).
-static const uint8 ATTEMPTS_TO_RECEIVE_BLOCK = 5; // attempts. Download is interrupted after reaching this limit.
-static const uint8 SECONDS_TO_WAIT_ANSWER_ON_MFI = 5; // seconds. Message with file information (M_FI) is re-sent after this time.
+static const uint8 SECONDS_TO_RECEIVE_BLOCK = 10; // seconds. Download is interrupted, if no blocks are received for this time.
 static const uint8 ATTEMPTS_TO_SEND_FIRST_M = 5; // attempts. We can't send M_FI after reaching this limit.
 static const uint8 SECONDS_TO_BE_ALIVE = 2;
+static const uint8 SECONDS_TO_REMEMBER_FILE = 60; // seconds. Re-sent M_FI of the received file is ignored for this time.
+static const uint8 SECONDS_TO_KEEP_MAPPING = 30; // seconds. Sent file is unmapped, if nothing is requested for this time.
+
+// Constants for receiving
+
+static const size_t RECV_BATCH = 32; // datagrams. Max quantity of datagrams read by one wakeup.
+static const int RECV_SOCKET_BUFFER = 4 * 1024 * 1024; // bytes. Socket buffer keeps datagrams while the batch is handled.
+
+// Constants for compression of file blocks
+
+static const uint32 COMPRESSION_GAIN = 16; // compressed block is sent, if it is smaller by 1/16 of the block at least
+static const uint32 COMPRESSION_FAILS_MAX = 8; // blocks. Compression is paused after so many incompressible blocks in a row.
+static const uint32 COMPRESSION_PAUSE = 256; // blocks. They are sent raw without trying (archives, media), then it is tried again.
+
+// Constants for sending files to all peers
+
+static const int64_t REPAIR_HOLDOFF_MIN_US = 2 * 1000; // microseconds. Block isn't sent again sooner (RTT of the requester can be unknown yet).
+
+// Constants for downloading from many peers
 
-ChatClient::ChatClient() : _sendSocket(_ioService)
+static const size_t FILE_SOURCES_MAX = 8; // peers. Blocks of one download are requested from so many peers at most.
+
+// Constants for downloading changes of files
+
+static const uint32 SIGNATURE_PAGES_IN_FLIGHT = 8; // pages. So many pages of signatures are requested at once.
+
+ChatClient::ChatClient() : _work(_ioService)
+    , _chatStrand(_ioService)
+    , _sendSocket(_ioService)
     , _recvSocket(_ioService)
     , _sendEndpoint(Ipv4Address::broadcast(), Port)
     , _recvEndpoint(Ipv4Address::any(), Port)
     , _runThreads(1)
     , _port(Port)
     , _fileId(0)
+    , _peersTimer(_ioService)
 {
-    Logger::GetInstance()->Trace("Chat client started");
-    // Create handlers
-    Handler::setChatInstance(this);
-    _handlers.resize(LAST + 1);
-    _handlers[M_SYS] = new HandlerSys;
-    _handlers[M_TEXT] = new HandlerText;
-    _handlers[M_FILE_BEGIN] = new HandlerFileInfo;
-    _handlers[M_FILE_BLOCK] = new HandlerFileBlock;
-    _handlers[M_REQ_FOR_FILE_BLOCK] = new HandlerRequestForFileBlock;
-    _handlers[M_PEER_DATA] = new HandlerPeerData;
+    LOG_INFO("Chat client started");
 
     // Set this-peer ip here
     try
@@ -52,15 +68,15 @@ ChatClient::ChatClient() : _sendSocket(_ioService)
 
         IpAddress addr = socket.local_endpoint().address();
         string ipAddr(addr.to_string());
-        Logger::GetInstance()->Trace("Using ip address ", ipAddr);
+        LOG_INFO("Using ip address ", ipAddr);
         _thisPeer.SetIp(ipAddr);
     }
     catch (exception& e)
     {
-        Logger::GetInstance()->Trace(CHAT_ERROR, "Can't get local ip due to ", e.what());
+        LOG_ERROR("Can't get local ip due to ", e.what());
     }
 
-    Logger::GetInstance()->Trace("My peer id: ", _thisPeer.GetId());
+    LOG_INFO("My peer id: ", _thisPeer.GetId());
 
     // Socket for sending
     _sendSocket.open(_sendEndpoint.protocol());
@@ -71,27 +87,29 @@ ChatClient::ChatClient() : _sendSocket(_ioService)
     _recvSocket.open(_recvEndpoint.protocol());
     _recvSocket.set_option(UdpSocket::reuse_address(true));
     _recvSocket.set_option(boost::asio::socket_base::broadcast(true));
+    _recvSocket.set_option(boost::asio::socket_base::receive_buffer_size(RECV_SOCKET_BUFFER));
     _recvSocket.bind(_recvEndpoint);
-    _recvSocket.async_receive_from(
-        boost::asio::buffer(_data), _recvEndpoint,
-        boost::bind(&ChatClient::HandleReceiveFrom, this,
-        boost::asio::placeholders::error,
-        boost::asio::placeholders::bytes_transferred));
+    _recvSocket.non_blocking(true);
+    _recvRing.resize(RECV_BATCH);
+    for (size_t i = 0; i < _recvRing.size(); ++i)
+        _recvRing[i].packet.allocate(PACKET_LARGE);
+    StartReceive();
+
+    // Here we send alive messages and remove peers, which don't answer
+    StartCheckPeers();
 
     /*
-    In this thread io_service is ran
+    In these threads io_service is ran (one thread per core)
     We can't read user's input without it
     */
-    ThreadsMap.insert(pair<string, auto_ptr<Thread>>(BOOST_SERVICE_THREAD,
-        auto_ptr<Thread>(new Thread(boost::bind(&ChatClient::BoostServiceThread, this)))));
-    /*
-    It is our system thread
-    Here we send alive messages, send PeerData messages, track track all downloading files and send a re-send message
-    if time of received block less than sender pointed out
-    */
-    ThreadsMap.insert(pair<string, auto_ptr<Thread>>(FILESWATCHER_THREAD,
-        auto_ptr<Thread>(new Thread(boost::bind(&ChatClient::ServiceFilesWatcher, this)))));
-
+    unsigned threads = max(Thread::hardware_concurrency(), 1u);
+    for (unsigned i = 0; i < threads; ++i)
+    {
+        stringstream name;
+        name << BOOST_SERVICE_THREAD << i;
+        ThreadsMap.insert(pair<string, auto_ptr<Thread>>(name.str(),
+            auto_ptr<Thread>(new Thread(boost::bind(&ChatClient::BoostServiceThread, this)))));
+    }
 }
 
 ChatClient::~ChatClient()
@@ -101,35 +119,44 @@ ChatClient::~ChatClient()
     if (ThreadsMap[LOG_THREAD].get())
         ThreadsMap[LOG_THREAD]->join();
 
-    if (ThreadsMap[FILESWATCHER_THREAD].get())
-        ThreadsMap[FILESWATCHER_THREAD]->join();
-
     _recvSocket.close();
     _sendSocket.close();
     _ioService.stop();
     
-    if (ThreadsMap[BOOST_SERVICE_THREAD].get())
-        ThreadsMap[BOOST_SERVICE_THREAD]->join();
+    for (map<string, auto_ptr<Thread>>::iterator it = ThreadsMap.begin(); it != ThreadsMap.end(); ++it)
+    {
+        if (it->first.compare(0, strlen(BOOST_SERVICE_THREAD), BOOST_SERVICE_THREAD) == 0 && it->second.get())
+            it->second->join();
+    }
     
     ThreadsMap.clear();
 
-    // Delete all downloading and sending files
-
+    // downloads are resumed after the restart, the old copy is put back, if its changes aren't found yet
+    // (the delta is started again, the old copy isn't kept for the next run)
+    // the download is in the map by keys of all its sources, it is visited once (by the key of the first one)
     for (UploadingFilesMap::iterator it = _uploadingFiles.begin(); it != _uploadingFiles.end(); ++it)
-        delete ((*it).second);
-
-    for (SendingFilesMap::iterator it = _sendingFiles.begin(); it != _sendingFiles.end(); ++it)
-        delete ((*it).second);
-
-    // Delete all handlers
+    {
+        UploadingFilesContext* ctx = it->second.get();
+        if (!(it->first == ctx->key))
+            continue;
 
-    for (Handlers::iterator it = _handlers.begin(); it != _handlers.end(); ++it)
-        delete (*it);
+        if (ctx->delta)
+        {
+            ErrorCode ec;
+            ctx->fp.close();
+            boost::filesystem::remove(ctx->name, ec);
+            boost::filesystem::rename(ctx->delta->basis, ctx->name, ec);
+        }
+        else
+        {
+            SaveJournal(ctx);
+        }
+    }
 
-    // Delete all peers
+    // Delete all downloading and sending files
 
-    for (Peers::iterator it = _peersMap.begin(); it != _peersMap.end(); ++it)
-        delete((*it).second);
+    _uploadingFiles.clear();
+    _sendingFiles.clear();
 }
 
 ChatClient& ChatClient::GetInstance()
@@ -147,155 +174,422 @@ void ChatClient::BoostServiceThread()
 {
     ErrorCode ec;
 
-    while (_runThreads)
-    {
-        _ioService.run(ec);
-        _ioService.reset();
-    }
+    // _work keeps it running until the io_service is stopped
+    _ioService.run(ec);
 
     if (ec)
         cout << ec.message();
 }
 
-// Thread function: FILESWATCHER_THREAD
+// peers are checked every second on the chat strand
 
-void ChatClient::ServiceFilesWatcher()
+void ChatClient::StartCheckPeers()
 {
-    stringstream ss;
-    while (_runThreads)
+    _peersTimer.expires_from_now(chrono::seconds(1));
+    _peersTimer.async_wait(_chatStrand.wrap(
+        boost::bind(&ChatClient::CheckPeers, this, boost::asio::placeholders::error)));
+}
+
+void ChatClient::CheckPeers(const ErrorCode& error)
+{
+    if (error)
+        return;
+
     {
-        boost::this_thread::sleep(boost::posix_time::seconds(1));
+        ScopedLock lk(_peersMutex);
+
+        //scan table of peers
+        time_t now = time(0);
+        for (PeerHandle peer = _peers.First(); peer != PEER_NONE; peer = _peers.Next(peer))
         {
-            ScopedLock lk(_filesMutex);
-            
-            //scan map of peers
-            for (Peers::iterator it = _peersMap.begin(); it != _peersMap.end();)
+            if (difftime(now, _peers.GetLastActivity(peer)) <= SECONDS_TO_BE_ALIVE)
+                continue;
+
+            if (!_peers.WasPingSent(peer))
             {
-                Peer* peer = (*it).second;
-                if (difftime(time(0), peer->GetLastActivityCheck()) > SECONDS_TO_BE_ALIVE)
-                {
-                    if (!peer->WasPingSent())
-                    {
-                        Logger::GetInstance()->Trace("Sending ping to peer ", peer->GetId());
-                        SendTo(ParseEpFromString(peer->GetIp()), MessageBuilder::System("ping", _thisPeer.GetId()));
-                        peer->SetPingSent(true);
-                        peer->SetPingSentTime(time(0));
-                        ++it;
-                        continue;
-                    }
-                    else if (difftime(time(0), peer->GetPingSentTime()) > SECONDS_TO_BE_ALIVE)
-                    {
-                        Logger::GetInstance()->Trace("Peer ", peer->GetId(), " don't answer on 'ping'. Removing it from peers map");
-                        wcout << peer->GetNickname();
-                        cout << " left out chat." << endl;
-                        _peersMap.erase(it++);
-                        delete peer;
-                        continue;
-                    }
-                }
-                ++it;
+                LOG_DEBUG("Sending ping to peer ", _peers.GetId(peer));
+                SendTo(ParseEpFromString(_peers.Get(peer).GetIp()), MessageBuilder::System("ping", _thisPeer, _peers.Get(peer).GetVersion()));
+                _peers.SetPingSent(peer, now);
             }
-
-            // scan map with files, that we receive
-            for (UploadingFilesMap::iterator it = _uploadingFiles.begin(); it != _uploadingFiles.end();)
+            else if (difftime(now, _peers.GetPingSentTime(peer)) > SECONDS_TO_BE_ALIVE)
             {
-                UploadingFilesContext * fc = (*it).second;
-                if (fc == 0 || difftime(time(0), fc->ts) <= SECONDS_TO_LOOSE_PACKET)
-                {
-                    ++it;
-                    continue;
-                }
+                LOG_INFO("Peer ", _peers.GetId(peer), " don't answer on 'ping'. Removing it from peers table");
+                wcout << _peers.Get(peer).GetNickname();
+                cout << " left out chat." << endl;
+                _peers.Remove(peer);
+            }
+        }
+    }
 
-                // we have no more attempts to receive ONE block ?
-                if (fc->resendCount >= ATTEMPTS_TO_RECEIVE_BLOCK)
-                {
-                    // delete this download
-                    ss.str(string());
-                    ss << "Download of " << fc->name << " ended with ERROR: peer " << fc->_recvFrom.GetId() << " is offline";
-                    Logger::GetInstance()->Trace(CHAT_ERROR, ss.str());
-                    cout << endl << ss.str() << endl;
-                    _uploadingFiles.erase(it++);
-                    fc->fp.close();
-
-                    // delete the file
-                    ErrorCode ec;
-                    boost::filesystem::path abs_path = boost::filesystem::complete(fc->name);
-                    boost::filesystem::remove(abs_path, ec);
-
-                    delete fc;
-                    continue;
-                }
+    StartCheckPeers();
+}
 
-                // if we have attempts, try again
-                if (fc->blocksReceived > 0)
-                {
-                    ss.str(string());
-                    ss << "File " << fc->name << ": Request dropped packet " << fc->blocksReceived << " from " << fc->blocks;
-                    Logger::GetInstance()->Trace(ss.str());
-                    cout << endl << ss.str() << endl;
-                }
+// wait for the retransmission deadline of the file, that we receive (on the strand of the file)
 
-                fc->resendCount += 1;
-                SendReqForFileBlockMsg(fc);
-                ++it;
-            }
+void ChatClient::StartRetransmitTimer(UploadingFilePtr fc)
+{
+    if (fc->timerWaiting)
+        return;
 
-            // scan map with files, that we send
-            // if M_FI is not sent successfully, then, if we have attempts, send it again
-            for (SendingFilesMap::iterator it = _sendingFiles.begin(); it != _sendingFiles.end();)
-            {
-                SendingFilesContext * fsc = (*it).second;
-                if (fsc == 0 || fsc->firstBlockSent || difftime(time(0), fsc->ts) <= SECONDS_TO_WAIT_ANSWER_ON_MFI)
-                {
-                    ++it;
-                    continue;
-                }
+    fc->timerWaiting = true;
+    fc->retransmitTimer.expires_at(fc->retransmitAt);
+    fc->retransmitTimer.async_wait(fc->strand.wrap(
+        boost::bind(&ChatClient::CheckUploadingFile, this, fc, boost::asio::placeholders::error)));
+}
 
-                // if we have no more attempts
-                if (fsc->resendCount >= ATTEMPTS_TO_SEND_FIRST_M)
-                {
-                    // delete this download
-                    ss.str(string());
-                    ss << "Sending of ", fsc->path, " ended with ERROR: Peer doesn't request the first block";
-                    Logger::GetInstance()->Trace(CHAT_ERROR, ss.str());
-                    cout << endl << ss.str() << endl;
-                    _sendingFiles.erase(it++);
-                    delete fsc;
-                    continue;
-                }
+// check file, that we receive: maybe we lost its blocks
+// every source has its own deadline: blocks of the source, which doesn't answer, are requested again
+// (from other sources, if they answer), the source, which doesn't answer for too long, is dropped
 
-                // send again
+void ChatClient::CheckUploadingFile(UploadingFilePtr fc, const ErrorCode& error)
+{
+    fc->timerWaiting = false;
 
-                fsc->resendCount += 1;
-                SendFileInfoMsg(fsc);
-                ++it;
-            }
+    if (error || FindUploadingFile(fc->key) != fc)
+        return;
+
+    // signatures of blocks are downloaded first
+    TimePoint now = Clock::now();
+    if (fc->delta)
+    {
+        CheckSignatures(fc, now);
+        return;
+    }
+
+    // blocks were received after the timer had been started, so the deadline is moved
+    fc->retransmitAt = RetransmitDeadline(fc.get(), now);
+    if (now < fc->retransmitAt)
+    {
+        StartRetransmitTimer(fc);
+        return;
+    }
+
+    stringstream ss;
+    vector<bool> expired(fc->sources.size(), false);
+    bool active = false;
+
+    for (size_t i = 0; i < fc->sources.size(); ++i)
+    {
+        FileSource& source = fc->sources[i];
+        if (!source.active)
+            continue;
+        if (source.inFlight == 0 || now < source.retransmitAt)
+        {
+            active = true;
+            continue;
+        }
+
+        expired[i] = true;
+
+        bool left;
+        {
+            ScopedLock lk(_peersMutex);
+            left = !_peers.IsValid(source.peer);
+        }
+
+        // it has left the chat or we have received nothing from it for too long?
+        if ((left && fc->sources.size() > 1) || now - source.lastReceived > chrono::seconds(SECONDS_TO_RECEIVE_BLOCK))
+        {
+            source.active = false;
+            LOG_INFO("File ", fc->name, ": source ", source.endpoint.address().to_string(), " is offline");
+            continue;
+        }
+
+        // try again (timeouts are frequent on lossy links, so they go only to the log)
+        if (fc->blocksReceived > 0)
+            LOG_DEBUG("File ", fc->name, ": Request dropped packet ", fc->firstMissing, " from ", fc->blocks);
+
+        // shrink the window and wait longer
+        source.silent = true;
+        source.congestion.OnLoss();
+        source.rtt.Backoff();
+        source.retransmitAt = now + source.rtt.GetRto();
+        active = true;
+    }
+
+    // all sources are offline?
+    if (!active)
+    {
+        // stop this download
+        ss << "Download of " << fc->name << " ended with ERROR: peer ";
+        {
+            ScopedLock lk(_peersMutex);
+            if (_peers.IsValid(fc->sources[0].peer))
+                ss << _peers.GetId(fc->sources[0].peer) << " ";
+        }
+        ss << "is offline";
+        LOG_ERROR(ss.str());
+        cout << endl << ss.str() << endl;
+        StopUploadingFile(fc.get());
+
+        // received blocks are kept for the next try (the file is deleted, if the sender can't resume it)
+        if (fc->identity.IsKnown())
+        {
+            SaveJournal(fc.get());
+            fc->fp.close();
+            cout << "It will be resumed, when the file is sent again" << endl;
+        }
+        else
+        {
+            fc->fp.close();
+            ErrorCode ec;
+            boost::filesystem::path abs_path = boost::filesystem::complete(fc->name);
+            boost::filesystem::remove(abs_path, ec);
         }
+        return;
     }
+
+    // request only the holes
+    SendReqForLostBlocksMsg(fc.get(), expired);
+
+    fc->retransmitAt = RetransmitDeadline(fc.get(), now);
+    StartRetransmitTimer(fc);
 }
 
-// async reading handler (udp socket)
-void ChatClient::HandleReceiveFrom(const ErrorCode& err, size_t size)
+// wait for the first request of the file, that we send (on the strand of the file)
+
+void ChatClient::StartFileInfoTimer(SendingFilePtr fsc)
 {
-    if (err)
+    fsc->retransmitTimer.expires_from_now(fsc->rtt.GetRto());
+    fsc->retransmitTimer.async_wait(fsc->strand.wrap(
+        boost::bind(&ChatClient::CheckSendingFile, this, fsc, boost::asio::placeholders::error)));
+}
+
+// check file, that we send
+// if M_FI is not sent successfully, then, if we have attempts, send it again
+// M_FI, which is sent to all, is repeated anyway: one request doesn't mean, that every peer has got it
+
+void ChatClient::CheckSendingFile(SendingFilePtr fsc, const ErrorCode& error)
+{
+    if (error || FindSendingFile(fsc->id) != fsc || (fsc->requested && !fsc->broadcast))
         return;
 
-    // parse received packet
-    MessageSystem * pmsys = (MessageSystem*)_data.data();
-    if (pmsys->_code <= LAST)
+    // if we have no more attempts
+    if (fsc->resendCount >= ATTEMPTS_TO_SEND_FIRST_M)
     {
+        if (fsc->requested)
+            return;
+
+        // the peer has finished the download or has enough sources
+        if (fsc->offered)
+        {
+            LOG_DEBUG("Offer of ", fsc->path, " isn't accepted");
+            ScopedLock lk(_filesMutex);
+            _sendingFiles.erase(fsc->id);
+            return;
+        }
+
+        // delete this download
+        stringstream ss;
+        ss << "Sending of " << fsc->path << " ended with ERROR: Peer doesn't request the first block";
+        LOG_ERROR(ss.str());
+        cout << endl << ss.str() << endl;
         ScopedLock lk(_filesMutex);
-        (_handlers[pmsys->_code])->handle(_data.data(), size);
+        _sendingFiles.erase(fsc->id);
+        return;
+    }
+
+    // send again
+
+    // repeats of the requested M_FI aren't backed off: they are for late peers
+    fsc->resendCount += 1;
+    if (!fsc->requested)
+        fsc->rtt.Backoff();
+    SendFileInfoMsg(fsc);
+}
+
+// unmap the file, which isn't requested for a while (the receiver can request blocks later, the file is mapped again)
+
+void ChatClient::StartIdleTimer(SendingFilePtr fsc)
+{
+    fsc->idleTimer.expires_at(fsc->lastRequest + chrono::seconds(SECONDS_TO_KEEP_MAPPING));
+    fsc->idleTimer.async_wait(fsc->strand.wrap(
+        boost::bind(&ChatClient::CheckIdleFile, this, fsc, boost::asio::placeholders::error)));
+}
+
+void ChatClient::CheckIdleFile(SendingFilePtr fsc, const ErrorCode& error)
+{
+    if (error || FindSendingFile(fsc->id) != fsc)
+        return;
+
+    // requested blocks are still being sent
+    TimePoint now = Clock::now();
+    if (!fsc->queue.empty() || fsc->pacing)
+    {
+        fsc->lastRequest = now;
     }
+    else if (now - fsc->lastRequest >= chrono::seconds(SECONDS_TO_KEEP_MAPPING))
+    {
+        LOG_DEBUG("File ", fsc->path, " isn't requested, it is unmapped");
+        UnmapSendingFile(fsc.get());
+        return;
+    }
+
+    StartIdleTimer(fsc);
+}
+
+// wait until the socket has datagrams (they are read by HandleReceiveFrom)
 
-    // wait for the next message
-    _recvSocket.async_receive_from(
-        boost::asio::buffer(_data), _recvEndpoint,
+void ChatClient::StartReceive()
+{
+    _recvSocket.async_receive(boost::asio::null_buffers(),
         boost::bind(&ChatClient::HandleReceiveFrom, this,
         boost::asio::placeholders::error,
         boost::asio::placeholders::bytes_transferred));
 }
 
+// async reading handler (udp socket)
+// only one read is waited at once, so the ring is used by one thread
+void ChatClient::HandleReceiveFrom(const ErrorCode& err, size_t)
+{
+    if (err)
+        return;
+
+    // drain the socket while it has datagrams
+    for (size_t count = ReceiveBatch(); count > 0; count = ReceiveBatch())
+    {
+        for (size_t i = 0; i < count; ++i)
+            Dispatch(_recvRing[i]);
+
+        if (count < _recvRing.size())
+            break;
+    }
+
+    // wait for the next messages
+    StartReceive();
+}
+
+// pass received packet to its handler on the strand of the handler
+
+void ChatClient::Dispatch(ReceivedDatagram& datagram)
+{
+    // parse received packet
+    MessageSystem * pmsys = (MessageSystem*)datagram.packet.data();
+    if (datagram.size == 0 || (pmsys->_code & ~M_V2) > LAST)
+        return;
+
+    const MessageHandler* handler = &_handlers[pmsys->_code & ~M_V2];
+
+    // the ring is filled by the next read, so the handler gets its own buffer of the pool (v2 message is unpacked into it)
+    Packet packet;
+
+    // broken datagram of any peer is dropped here, nothing is thrown to the thread of the service
+    try
+    {
+        if (pmsys->_code & M_V2)
+        {
+            if (datagram.size < SZ_MESSAGE_V2_HEADER)
+                return;
+
+            uint32 token = MessageBuilder::Token(datagram.packet.data() + sizeof(uint8));
+            char peerId[PEER_ID_SIZE + 1];
+            if (token == _thisPeer.GetToken())
+            {
+                memcpy(peerId, _thisPeer.GetId().c_str(), sizeof(peerId));
+            }
+            else
+            {
+                ScopedLock lk(_peersMutex);
+                PeerHandle peer = _peers.FindByToken(token);
+                if (peer == PEER_NONE)
+                {
+                    LOG_DEBUG("Received message from unknown token ", token);
+                    return;
+                }
+                memcpy(peerId, _peers.GetId(peer), sizeof(peerId));
+            }
+
+            if (!MessageBuilder::UnpackV2(datagram.packet.data(), datagram.size, peerId, packet))
+            {
+                LOG_DEBUG("Received broken message from peer ", peerId);
+                return;
+            }
+        }
+        else if (datagram.size <= PACKET_SMALL)
+        {
+            packet.append(datagram.packet.data(), datagram.size);
+        }
+        else
+        {
+            // large datagram isn't copied: its buffer is handed over, the ring gets a new one
+            packet = datagram.packet;
+            packet.resize(datagram.size);
+            datagram.packet.allocate(PACKET_LARGE);
+        }
+
+        // the only check of the length: handlers read fields of the message without it
+        if (!handler->validate(packet.data(), packet.size()))
+        {
+            LOG_DEBUG("Received truncated message ", (int)(uint8)pmsys->_code, " (", datagram.size, " bytes)");
+            return;
+        }
+    }
+    catch (const exception& e)
+    {
+        LOG_DEBUG("Received message ", (int)(uint8)pmsys->_code, " (", datagram.size, " bytes) is dropped: ", e.what());
+        return;
+    }
+
+    handler->route(this, packet.data(), packet.size(), datagram.from).post(
+        boost::bind(&ChatClient::HandlePacket, this, handler, packet, datagram.from));
+}
+
+void ChatClient::HandlePacket(const MessageHandler* handler, Packet packet, const UdpEndpoint& from)
+{
+    handler->handle(this, packet.data(), packet.size(), from);
+}
+
+// read as many datagrams as the ring can hold without blocking, returns quantity of read datagrams
+
+#ifdef __linux__
+size_t ChatClient::ReceiveBatch()
+{
+    mmsghdr headers[RECV_BATCH];
+    iovec vectors[RECV_BATCH];
+    sockaddr_storage addresses[RECV_BATCH];
+
+    memset(headers, 0, sizeof(headers));
+    for (size_t i = 0; i < _recvRing.size(); ++i)
+    {
+        vectors[i].iov_base = _recvRing[i].packet.data();
+        vectors[i].iov_len = _recvRing[i].packet.size();
+        headers[i].msg_hdr.msg_iov = &vectors[i];
+        headers[i].msg_hdr.msg_iovlen = 1;
+        headers[i].msg_hdr.msg_name = &addresses[i];
+        headers[i].msg_hdr.msg_namelen = sizeof(addresses[i]);
+    }
+
+    int count = recvmmsg(_recvSocket.native_handle(), headers, (unsigned)_recvRing.size(), MSG_DONTWAIT, 0);
+    if (count <= 0)
+        return 0;
+
+    for (int i = 0; i < count; ++i)
+    {
+        ReceivedDatagram& datagram = _recvRing[i];
+        datagram.size = headers[i].msg_len;
+        datagram.from.resize(headers[i].msg_hdr.msg_namelen);
+        memcpy(datagram.from.data(), &addresses[i], headers[i].msg_hdr.msg_namelen);
+    }
+
+    return (size_t)count;
+}
+#else
+size_t ChatClient::ReceiveBatch()
+{
+    size_t count = 0;
+    for (; count < _recvRing.size(); ++count)
+    {
+        ErrorCode ec;
+        ReceivedDatagram& datagram = _recvRing[count];
+        datagram.size = _recvSocket.receive_from(boost::asio::buffer(datagram.packet.data(), datagram.packet.size()), datagram.from, 0, ec);
+        if (ec)
+            break;
+    }
+
+    return count;
+}
+#endif
+
 // try to understand user's input
 void ChatClient::ParseUserInput(const wstring& data)
 {
@@ -320,12 +614,12 @@ void ChatClient::ParseUserInput(const wstring& data)
             else
             {
                 string ip = to_string(nickOrIp);
-                ScopedLock lk(_filesMutex);
+                ScopedLock lk(_peersMutex);
                 if (IsIpV4(ip))
-                    SendText(ParseEpFromString(ip), msg);
+                    SendText(ParseEpFromString(ip), msg, PeerVersion(ip));
                 else
                 {
-                    vector<Peer*> peers = ProcessNick(nickOrIp);
+                    vector<PeerHandle> peers = ProcessNick(nickOrIp);
                     if (peers.size() == 0)
                     {
                         cout << "\nThere is no peer ";
@@ -333,14 +627,15 @@ void ChatClient::ParseUserInput(const wstring& data)
                     }                        
                     else if (peers.size() == 1)
                     {
-                        SendText(ParseEpFromString(peers[0]->GetIp()), msg);
+                        const Peer& peer = _peers.Get(peers[0]);
+                        SendText(ParseEpFromString(peer.GetIp()), msg, peer.GetVersion());
                     }
                     else
                     {
                         cout << "\nThere are several peers with nick ";
                         wcout << nickOrIp << "!" << endl;
                         for (size_t i = 0; i < peers.size(); i++)
-                            cout << "\nPeer " << i << ": " << peers[i]->GetIp();
+                            cout << "\nPeer " << i << ": " << _peers.Get(peers[i]).GetIp();
                         cout << "\nTry to send a PM directly using peer's ip." << endl;
                     }
                 }
@@ -359,15 +654,25 @@ void ChatClient::ParseUserInput(const wstring& data)
             {
                 throw logic_error("invalid format.");
             }
+            else if (nickOrIp == L"all")
+            {
+                // blocks are sent once on broadcast address, every peer requests its own missing ones
+                uint8 version;
+                {
+                    ScopedLock lk(_peersMutex);
+                    version = BroadcastVersion();
+                }
+                SendFile(_sendEndpoint, path, version, true);
+            }
             else
             {
                 string ip = to_string(nickOrIp);
-                ScopedLock lk(_filesMutex);
+                ScopedLock lk(_peersMutex);
                 if (IsIpV4(ip))
-                    SendFile(ParseEpFromString(ip), path);
+                    SendFile(ParseEpFromString(ip), path, PeerVersion(ip), false);
                 else
                 {
-                    vector<Peer*> peers = ProcessNick(nickOrIp);
+                    vector<PeerHandle> peers = ProcessNick(nickOrIp);
                     if (peers.size() == 0)
                     {
                         cout << "\nThere is no peer ";
@@ -375,14 +680,15 @@ void ChatClient::ParseUserInput(const wstring& data)
                     }
                     else if (peers.size() == 1)
                     {
-                        SendFile(ParseEpFromString(peers[0]->GetIp()), path);
+                        const Peer& peer = _peers.Get(peers[0]);
+                        SendFile(ParseEpFromString(peer.GetIp()), path, peer.GetVersion(), false);
                     }
                     else
                     {
                         cout << "\nThere are several peers with nick ";
                         wcout << nickOrIp << "!" << endl;
                         for (size_t i = 0; i < peers.size(); i++)
-                            cout << "\nPeer " << i << ": " << peers[i]->GetIp();
+                            cout << "\nPeer " << i << ": " << _peers.Get(peers[i]).GetIp();
                         cout << "\nTry to send a file directly using peer's ip." << endl;
                     }
                 }
@@ -395,7 +701,12 @@ void ChatClient::ParseUserInput(const wstring& data)
         return;
 
     // send on broadcast address
-    SendText(_sendEndpoint, tmp);
+    uint8 version;
+    {
+        ScopedLock lk(_peersMutex);
+        version = BroadcastVersion();
+    }
+    SendText(_sendEndpoint, tmp, version);
 }
 
 // get endpoint from string
@@ -431,16 +742,62 @@ void ChatClient::ParseTwoStrings(const wstring& str, wstring& s1, wstring& s2)
     s2 = str.substr(t + 1);
 }
 
-// returns a vector of pointers to Peers which have the processable nick
+// version of messages for the peer with this ip (v1 for unknown peers)
 
-vector<Peer*> ChatClient::ProcessNick(const wstring& nick)
+uint8 ChatClient::PeerVersion(const string& ip)
 {
-    vector<Peer*> peers;
-    Peer* peer;
-    for (Peers::const_iterator it = _peersMap.begin(); it != _peersMap.end(); it++)
+    PeerHandle peer = _peers.FindByIp(ip);
+    return peer != PEER_NONE ? _peers.Get(peer).GetVersion() : PROTOCOL_V1;
+}
+
+// broadcast messages must be understood by all peers
+
+uint8 ChatClient::BroadcastVersion()
+{
+    if (_peers.Empty())
+        return PROTOCOL_V1;
+
+    uint8 version = PROTOCOL_VERSION;
+    for (PeerHandle peer = _peers.First(); peer != PEER_NONE; peer = _peers.Next(peer))
+        version = min(version, _peers.Get(peer).GetVersion());
+
+    return version;
+}
+
+// is it our own message (we receive our broadcasts)?
+
+bool ChatClient::IsThisPeer(cc_string peerId) const
+{
+    const string& id = _thisPeer.GetId();
+    return strnlen(peerId, PEER_ID_SIZE + 1) == id.size() && memcmp(peerId, id.data(), id.size()) == 0;
+}
+
+// peer, which has sent the message, is alive. PEER_NONE for our own and unknown peers
+
+PeerHandle ChatClient::FindSender(cc_string peerId, cc_string what)
+{
+    if (IsThisPeer(peerId))
+        return PEER_NONE;
+
+    PeerHandle peer = _peers.Find(peerId);
+    if (peer == PEER_NONE)
+    {
+        LOG_DEBUG("Received ", what, " from unknown peer ", string(peerId, strnlen(peerId, PEER_ID_SIZE + 1)));
+        return PEER_NONE;
+    }
+
+    _peers.Touch(peer, time(0));
+    return peer;
+}
+
+// returns a vector of handles of peers which have the processable nick
+
+vector<PeerHandle> ChatClient::ProcessNick(const wstring& nick)
+{
+    vector<PeerHandle> peers;
+    for (PeerHandle peer = _peers.First(); peer != PEER_NONE; peer = _peers.Next(peer))
     {
-        peer = (*it).second;
-        if (nick == peer->GetNickname())
+        if (nick == _peers.Get(peer).GetNickname())
             peers.push_back(peer);
     }
 
@@ -467,6 +824,7 @@ int ChatClient::loop()
         cout << "3. sending file:" << endl;
         cout << "\tfile [nickname] [path]" << endl;
         cout << "\tfile [ip] [path]" << endl;
+        cout << "\tfile all [path]" << endl;
         wstring nick;
         do 
         {
@@ -476,7 +834,7 @@ int ChatClient::loop()
         } while (nick.empty());
         _thisPeer.SetNickname(nick);
 
-        SendPeerDataMsg(_sendEndpoint, _thisPeer.GetNickname(), _thisPeer.GetId());
+        SendPeerDataMsg(_sendEndpoint);
 
         for (wstring line;;)
         {
@@ -497,8 +855,13 @@ int ChatClient::loop()
                 continue;
             else if (line.compare(L"quit") == 0)
             {
-                Logger::GetInstance()->Trace("Shutdown");
-                SendSystemMsg(_sendEndpoint, "quit");
+                LOG_INFO("Shutdown");
+                uint8 version;
+                {
+                    ScopedLock lk(_peersMutex);
+                    version = BroadcastVersion();
+                }
+                SendSystemMsg(_sendEndpoint, "quit", version);
                 _runThreads = 0;
                 break;
             }
@@ -523,82 +886,261 @@ int ChatClient::loop()
 
 // system message
 
-void ChatClient::SendSystemMsg(const UdpEndpoint& endpoint, cc_string action)
+void ChatClient::SendSystemMsg(const UdpEndpoint& endpoint, cc_string action, uint8 version)
 {
-    ScopedLock lk(_filesMutex);
-    SendTo(endpoint, MessageBuilder::System(action, _thisPeer.GetId()));
+    SendTo(endpoint, MessageBuilder::System(action, _thisPeer, version));
 }
 
-void ChatClient::SendPeerDataMsg(const UdpEndpoint& endpoint, const wstring& nick, const string&id)
+void ChatClient::SendPeerDataMsg(const UdpEndpoint& endpoint)
 {
-    ScopedLock lk(_filesMutex);
-    SendTo(endpoint, MessageBuilder::PeerData(nick, id));
+    SendTo(endpoint, MessageBuilder::PeerData(_thisPeer));
 }
 
 // text message
 
-void ChatClient::SendText(const UdpEndpoint& endpoint, const wstring& msg)
+void ChatClient::SendText(const UdpEndpoint& endpoint, const wstring& msg, uint8 version)
 {
-    SendTo(endpoint, MessageBuilder::Text(msg, _thisPeer.GetId()));
+    SendTo(endpoint, MessageBuilder::Text(msg, _thisPeer, version));
 }
 
 // send file message
 
-void ChatClient::SendFile(const UdpEndpoint& endpoint, const wstring& path)
+void ChatClient::SendFile(const UdpEndpoint& endpoint, const wstring& path, uint8 version, bool broadcast)
 {
     string filePath(path.begin(), path.end());
 
-    ifstream input;
-    input.open(filePath.c_str(), ifstream::in | ios_base::binary);
-    if (!input.is_open())
-    {
-        cerr << "\nError! Can't open file " << filePath << endl;
-
-        input.close();
-
+    SendingFilePtr fsc = OpenSendingFile(endpoint, filePath, version);
+    if (!fsc)
         return;
-    }
-    input.close();
 
-    // add to sent-files map
-    SendingFilesContext * fsc = new SendingFilesContext;
+    fsc->broadcast = broadcast;
+    if (broadcast)
+        fsc->sentAt.assign(fsc->totalBlocks, TimePoint());
 
-    fsc->firstBlockSent = false;
-    fsc->totalBlocks = 0;
-    fsc->id = _fileId;
-    fsc->path = filePath;
+    LOG_INFO("Start sending file ", filePath);
+    cout << "\nStart sending file" << endl;
+    AddSendingFile(fsc);
+}
+
+// offer the file to the peer, which downloads the same content from others (the content is checked first)
+
+void ChatClient::OfferFile(const UdpEndpoint& endpoint, const string& path, uint8 version, uint64 content)
+{
+    SendingFilePtr fsc = OpenSendingFile(endpoint, path, version);
+    if (!fsc)
+        return;
+
+    fsc->offered = true;
+    fsc->content = content;
+
+    LOG_INFO("Offer file ", path, " to ", endpoint.address().to_string());
+    AddSendingFile(fsc);
+}
+
+// open and map the file once, blocks are read from the mapping while the file is sending
+
+ChatClient::SendingFilePtr ChatClient::OpenSendingFile(const UdpEndpoint& endpoint, const string& filePath, uint8 version)
+{
+    SendingFilePtr fsc(new SendingFilesContext(_ioService));
+
+    ErrorCode ec;
+    fsc->path = filePath;
+    fsc->size = boost::filesystem::file_size(filePath, ec);
+    if (ec || !MapSendingFile(fsc.get()))
+    {
+        cerr << "\nError! Can't open file " << filePath << endl;
+        return SendingFilePtr();
+    }
+
+    // identity of the file: the receiver resumes the download, if it has received a part of this file before
+    time_t lastWrite = boost::filesystem::last_write_time(filePath, ec);
+    fsc->identity = TransferJournal::Identify((cc_string)fsc->region.get_address(), fsc->size, lastWrite);
+
+    fsc->requested = false;
+    fsc->totalBlocks = (uint32)(fsc->size / FILE_BLOCK_MAX);
+    if (fsc->size % FILE_BLOCK_MAX)
+        fsc->totalBlocks += 1;
+    fsc->queue.set_capacity(fsc->totalBlocks);
+    fsc->queued.assign(fsc->totalBlocks, false);
+    fsc->codec = 0;
+    fsc->incompressible.assign(fsc->totalBlocks, false);
+    fsc->compressFails = 0;
+    fsc->compressPause = 0;
+    fsc->loss = 0;
+    fsc->broadcast = false;
+    fsc->content = 0;
+    fsc->offered = false;
+    fsc->version = version;
     fsc->endpoint = endpoint;
     fsc->endpoint.port(_port);
     fsc->resendCount = 0;
-    fsc->ts = 0;
-    _sendingFiles[_fileId] = fsc;
-    _fileId += 1;
+    return fsc;
+}
 
-    Logger::GetInstance()->Trace("Start sending file ", filePath);
-    cout << "\nStart sending file" << endl;
-    SendFileInfoMsg(fsc);
+// map the whole file for reading (empty file isn't mapped)
+
+bool ChatClient::MapSendingFile(SendingFilesContext* ctx)
+{
+    if (ctx->size == 0 || ctx->region.get_address() != 0)
+        return true;
+
+    try
+    {
+        FileMapping file(ctx->path.c_str(), boost::interprocess::read_only);
+        MappedRegion region(file, boost::interprocess::read_only);
+        ctx->file.swap(file);
+        ctx->region.swap(region);
+    }
+    catch (const boost::interprocess::interprocess_exception& e)
+    {
+        LOG_ERROR("Can't map file ", ctx->path, ": ", e.what());
+        return false;
+    }
+    return true;
+}
+
+void ChatClient::UnmapSendingFile(SendingFilesContext* ctx)
+{
+    MappedRegion region;
+    FileMapping file;
+    ctx->region.swap(region);
+    ctx->file.swap(file);
 }
 
-// make and send block of file
+// every request of the file comes here (on its strand): the file is mapped again after a pause,
+// if it isn't changed since it was announced
 
-void ChatClient::SendFileInfoMsg(SendingFilesContext * ctx)
+bool ChatClient::ResumeSendingFile(SendingFilePtr ctx)
 {
-    string fileName(ctx->path.begin(), ctx->path.end());
+    ctx->lastRequest = Clock::now();
+    bool unmapped = ctx->size > 0 && ctx->region.get_address() == 0;
+
+    if (unmapped)
+    {
+        ErrorCode ec;
+        uint64 size = boost::filesystem::file_size(ctx->path, ec);
+        time_t lastWrite = ec ? 0 : boost::filesystem::last_write_time(ctx->path, ec);
+        if (ec || size != ctx->size || !MapSendingFile(ctx.get())
+            || !(TransferJournal::Identify((cc_string)ctx->region.get_address(), size, lastWrite) == ctx->identity))
+        {
+            LOG_INFO("File ", ctx->path, " is changed or removed, it isn't sent anymore");
+            {
+                ScopedLock lk(_filesMutex);
+                _sendingFiles.erase(ctx->id);
+                SharedFilesMap::iterator shared = _sharedFiles.find(ctx->content);
+                if (shared != _sharedFiles.end() && shared->second.path == ctx->path)
+                    _sharedFiles.erase(shared);
+            }
+            ReleaseSendingFile(ctx);
+            return false;
+        }
+        LOG_DEBUG("File ", ctx->path, " is requested again, it is mapped");
+    }
+
+    // the timer is started by the first request and after every mapping
+    if (unmapped || !ctx->requested)
+        StartIdleTimer(ctx);
+    return true;
+}
+
+// the receiver has got the file: the file, which is sent to this peer only, is closed at once
+// (the file, which is sent to all, is unmapped by the idle timer)
+
+void ChatClient::CloseSendingFile(uint32 id, const UdpEndpoint& from)
+{
+    SendingFilePtr fsc;
+    {
+        ScopedLock lk(_filesMutex);
+        SendingFilesMap::iterator it = _sendingFiles.find(id);
+        if (it == _sendingFiles.end() || it->second->broadcast || it->second->endpoint.address() != from.address())
+            return;
+        fsc = it->second;
+        _sendingFiles.erase(it);
+    }
 
-    ifstream input;
-    input.open(fileName.c_str(), ifstream::in | ios_base::binary);
-    if (!input.is_open())
-        throw logic_error("Can't open file!");
+    LOG_DEBUG("Sending of ", fsc->path, " is finished, the file is closed");
+    fsc->strand.post(boost::bind(&ChatClient::ReleaseSendingFile, this, fsc));
+}
+
+// timers hold the context (and the mapping), they are cancelled on the strand of the file
+
+void ChatClient::ReleaseSendingFile(SendingFilePtr ctx)
+{
+    ErrorCode ec;
+    ctx->retransmitTimer.cancel(ec);
+    ctx->pacingTimer.cancel(ec);
+    ctx->idleTimer.cancel(ec);
+    UnmapSendingFile(ctx.get());
+}
+
+// add to sent-files map (fields, which are read by other strands, are filled already)
+
+void ChatClient::AddSendingFile(SendingFilePtr fsc)
+{
+    {
+        ScopedLock lk(_filesMutex);
+        fsc->id = _fileId;
+        _sendingFiles[_fileId] = fsc;
+        _fileId += 1;
+    }
+
+    fsc->strand.post(boost::bind(&ChatClient::StartSendingFile, this, fsc));
+}
 
-    // count quantity of blocks
-    uint32 blocks = 0;
-    input.seekg(0, ifstream::end);
-    blocks = (uint32)(input.tellg() / FILE_BLOCK_MAX);
-    if (input.tellg() % FILE_BLOCK_MAX)
-        blocks += 1;
+// CRC of blocks and of the whole file are computed by one pass, before the file is announced (on the strand of the file)
+// (the pass reads the file into the cache, blocks are sent from it later)
+// the content is hashed by CRCs of blocks: the sent file is shared with peers, which download it later,
+// the offered file is checked (it could be changed since it was downloaded)
 
-    input.close();
-    ctx->totalBlocks = blocks;
+void ChatClient::StartSendingFile(SendingFilePtr ctx)
+{
+    cc_string file = (cc_string)ctx->region.get_address();
+    uint32 shift = Crc32c::Shift(FILE_BLOCK_MAX);
+
+    ctx->blockCrcs.resize(ctx->totalBlocks);
+    ctx->crc = 0;
+    for (uint32 block = 0; block < ctx->totalBlocks; ++block)
+    {
+        uint64_t offset = (uint64_t)block * FILE_BLOCK_MAX;
+        uint32 size = (uint32)min<uint64_t>(FILE_BLOCK_MAX, ctx->size - offset);
+        ctx->blockCrcs[block] = Crc32c::Compute(file + offset, size);
+
+        // the last block can be shorter
+        if (size == FILE_BLOCK_MAX)
+            ctx->crc = Crc32c::Multiply(ctx->crc, shift) ^ ctx->blockCrcs[block];
+        else
+            ctx->crc = Crc32c::Combine(ctx->crc, ctx->blockCrcs[block], size);
+    }
+
+    uint64 content = TransferJournal::HashContent(ctx->size, ctx->blockCrcs);
+    if (ctx->offered && content != ctx->content)
+    {
+        LOG_INFO("File ", ctx->path, " is changed, it isn't offered anymore");
+        ScopedLock lk(_filesMutex);
+        _sharedFiles.erase(ctx->content);
+        _sendingFiles.erase(ctx->id);
+        return;
+    }
+
+    ctx->content = content;
+    if (!ctx->offered)
+    {
+        SharedFile shared;
+        shared.size = ctx->size;
+        shared.crc = ctx->crc;
+        shared.path = ctx->path;
+        ScopedLock lk(_filesMutex);
+        _sharedFiles[content] = shared;
+    }
+
+    SendFileInfoMsg(ctx);
+}
+
+// make and send message with file information
+
+void ChatClient::SendFileInfoMsg(SendingFilePtr ctx)
+{
+    string fileName(ctx->path.begin(), ctx->path.end());
 
     // cut path (send just name)
 
@@ -608,20 +1150,798 @@ void ChatClient::SendFileInfoMsg(SendingFilesContext * ctx)
 
     // make packet and send M_FI
 
-    SendTo(ctx->endpoint, MessageBuilder::FileBegin(ctx->id, ctx->totalBlocks, fileName, _thisPeer.GetId()));
-
-    ctx->ts = time(0);
+    FileExtensions extensions;
+    extensions.identity = ctx->identity;
+    extensions.crc = ctx->crc;
+    extensions.crcKnown = true;
+    // old peers can't unpack blocks, and the block sent to all is the same for every peer
+    extensions.codecs = COMPRESS_FILE_BLOCKS == 1 && !ctx->broadcast ? FILE_CODEC_LZ4 : 0;
+    extensions.content = ctx->content;
+    extensions.source = ctx->offered;
+    extensions.signatures = DELTA_FILE_BLOCKS == 1 && !ctx->offered;
+    SendTo(ctx->endpoint, MessageBuilder::FileBegin(ctx->id, ctx->totalBlocks, fileName, extensions, _thisPeer, ctx->version));
+
+    StartFileInfoTimer(ctx);
 }
 
-// make and send message with request of re-sending file block
+// make and send messages with request of file blocks (until windows of sources are full)
+// every source gets the next blocks in a row, so its request has few ranges
+// blocks of the resumed download, which are on the disk already, are skipped
 
 void ChatClient::SendReqForFileBlockMsg(UploadingFilesContext* ctx)
 {
-    SendTo(ctx->endpoint, MessageBuilder::RequestForFileBlock(
-        ctx->id, ctx->blocksReceived, _thisPeer.GetId()));
+    // blocks, which the old copy has, aren't known yet
+    if (ctx->delta)
+        return;
+
+    // blocks of the old copy (or of the journal) are skipped, the first missing one can be after the next one
+    ctx->nextBlock = max(ctx->nextBlock, ctx->firstMissing);
+
+    TimePoint now = Clock::now();
+
+    for (size_t i = 0; i < ctx->sources.size(); ++i)
+    {
+        FileSource& source = ctx->sources[i];
+        if (!source.active)
+            continue;
+
+        // the source, which doesn't answer, is probed by one block (other blocks aren't stuck on it)
+        uint32 window = source.silent ? 1 : source.congestion.GetWindow();
+        uint32 inFlight = source.inFlight;
+        BlockRanges& ranges = ctx->ranges;
+        ranges.clear();
+        while (ctx->nextBlock < ctx->blocks && ctx->nextBlock - ctx->firstMissing < FILE_WINDOW_MAX && source.inFlight < window)
+        {
+            uint32 block = ctx->nextBlock++;
+            if (ctx->received[block])
+                continue;
+
+            ctx->requestedAt[block % FILE_WINDOW_MAX] = now;
+            ctx->requestedFrom[block % FILE_WINDOW_MAX] = (uint8)i;
+            source.inFlight += 1;
+            if (!ranges.empty() && ranges.back().second + 1 == block)
+                ranges.back().second = block;
+            else
+                ranges.push_back(make_pair(block, block));
+        }
+
+        if (ranges.empty())
+            continue;
+
+        // the source has waited without requests, its deadline starts now
+        if (inFlight == 0)
+        {
+            if (!source.silent)
+                source.lastReceived = now;
+            source.retransmitAt = now + source.rtt.GetRto();
+        }
+
+        for (size_t r = 0; r < ranges.size(); ++r)
+            source.loss.OnRequested(ranges[r].second - ranges[r].first + 1);
+
+        SendReqToSource(source, ranges);
+    }
+}
+
+// make and send messages with requests of re-sending lost file blocks (holes of the expired or offline sources)
+// they are requested from the source, which answers and has the most room in its window (or from the same one)
+// holes are losses: after the first of them the last blocks are kept for recovery by the parity
+
+void ChatClient::SendReqForLostBlocksMsg(UploadingFilesContext* ctx, const vector<bool>& expired)
+{
+    TimePoint now = Clock::now();
+    size_t count = ctx->sources.size();
+    size_t best = count;
+    int64_t bestRoom = 0;
+    for (size_t i = 0; i < count; ++i)
+    {
+        const FileSource& source = ctx->sources[i];
+        if (!source.active)
+            continue;
+
+        int64_t room = (int64_t)source.congestion.GetWindow() - source.inFlight;
+        if (!expired[i] && !source.silent && (best == count || room > bestRoom))
+        {
+            best = i;
+            bestRoom = room;
+        }
+    }
+
+    vector<BlockRanges> requests(count);
+    for (uint32 block = ctx->firstMissing; block < ctx->nextBlock; ++block)
+    {
+        if (ctx->received[block])
+            continue;
+
+        // the block is still waited from its source
+        uint32 slot = block % FILE_WINDOW_MAX;
+        size_t owner = ctx->requestedFrom[slot];
+        if (!expired[owner])
+            continue;
+
+        ctx->sources[owner].loss.OnRequested(1);
+        ctx->sources[owner].loss.OnLost(1);
+
+        // no source answers: the next one is tried (the owner itself, if it is the only one)
+        size_t target = best;
+        for (size_t i = 1; target == count && i <= count; ++i)
+        {
+            if (ctx->sources[(owner + i) % count].active)
+                target = (owner + i) % count;
+        }
+        if (target == count)
+            target = owner;
+        if (target != owner)
+        {
+            if (ctx->sources[owner].inFlight > 0)
+                ctx->sources[owner].inFlight -= 1;
+
+            // the source has waited without requests, its deadline starts now
+            FileSource& source = ctx->sources[target];
+            if (source.inFlight == 0)
+            {
+                if (!source.silent)
+                    source.lastReceived = now;
+                source.retransmitAt = now + source.rtt.GetRto();
+            }
+            source.inFlight += 1;
+            ctx->requestedFrom[slot] = (uint8)target;
+        }
+
+        // answer on the re-sent request can't be told apart from the late answer on the first one (Karn's algorithm)
+        ctx->requestedAt[slot] = TimePoint();
+
+        BlockRanges& ranges = requests[target];
+        if (!ranges.empty() && ranges.back().second + 1 == block)
+            ranges.back().second = block;
+        else
+            ranges.push_back(make_pair(block, block));
+
+        // message is full, send it and start the next one
+        if (ranges.size() == FILE_BLOCKS_RANGES_MAX)
+        {
+            SendReqToSource(ctx->sources[target], ranges);
+            ranges.clear();
+        }
+    }
+
+    bool lossy = false;
+    for (size_t i = 0; i < count; ++i)
+        lossy = lossy || ctx->sources[i].loss.Get() > 0;
+    if (FEC_FILE_BLOCKS == 1 && lossy && !ctx->fec.IsActive())
+        ctx->fec.Activate();
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!requests[i].empty())
+            SendReqToSource(ctx->sources[i], requests[i]);
+    }
+
+    // nothing is lost, but windows may be not full
+    SendReqForFileBlockMsg(ctx);
+}
+
+// the request tells the source our window, RTT and loss for it
+
+void ChatClient::SendReqToSource(const FileSource& source, const BlockRanges& ranges)
+{
+    SendTo(source.endpoint, MessageBuilder::RequestForFileBlocks(source.id, ranges, source.congestion.GetWindow(),
+        (uint32)ToMicroseconds(source.rtt.GetSmoothed()), source.codecs, source.loss.Get(), _thisPeer, source.version));
+}
+
+// queue requested blocks of file and send as many of them, as the pacer allows
+// blocks, which are sent to all, are requested by many peers: the block, which was sent within the round trip
+// of the requester, is on its way to it yet (the request has crossed it), so it isn't sent again
+
+void ChatClient::SendFileBlocks(SendingFilePtr ctx, const BlockRanges& ranges, Duration holdoff)
+{
+    // M_FI has reached the receiver (resumed download may start not from the first block)
+    ctx->requested = true;
+
+    TimePoint now = Clock::now();
+    holdoff = max<Duration>(holdoff, chrono::microseconds(REPAIR_HOLDOFF_MIN_US));
+
+    for (BlockRanges::const_iterator it = ranges.begin(); it != ranges.end(); ++it)
+    {
+        for (uint32 block = it->first; block <= it->second && block < ctx->totalBlocks; ++block)
+        {
+            // the block may be requested again before it is sent
+            if (ctx->queued[block])
+                continue;
+            if (ctx->broadcast && ctx->sentAt[block] != TimePoint() && now - ctx->sentAt[block] < holdoff)
+                continue;
+
+            ctx->queued[block] = true;
+            ctx->queue.push_back(block);
+        }
+    }
+
+    SendQueuedBlocks(ctx);
+}
+
+// send queued blocks (in a burst) right from the mapping, header and data are gathered into one datagram
+// (compressed blocks are appended to the header), the rest of the queue is sent by the pacing timer
+// it runs on the strand of the file, so blocks of different files are compressed by different threads
+
+void ChatClient::SendQueuedBlocks(SendingFilePtr ctx)
+{
+    if (ctx->pacing)
+        return;
+
+    TimePoint now = Clock::now();
+    uint32 count = ctx->pacer.Take(now, (uint32)ctx->queue.size());
+
+    cc_string file = (cc_string)ctx->region.get_address();
+    BulkSender sender(_sendSocket);
+
+    for (uint32 i = 0; i < count; ++i)
+    {
+        uint32 block = ctx->queue.front();
+        ctx->queue.pop_front();
+        ctx->queued[block] = false;
+        if (ctx->broadcast)
+            ctx->sentAt[block] = now;
+
+        uint64_t offset = (uint64_t)block * FILE_BLOCK_MAX;
+        uint32 size = (uint32)min<uint64_t>(FILE_BLOCK_MAX, ctx->size - offset);
+
+        AddToParity(ctx.get(), block, file + offset, size, sender);
+
+        if (SIMULATE_PACKET_LOOSING == 1)
+        {
+            if ((rand() % 10 + 1) > 7)
+                continue;
+        }
+
+        char trailer[SZ_FILE_BLOCK_CRC + SZ_FILE_BLOCK_CODEC];
+        MessageBuilder::StoreUint32(ctx->blockCrcs[block], trailer);
+
+        char packed[FILE_BLOCK_MAX];
+        size_t packedSize = CompressBlock(ctx.get(), block, file + offset, size, packed);
+        if (packedSize > 0)
+        {
+            Packet message = MessageBuilder::FileBlockHeader(ctx->id, block, (uint32)packedSize, _thisPeer, ctx->version);
+            message.append(packed, packedSize);
+            trailer[SZ_FILE_BLOCK_CRC] = (char)ctx->codec;
+            sender.Add(ctx->endpoint, message, 0, 0, trailer, sizeof(trailer));
+        }
+        else
+        {
+            sender.Add(ctx->endpoint,
+                MessageBuilder::FileBlockHeader(ctx->id, block, size, _thisPeer, ctx->version), file + offset, size, trailer, SZ_FILE_BLOCK_CRC);
+        }
+    }
+
+    // the last group is closed: the next burst can be far (the next request of the receiver)
+    if (ctx->queue.empty() && ctx->fec.Count() > 0)
+    {
+        SendParity(ctx.get(), sender);
+        ctx->fec.Reset();
+    }
+
+    sender.Flush();
+
+    if (ctx->queue.empty())
+        return;
+
+    ctx->pacing = true;
+    ctx->pacingTimer.expires_from_now(ctx->pacer.Delay(now));
+    ctx->pacingTimer.async_wait(ctx->strand.wrap(
+        boost::bind(&ChatClient::HandlePacingTimer, this, ctx, boost::asio::placeholders::error)));
+}
+
+// size of the compressed block, 0 - it is sent raw (compression isn't accepted or the block doesn't get smaller)
+// incompressible blocks are remembered, many of them in a row pause the compression (cheap detection of packed data)
+
+size_t ChatClient::CompressBlock(SendingFilesContext* ctx, uint32 block, cc_string data, uint32 size, c_string packed)
+{
+    if (ctx->codec == 0 || ctx->incompressible[block])
+        return 0;
+
+    if (ctx->compressPause > 0)
+    {
+        ctx->compressPause -= 1;
+        return 0;
+    }
+
+    size_t packedSize = Lz4::Compress(data, size, packed, size - size / COMPRESSION_GAIN);
+    if (packedSize > 0)
+    {
+        ctx->compressFails = 0;
+        return packedSize;
+    }
+
+    ctx->incompressible[block] = true;
+    ctx->compressFails += 1;
+    if (ctx->compressFails >= COMPRESSION_FAILS_MAX)
+    {
+        LOG_DEBUG("Blocks of file ", ctx->path, " don't compress, compression is paused");
+        ctx->compressFails = 0;
+        ctx->compressPause = COMPRESSION_PAUSE;
+    }
+    return 0;
+}
+
+// sent blocks are XORed into the parity of the group, it is sent after the last block of the group
+// (it is lost as well as blocks, so the simulation drops it too)
+
+void ChatClient::AddToParity(SendingFilesContext* ctx, uint32 block, cc_string data, uint32 size, BulkSender& sender)
+{
+    uint32 groupSize = FecEncoder::GroupSize(ctx->loss);
+    FecEncoder& fec = ctx->fec;
+
+    if (groupSize == 0)
+    {
+        fec.Reset();
+        return;
+    }
+
+    fec.Add(block, data, size);
+    if (fec.Count() >= groupSize)
+    {
+        SendParity(ctx, sender);
+        fec.Reset();
+    }
+}
+
+// parity is copied into the message: the encoder is reused before the burst is flushed
+
+void ChatClient::SendParity(SendingFilesContext* ctx, BulkSender& sender)
+{
+    if (SIMULATE_PACKET_LOOSING == 1)
+    {
+        if ((rand() % 10 + 1) > 7)
+            return;
+    }
+
+    const FecEncoder& fec = ctx->fec;
+    Packet message = MessageBuilder::FileParityHeader(ctx->id, fec.Blocks(), fec.Count(), (uint32)fec.Size(), _thisPeer, ctx->version);
+    message.append(fec.Data(), fec.Size());
+
+    // CRC of the v1 tail: numbers of blocks, then the parity
+    char crc[SZ_FILE_BLOCK_CRC];
+    uint32 blocksCrc = Crc32c::Compute((cc_string)fec.Blocks(), fec.Count() * sizeof(uint32));
+    MessageBuilder::StoreUint32(Crc32c::Compute(fec.Data(), fec.Size(), blocksCrc), crc);
+    sender.Add(ctx->endpoint, message, 0, 0, crc, sizeof(crc));
+}
+
+void ChatClient::HandlePacingTimer(SendingFilePtr ctx, const ErrorCode& error)
+{
+    ctx->pacing = false;
+
+    // sending is finished or interrupted
+    if (error || FindSendingFile(ctx->id) != ctx)
+        return;
+
+    SendQueuedBlocks(ctx);
+}
+
+ChatClient::TransferKey::TransferKey(const UdpEndpoint& from, uint32 fileId)
+    : port(from.port())
+    , id(fileId)
+{
+    const IpAddress& ip = from.address();
+    if (ip.is_v4())
+    {
+        // ::ffff:a.b.c.d
+        Ipv4Address::bytes_type bytes = ip.to_v4().to_bytes();
+        memset(address, 0, 10);
+        address[10] = 0xFF;
+        address[11] = 0xFF;
+        memcpy(address + 12, bytes.data(), bytes.size());
+    }
+    else
+    {
+        Ipv6Address::bytes_type bytes = ip.to_v6().to_bytes();
+        memcpy(address, bytes.data(), bytes.size());
+    }
+}
+
+bool ChatClient::TransferKey::operator==(const TransferKey& other) const
+{
+    return id == other.id && port == other.port && memcmp(address, other.address, sizeof(address)) == 0;
+}
+
+// FNV-1a on 64-bit words (address is two of them), high bits are folded into the low ones
+
+size_t ChatClient::TransferKeyHash::operator()(const TransferKey& key) const
+{
+    uint64 words[3];
+    memcpy(words, key.address, sizeof(key.address));
+    words[2] = ((uint64)key.port << 32) | key.id;
+
+    uint64 hash = 14695981039346656037ull;
+    for (int i = 0; i < 3; ++i)
+    {
+        hash ^= words[i];
+        hash *= 1099511628211ull;
+        hash ^= hash >> 29;
+    }
+    return (size_t)hash;
+}
+
+ChatClient::UploadingFilePtr ChatClient::FindUploadingFile(const TransferKey& key)
+{
+    ScopedLock lk(_filesMutex);
+    UploadingFilesMap::iterator it = _uploadingFiles.find(key);
+    return it != _uploadingFiles.end() ? it->second : UploadingFilePtr();
+}
+
+ChatClient::SendingFilePtr ChatClient::FindSendingFile(uint32 id)
+{
+    ScopedLock lk(_filesMutex);
+    SendingFilesMap::iterator it = _sendingFiles.find(id);
+    return it != _sendingFiles.end() ? it->second : SendingFilePtr();
+}
+
+// download of the same content (only identified files with CRC are downloaded from many sources)
+
+ChatClient::UploadingFilePtr ChatClient::FindUploadingContent(const FileExtensions& extensions)
+{
+    if (extensions.content == 0 || !extensions.crcKnown)
+        return UploadingFilePtr();
+
+    // these fields aren't changed after the download is added to the map
+    ScopedLock lk(_filesMutex);
+    for (UploadingFilesMap::const_iterator it = _uploadingFiles.begin(); it != _uploadingFiles.end(); ++it)
+    {
+        const UploadingFilesContext& ctx = *it->second;
+        if (ctx.content == extensions.content && ctx.identity.size == extensions.identity.size && ctx.crc == extensions.crc)
+            return it->second;
+    }
+    return UploadingFilePtr();
+}
+
+// index of the source by its key (unknown key is the first source)
+
+size_t ChatClient::FindSource(const UploadingFilesContext* ctx, const TransferKey& key)
+{
+    for (size_t i = 1; i < ctx->sources.size(); ++i)
+    {
+        if (ctx->sources[i].key == key)
+            return i;
+    }
+    return 0;
+}
+
+// the earliest deadline of sources, which blocks are waited from
+
+TimePoint ChatClient::RetransmitDeadline(const UploadingFilesContext* ctx, TimePoint now)
+{
+    TimePoint deadline = now + ctx->sources[0].rtt.GetRto();
+    bool waiting = false;
+    for (size_t i = 0; i < ctx->sources.size(); ++i)
+    {
+        const FileSource& source = ctx->sources[i];
+        if (!source.active || source.inFlight == 0)
+            continue;
+        if (!waiting || source.retransmitAt < deadline)
+            deadline = source.retransmitAt;
+        waiting = true;
+    }
+    return deadline;
+}
+
+// finished downloads are remembered for a while (old ones are forgotten here)
+
+bool ChatClient::IsFinishedFile(const TransferKey& key)
+{
+    TimePoint now = Clock::now();
+    ScopedLock lk(_filesMutex);
+    for (FinishedFilesMap::iterator it = _finishedFiles.begin(); it != _finishedFiles.end();)
+    {
+        if (now - it->second > chrono::seconds(SECONDS_TO_REMEMBER_FILE))
+            it = _finishedFiles.erase(it);
+        else
+            ++it;
+    }
+    return _finishedFiles.count(key) > 0;
+}
+
+// requesting the first window of blocks (on the strand of the file)
+// peers, which have the same content, are asked to offer it
+
+void ChatClient::StartUploadingFile(UploadingFilePtr ctx)
+{
+    // resumed download may have all blocks already
+    if (ctx->blocksReceived == ctx->blocks)
+    {
+        FinishUploadingFile(ctx);
+        return;
+    }
+
+    if (ctx->delta)
+    {
+        FileSource& source = ctx->sources[0];
+        source.lastReceived = Clock::now();
+        source.retransmitAt = source.lastReceived + source.rtt.GetRto();
+        SendReqForSignaturesMsg(ctx.get());
+    }
+    else
+    {
+        SendReqForFileBlockMsg(ctx.get());
+    }
+
+    ctx->retransmitAt = RetransmitDeadline(ctx.get(), Clock::now());
+    StartRetransmitTimer(ctx);
+
+    if (ctx->content != 0)
+        SendFileQuery(ctx.get());
+}
+
+// request the next pages of signatures (a few pages are on the way at once)
+
+void ChatClient::SendReqForSignaturesMsg(UploadingFilesContext* ctx)
+{
+    DeltaState& delta = *ctx->delta;
+    uint32 first = delta.nextPage;
+    while (delta.nextPage < delta.pages.size() && delta.nextPage - delta.pagesReceived < SIGNATURE_PAGES_IN_FLIGHT)
+        delta.nextPage += 1;
+
+    const FileSource& source = ctx->sources[0];
+    if (delta.nextPage > first)
+        SendTo(source.endpoint, MessageBuilder::RequestForFileSignatures(source.id, first, delta.nextPage - first, _thisPeer, source.version));
+}
+
+// pages of signatures, which haven't come till the deadline, are requested again
+// the old copy isn't used, if the sender doesn't send them for too long (all blocks are requested as usual)
+
+void ChatClient::CheckSignatures(UploadingFilePtr ctx, TimePoint now)
+{
+    FileSource& source = ctx->sources[0];
+    if (now < source.retransmitAt)
+    {
+        ctx->retransmitAt = source.retransmitAt;
+        StartRetransmitTimer(ctx);
+        return;
+    }
+
+    if (now - source.lastReceived > chrono::seconds(SECONDS_TO_RECEIVE_BLOCK))
+    {
+        LOG_INFO("File ", ctx->name, ": signatures aren't received, the whole file is downloaded");
+        DropDelta(ctx.get());
+        SendReqForFileBlockMsg(ctx.get());
+        ctx->retransmitAt = RetransmitDeadline(ctx.get(), now);
+        StartRetransmitTimer(ctx);
+        return;
+    }
+
+    source.rtt.Backoff();
+    source.retransmitAt = now + source.rtt.GetRto();
+
+    // lost pages are requested by runs
+    DeltaState& delta = *ctx->delta;
+    for (uint32 page = 0; page < delta.nextPage; ++page)
+    {
+        if (delta.pages[page])
+            continue;
+
+        uint32 last = page;
+        while (last + 1 < delta.nextPage && !delta.pages[last + 1])
+            last += 1;
+        SendTo(source.endpoint, MessageBuilder::RequestForFileSignatures(source.id, page, last - page + 1, _thisPeer, source.version));
+        page = last;
+    }
+
+    ctx->retransmitAt = source.retransmitAt;
+    StartRetransmitTimer(ctx);
+}
+
+// blocks, which the old copy has, are copied from it: only the rest is downloaded (on the strand of the file)
+
+void ChatClient::ApplyDelta(UploadingFilePtr ctx)
+{
+    const DeltaState& delta = *ctx->delta;
+    uint32 found = 0;
+
+    try
+    {
+        FileMapping file(delta.basis.c_str(), boost::interprocess::read_only);
+        MappedRegion region(file, boost::interprocess::read_only);
+        cc_string basis = (cc_string)region.get_address();
+
+        DeltaMatcher matcher(delta.weakSums, delta.crcs, ctx->identity.size, FILE_BLOCK_MAX);
+        vector<uint64> offsets;
+        matcher.Match(basis, region.get_size(), offsets);
+
+        for (uint32 block = 0; block < ctx->blocks; ++block)
+        {
+            if (offsets[block] == DELTA_NO_MATCH || ctx->received[block])
+                continue;
+
+            uint64 offset = (uint64)block * FILE_BLOCK_MAX;
+            size_t size = (size_t)min<uint64>(FILE_BLOCK_MAX, ctx->identity.size - offset);
+            ctx->fp.seekp((streamoff)offset);
+            ctx->fp.write(basis + offsets[block], size);
+            ctx->received[block] = true;
+            ctx->blockCrcs[block] = delta.crcs[block];
+            ctx->blocksReceived += 1;
+            found += 1;
+        }
+    }
+    catch (const boost::interprocess::interprocess_exception& e)
+    {
+        LOG_ERROR("Can't read the old copy of ", ctx->name, ": ", e.what());
+    }
+
+    LOG_INFO("File ", ctx->name, ": ", found, " from ", ctx->blocks, " blocks are found in the old copy");
+    cout << "\nFile " << ctx->name << ": " << found << " from " << ctx->blocks << " blocks are found in the old copy" << endl;
+    DropDelta(ctx.get());
+
+    while (ctx->firstMissing < ctx->blocks && ctx->received[ctx->firstMissing])
+        ctx->firstMissing += 1;
+
+    if (ctx->blocksReceived == ctx->blocks)
+    {
+        FinishUploadingFile(ctx);
+        return;
+    }
+
+    SaveJournal(ctx.get());
+    SendReqForFileBlockMsg(ctx.get());
+    ctx->retransmitAt = RetransmitDeadline(ctx.get(), Clock::now());
+    StartRetransmitTimer(ctx);
+}
+
+// the old copy isn't needed anymore
+
+void ChatClient::DropDelta(UploadingFilesContext* ctx)
+{
+    ErrorCode ec;
+    boost::filesystem::remove(ctx->delta->basis, ec);
+    ctx->delta.reset();
+}
+
+// the peer has offered the content of the download (on the strand of the file)
+
+void ChatClient::AddFileSource(UploadingFilePtr ctx, const FileSource& source)
+{
+    // the download is finished or stopped already
+    if (FindUploadingFile(ctx->key) != ctx)
+        return;
+
+    for (size_t i = 0; i < ctx->sources.size(); ++i)
+    {
+        if (ctx->sources[i].key == source.key)
+            return;
+    }
+    if (ctx->sources.size() >= FILE_SOURCES_MAX)
+    {
+        LOG_DEBUG("File ", ctx->name, " has enough sources");
+        return;
+    }
+
+    ctx->sources.push_back(source);
+    ctx->sources.back().lastReceived = Clock::now();
+    {
+        ScopedLock lk(_filesMutex);
+        _uploadingFiles[source.key] = ctx;
+    }
+
+    string peerId;
+    {
+        ScopedLock lk(_peersMutex);
+        if (_peers.IsValid(source.peer))
+            peerId = _peers.GetId(source.peer);
+    }
+    LOG_INFO("File ", ctx->name, ": ", peerId, " is one more source");
+    cout << "\nFile " << ctx->name << " is downloaded from " << peerId << " too" << endl;
+
+    SendReqForFileBlockMsg(ctx.get());
+    ctx->retransmitAt = RetransmitDeadline(ctx.get(), Clock::now());
+    StartRetransmitTimer(ctx);
+}
+
+// blocks, which come later, are ignored (the download is found by keys of all its sources)
+
+void ChatClient::StopUploadingFile(UploadingFilesContext* ctx)
+{
+    ScopedLock lk(_filesMutex);
+    for (size_t i = 0; i < ctx->sources.size(); ++i)
+        _uploadingFiles.erase(ctx->sources[i].key);
 }
 
-void ChatClient::SendTo(const UdpEndpoint& e, const string& m)
+// peers, which have the file with this content, offer it (see OnFileQuery)
+
+void ChatClient::SendFileQuery(UploadingFilesContext* ctx)
 {
-    _sendSocket.send_to(boost::asio::buffer(m), e);
+    LOG_DEBUG("File ", ctx->name, ": look for more sources");
+    uint8 version;
+    {
+        ScopedLock lk(_peersMutex);
+        version = BroadcastVersion();
+    }
+    SendTo(_sendEndpoint, MessageBuilder::FileQuery(ctx->identity.size, ctx->content, ctx->crc, _thisPeer, version));
 }
+
+// all blocks are received (on the strand of the file)
+
+// CRC of the file is combined from CRCs of blocks (the file isn't read again)
+// the downloaded file is shared: it is offered to peers, which download the same content later
+
+void ChatClient::FinishUploadingFile(UploadingFilePtr ctx)
+{
+    StopUploadingFile(ctx.get());
+    if (ctx->delta)
+        DropDelta(ctx.get());
+    {
+        ScopedLock lk(_filesMutex);
+        _finishedFiles[ctx->key] = Clock::now();
+    }
+    ctx->fp.close();
+    TransferJournal::Remove(ctx->name);
+
+    bool corrupted = false;
+    if (ctx->crcKnown)
+    {
+        uint64 size = ctx->identity.IsKnown() ? ctx->identity.size : (uint64)ctx->blocks * FILE_BLOCK_MAX;
+        uint32 shift = Crc32c::Shift(FILE_BLOCK_MAX);
+        uint32 crc = 0;
+        for (uint32 block = 0; block < ctx->blocks; ++block)
+        {
+            uint64 offset = (uint64)block * FILE_BLOCK_MAX;
+            uint32 blockSize = (uint32)min<uint64>(FILE_BLOCK_MAX, size - offset);
+            if (blockSize == FILE_BLOCK_MAX)
+                crc = Crc32c::Multiply(crc, shift) ^ ctx->blockCrcs[block];
+            else
+                crc = Crc32c::Combine(crc, ctx->blockCrcs[block], blockSize);
+        }
+
+        if (crc != ctx->crc)
+        {
+            LOG_ERROR("Downloaded file ", ctx->name, " is corrupted (CRC ", crc, " instead of ", ctx->crc, ")");
+            corrupted = true;
+        }
+        else if (ctx->content != 0 && TransferJournal::HashContent(size, ctx->blockCrcs) != ctx->content)
+        {
+            LOG_ERROR("Downloaded file ", ctx->name, " is corrupted (content differs from the announced one)");
+            corrupted = true;
+        }
+    }
+
+    cc_string action = corrupted ? "filecorrupted" : "filedone";
+    for (size_t i = 0; i < ctx->sources.size(); ++i)
+    {
+        if (ctx->sources[i].active)
+            SendTo(ctx->sources[i].endpoint, MessageBuilder::FileResult(action, ctx->sources[i].id, _thisPeer, ctx->sources[i].version));
+    }
+
+    if (corrupted)
+    {
+        cout << "\nDownloaded file " << ctx->name << " is corrupted" << endl;
+        return;
+    }
+
+    if (ctx->content != 0)
+    {
+        SharedFile shared;
+        shared.size = ctx->identity.size;
+        shared.crc = ctx->crc;
+        shared.path = ctx->name;
+        ScopedLock lk(_filesMutex);
+        _sharedFiles[ctx->content] = shared;
+    }
+
+    LOG_INFO("Done uploading file ", ctx->name);
+    cout << "\nDone uploading file " << ctx->name << endl;
+}
+
+// blocks are written into the file before the journal tells about them
+
+void ChatClient::SaveJournal(UploadingFilesContext* ctx)
+{
+    if (!ctx->identity.IsKnown() || !ctx->fp.is_open())
+        return;
+
+    ctx->fp.flush();
+    if (TransferJournal::Save(ctx->name, ctx->identity, FILE_BLOCK_MAX, ctx->received, ctx->blockCrcs))
+        ctx->journaled = ctx->blocksReceived;
+}
+
+// sockets are used by many threads, but one send_to is one system call (no state is shared)
+
+void ChatClient::SendTo(const UdpEndpoint& e, const Packet& m)
+{
+    _sendSocket.send_to(boost::asio::buffer(m.data(), m.size()), e);
+}
+
@@ -2,10 +2,22 @@
 #define CHAT_CLIENT_H
 
 #include "utils.h"
+#include "message_formats.h"
+#include "MessageSchema.h"
 #include "Peer.h"
+#include "PeerTable.h"
+#include "PacketPool.h"
+#include "CongestionControl.h"
+#include "TransferJournal.h"
+#include "Crc32c.h"
+#include "Lz4.h"
+#include "Fec.h"
+#include "DeltaTransfer.h"
 
 #include <mutex>
 
+class BulkSender;
+
 class ChatClient
 {
 public:
@@ -22,82 +34,234 @@ private:
     ChatClient(const ChatClient& src);
     ChatClient& operator=(const ChatClient& rval);
 
+    // key of downloading file: endpoint of the sender and file id on its side (no strings, it's built for every block)
+    struct TransferKey
+    {
+        TransferKey() : port(0), id(0) { memset(address, 0, sizeof(address)); }
+        TransferKey(const UdpEndpoint& from, uint32 fileId);
+
+        uint8 address[16];  // IPv4 is kept as IPv4-mapped IPv6 address
+        uint16 port;
+        uint32 id;
+
+        bool operator==(const TransferKey& other) const;
+    };
+
+    struct TransferKeyHash
+    {
+        size_t operator()(const TransferKey& key) const;
+    };
+
+    /*
+    Every file transfer has its own strand: blocks, requests and timeouts of one file are handled one by one,
+    but different transfers (and chat messages, see _chatStrand) are handled by service threads in parallel.
+    Timeouts are asio timers. The timer isn't restarted on every block: it's just the deadline, which is moved,
+    and the timer is re-armed, when it expires before the deadline.
+    */
+
+    // peer, which blocks of the downloading file are requested from
+    // (the file is downloaded from all peers, which have its content, see M_FILE_QUERY)
+    struct FileSource
+    {
+        FileSource()
+            : peer(PEER_NONE)
+            , congestion(FILE_WINDOW_MIN, FILE_WINDOW_INITIAL, FILE_WINDOW_MAX)
+            , inFlight(0)
+            , silent(false)
+            , active(true)
+        { }
+
+        PeerHandle peer;        // it can leave the chat, so the handle is checked
+        TransferKey key;        // key in the map of downloading files
+        UdpEndpoint endpoint;
+        uint32 id;              // file id on its side
+        uint8 version;          // version of its messages
+        uint8 codecs;           // codecs of blocks, which are accepted (offered by it and known here)
+        LedbatController congestion;    // window: max quantity of blocks, which are requested from it and not received yet
+        RttEstimator rtt;               // retransmission timeout
+        LossEstimator loss;             // reported to it, it sends parity of blocks for it
+        uint32 inFlight;                // blocks, which are requested from it and not received yet
+        TimePoint retransmitAt;         // its blocks are lost, if nothing comes from it till this moment
+        TimePoint lastReceived;         // last block received from it (or the moment, when it got blocks after an idle pause)
+        bool silent;                    // its deadline has expired: one block at a time is requested from it, until it answers
+        bool active;                    // offline source isn't asked anymore (its blocks are requested from others)
+    };
+
+    // signatures of blocks, which are downloaded before blocks, when the receiver has an old copy of the file
+    struct DeltaState
+    {
+        string basis;               // path of the old copy (it is moved aside)
+        vector<uint32> weakSums;    // signatures of blocks of the new file
+        vector<uint32> crcs;
+        vector<bool> pages;         // received pages of signatures
+        uint32 pagesReceived;
+        uint32 nextPage;            // next page to request
+    };
+
     // downloading files
     struct UploadingFilesContext
     {
-        Peer _recvFrom;
-        UdpEndpoint endpoint;
+        UploadingFilesContext(boost::asio::io_service& ioService)
+            : strand(ioService)
+            , requestedAt(FILE_WINDOW_MAX)
+            , requestedFrom(FILE_WINDOW_MAX, 0)
+            , retransmitTimer(ioService)
+            , timerWaiting(false)
+        { }
+
+        Strand strand;
+        TransferKey key;        // key of the first source (the download is in the map of downloading files by keys of all sources)
+        vector<FileSource> sources;     // [0] is the peer, which has sent the file
         uint32 blocks;          // total blocks
         uint32 blocksReceived;  // received blocks
-        uint32 resendCount;     // sending requests (for one block!)
-        uint32 id;              // file id on the receiver side
+        uint32 firstMissing;    // first not received block (all blocks before this one are written)
+        uint32 nextBlock;       // next block to request (blocks are never requested further than FILE_WINDOW_MAX from the first missing one)
+        vector<bool> received;  // bitmap of received blocks
+        vector<uint32> blockCrcs;       // CRC-32C of received blocks (the CRC of the file is combined from them)
+        BlockRanges ranges;     // ranges of the request, which is being built (memory is kept)
+        vector<TimePoint> requestedAt;  // when blocks were requested (ring by block % FILE_WINDOW_MAX), empty for re-requested ones
+        vector<uint8> requestedFrom;    // sources of requested blocks (ring by block % FILE_WINDOW_MAX)
+        SteadyTimer retransmitTimer;    // lost blocks are requested again, when it expires
+        TimePoint retransmitAt;         // deadline of the timer (the earliest deadline of sources)
+        bool timerWaiting;              // is the timer waiting?
+        uint32 progress;        // last shown progress (percents)
+        FileIdentity identity;  // of the sent file (unknown for old senders, they aren't journaled)
+        uint32 crc;             // CRC-32C of the sent file
+        bool crcKnown;          // old senders don't send it
+        uint64 content;         // hash of the content (0 - unknown, the file is downloaded from its sender only)
+        uint32 journaled;       // received blocks, when the journal was saved
+        FecDecoder fec;         // last blocks for recovery by the parity
+        unique_ptr<DeltaState> delta;   // not null, while signatures are downloaded (blocks are requested after them)
         ofstream fp;            // read from it
-        time_t ts;              // last block received
         string name;            // file name
     };
-    typedef map<string, UploadingFilesContext*> UploadingFilesMap;
+    typedef shared_ptr<UploadingFilesContext> UploadingFilePtr;
+    typedef unordered_map<TransferKey, UploadingFilePtr, TransferKeyHash> UploadingFilesMap;
+    typedef unordered_map<TransferKey, TimePoint, TransferKeyHash> FinishedFilesMap;   // when downloads were finished
 
     // sent files
     struct SendingFilesContext
     {
-        Peer _sendTo;
+        SendingFilesContext(boost::asio::io_service& ioService)
+            : strand(ioService)
+            , retransmitTimer(ioService)
+            , pacingTimer(ioService)
+            , pacing(false)
+            , idleTimer(ioService)
+        { }
+
+        Strand strand;
         UdpEndpoint endpoint;   // to
         uint32 id;              // file id on the sender side
+        uint8 version;          // version of messages of the receiver
         uint32 totalBlocks;     // total blocks
         string    path;                        // file path
-        bool firstBlockSent;                   // has first block been sent?
-        time_t ts;                            // first block sent
+        uint64_t size;                         // file size
+        FileMapping file;                      // file is opened while it is requested
+        MappedRegion region;                   // whole file mapped for reading (unmapped after a pause)
+        FileIdentity identity;                 // receiver resumes the download of the same file
+        vector<uint32> blockCrcs;              // CRC-32C of blocks (computed once, before M_FI is sent)
+        uint32 crc;                            // CRC-32C of the file
+        bool requested;                        // has the receiver requested blocks (M_FI has reached it)?
+        RttEstimator rtt;               // timeout of M_FI (backoff only, there are no samples)
+        SteadyTimer retransmitTimer;    // M_FI is sent again, when it expires
         uint32 resendCount;            // sending requests (for one block!)
         string _peerId;                 //send to it
+        Pacer pacer;                    // spreads blocks over the round trip of the receiver
+        boost::circular_buffer<uint32> queue;   // requested blocks, which are not sent yet (capacity is totalBlocks)
+        vector<bool> queued;            // bitmap of blocks in the queue
+        BlockRanges ranges;             // ranges of the request, which is being handled (memory is kept)
+        SteadyTimer pacingTimer;        // sends the queue, when the pacer allows
+        bool pacing;                    // is the timer waiting?
+        uint8 codec;                    // codec of blocks, which the receiver has accepted (0 - blocks are sent raw)
+        vector<bool> incompressible;    // blocks, which didn't get smaller (they are sent raw again)
+        uint32 compressFails;           // incompressible blocks in a row
+        uint32 compressPause;           // blocks, which are sent raw without trying
+        uint8 loss;                     // loss of blocks, which the receiver sees (1/255)
+        FecEncoder fec;                 // parity of the current group of blocks
+        bool broadcast;                 // is it sent to all peers (on broadcast address)?
+        vector<TimePoint> sentAt;       // when blocks were sent last time (sending to all only)
+        uint64 content;                 // hash of the content (the expected one, when the file is offered)
+        bool offered;                   // is it offered to the peer as one more source of its download (not announced)?
+        vector<uint32> weakSums;        // rolling sums of blocks (counted on the first request of signatures)
+        SteadyTimer idleTimer;          // unmaps the file, when nothing is requested
+        TimePoint lastRequest;
     };
-    typedef map<unsigned, SendingFilesContext*> SendingFilesMap;
+    typedef shared_ptr<SendingFilesContext> SendingFilePtr;
+    typedef unordered_map<uint32, SendingFilePtr> SendingFilesMap;
 
-    typedef map<string, Peer*> Peers;
-
-    // Handlers
-
-    class Handler
+    // file, which this peer has (sent or downloaded): it is offered to peers, which download the same content
+    struct SharedFile
     {
-    public:
-        virtual ~Handler() {}
-        virtual void handle(cc_string data, size_t size) = 0;
-        static void setChatInstance(ChatClient* chatClient) { _chatClient = chatClient; }
-    protected:
-        static ChatClient* _chatClient;
+        uint64 size;
+        uint32 crc;
+        string path;
     };
-    typedef vector< Handler* > Handlers;
+    typedef unordered_map<uint64, SharedFile> SharedFilesMap;   // by the hash of the content
 
-    class HandlerSys : public Handler {
-    public:
-        void handle(cc_string data, size_t size);
+    // one received datagram (ring of them is filled by one read)
+    struct ReceivedDatagram
+    {
+        Packet packet;          // large buffer of the pool
+        UdpEndpoint from;
+        size_t size;
     };
+    typedef vector<ReceivedDatagram> ReceiveRing;
 
-    class HandlerText : public Handler {
-    public:
-        void handle(cc_string data, size_t size);
-    };
+    // Handlers
 
-    class HandlerPeerData : public Handler {
-    public:
-        void handle(cc_string data, size_t size);
+    /*
+    Dispatch table (by code of the message) is built by templates at compile time, there are no virtual calls.
+    Datagram is validated once (see MessageView), route and handle get it already checked.
+    */
+    struct MessageHandler
+    {
+        bool (*validate)(cc_string data, size_t size);
+        Strand (*route)(ChatClient* client, cc_string data, size_t size, const UdpEndpoint& from);  // strand, which the message is handled on
+        void (*handle)(ChatClient* client, cc_string data, size_t size, const UdpEndpoint& from);
     };
+    static const MessageHandler _handlers[LAST + 1];
 
-    class HandlerFileInfo : public Handler {
-    public:
-        void handle(cc_string data, size_t size);
-    };
+    template <class T, void (ChatClient::*Handle)(const MessageView<T>&, const UdpEndpoint&)>
+    static void HandleMessage(ChatClient* client, cc_string data, size_t size, const UdpEndpoint& from)
+    {
+        (client->*Handle)(MessageView<T>(data, size), from);
+    }
 
-    class HandlerFileBlock : public Handler {
-    public:
-        void handle(cc_string data, size_t size);
-    };
+    template <class T, Strand (ChatClient::*Route)(const MessageView<T>&, const UdpEndpoint&)>
+    static Strand RouteMessage(ChatClient* client, cc_string data, size_t size, const UdpEndpoint& from)
+    {
+        return (client->*Route)(MessageView<T>(data, size), from);
+    }
 
-    class HandlerRequestForFileBlock : public Handler {
-    public:
-        void handle(cc_string data, size_t size);
-    };
+    // by default messages are handled on the chat strand
+    static Strand RouteToChat(ChatClient* client, cc_string, size_t, const UdpEndpoint&) { return client->_chatStrand; }
+
+    // message, which is routed before its download is registered, is handled again on the strand of the download
+    template <class T>
+    void Reroute(Strand& strand, const MessageView<T>& msg, const UdpEndpoint& from);
+
+    void OnSystem(const MessageView<MessageSystem>& msg, const UdpEndpoint& from);
+    void OnText(const MessageView<MessageText>& msg, const UdpEndpoint& from);
+    void OnPeerData(const MessageView<MessagePeerData>& msg, const UdpEndpoint& from);
+    void OnFileInfo(const MessageView<MessageFileInfo>& msg, const UdpEndpoint& from);
+    void OnFileBlock(const MessageView<MessageFileBlock>& msg, const UdpEndpoint& from);
+    Strand RouteFileBlock(const MessageView<MessageFileBlock>& msg, const UdpEndpoint& from);
+    void OnFileParity(const MessageView<MessageFileParity>& msg, const UdpEndpoint& from);
+    Strand RouteFileParity(const MessageView<MessageFileParity>& msg, const UdpEndpoint& from);
+    void OnRequestForFileBlock(const MessageView<MessageRequestForFileBlock>& msg, const UdpEndpoint& from);
+    Strand RouteRequestForFileBlock(const MessageView<MessageRequestForFileBlock>& msg, const UdpEndpoint& from);
+    void OnRequestForFileBlocks(const MessageView<MessageRequestForFileBlocks>& msg, const UdpEndpoint& from);
+    Strand RouteRequestForFileBlocks(const MessageView<MessageRequestForFileBlocks>& msg, const UdpEndpoint& from);
+    void OnFileQuery(const MessageView<MessageFileQuery>& msg, const UdpEndpoint& from);
+    void OnRequestForFileSignatures(const MessageView<MessageRequestForFileSignatures>& msg, const UdpEndpoint& from);
+    Strand RouteRequestForFileSignatures(const MessageView<MessageRequestForFileSignatures>& msg, const UdpEndpoint& from);
+    void OnFileSignatures(const MessageView<MessageFileSignatures>& msg, const UdpEndpoint& from);
+    Strand RouteFileSignatures(const MessageView<MessageFileSignatures>& msg, const UdpEndpoint& from);
 
     boost::asio::io_service _ioService;
+    boost::asio::io_service::work _work;
+    Strand _chatStrand;
 
     UdpSocket _sendSocket;
     UdpSocket _recvSocket;
@@ -105,38 +269,99 @@ private:
     UdpEndpoint _recvEndpoint;
     uint16 _port;
     volatile uint8 _runThreads;
-    boost::array<char, 64 * 1024> _data;    
+    ReceiveRing _recvRing;
     uint32 _fileId;
     UploadingFilesMap _uploadingFiles;
     SendingFilesMap _sendingFiles;
-    Mutex _filesMutex;
-    Handlers _handlers;
+    FinishedFilesMap _finishedFiles;
+    SharedFilesMap _sharedFiles;
+    Mutex _filesMutex;      // guards maps of files (not contexts, they are guarded by their strands)
     Peer _thisPeer;
-    Peers _peersMap;
+    PeerTable _peers;
+    Mutex _peersMutex;      // guards table of peers
+    SteadyTimer _peersTimer;    // peers are pinged and removed by it
 
     void BoostServiceThread();
-    void ServiceFilesWatcher();
+
+    // timers
+
+    void StartCheckPeers();
+    void CheckPeers(const ErrorCode& error);
+    void StartRetransmitTimer(UploadingFilePtr ctx);
+    void CheckUploadingFile(UploadingFilePtr ctx, const ErrorCode& error);
+    void StartFileInfoTimer(SendingFilePtr ctx);
+    void CheckSendingFile(SendingFilePtr ctx, const ErrorCode& error);
+    void StartIdleTimer(SendingFilePtr ctx);
+    void CheckIdleFile(SendingFilePtr ctx, const ErrorCode& error);
 
     // async
 
+    void StartReceive();
     void HandleReceiveFrom(const ErrorCode& error, size_t bytes_recvd);
+    size_t ReceiveBatch();
+    void Dispatch(ReceivedDatagram& datagram);
+    void HandlePacket(const MessageHandler* handler, Packet packet, const UdpEndpoint& from);
+
+    // files
+
+    UploadingFilePtr FindUploadingFile(const TransferKey& key);
+    SendingFilePtr FindSendingFile(uint32 id);
+    bool IsFinishedFile(const TransferKey& key);
+    UploadingFilePtr FindUploadingContent(const FileExtensions& extensions);
+    void StartUploadingFile(UploadingFilePtr ctx);
+    void AddFileSource(UploadingFilePtr ctx, const FileSource& source);
+    void FinishUploadingFile(UploadingFilePtr ctx);
+    void StopUploadingFile(UploadingFilesContext* ctx);
+    void CheckSignatures(UploadingFilePtr ctx, TimePoint now);
+    void ApplyDelta(UploadingFilePtr ctx);
+    void DropDelta(UploadingFilesContext* ctx);
+    void SaveJournal(UploadingFilesContext* ctx);
+    void StoreFileBlock(UploadingFilePtr ctx, size_t from, uint32 block, cc_string data, size_t size, uint32 crc);
+    static size_t FindSource(const UploadingFilesContext* ctx, const TransferKey& key);
+    static TimePoint RetransmitDeadline(const UploadingFilesContext* ctx, TimePoint now);
 
     // parsing
 
     UdpEndpoint ParseEpFromString(const string&);
     void ParseUserInput(const wstring& data);
     void ParseTwoStrings(const wstring& str, wstring& s1, wstring& s2);
-    vector<Peer*> ProcessNick(const wstring& nick);
+    vector<PeerHandle> ProcessNick(const wstring& nick);
+
+    // peers (_peersMutex must be locked)
+
+    bool IsThisPeer(cc_string peerId) const;
+    PeerHandle FindSender(cc_string peerId, cc_string what);
+    uint8 PeerVersion(const string& ip);
+    uint8 BroadcastVersion();
 
     // senders
 
-    void SendSystemMsg(const UdpEndpoint& endpoint, cc_string action);
-    void SendPeerDataMsg(const UdpEndpoint& endpoint, const wstring& nick, const string&id);
-    void SendText(const UdpEndpoint& endpoint, const wstring& message);
-    void SendFile(const UdpEndpoint& endpoint, const wstring& path);
-    void SendTo(const UdpEndpoint& endpoint, const string& m);
+    void SendSystemMsg(const UdpEndpoint& endpoint, cc_string action, uint8 version);
+    void SendPeerDataMsg(const UdpEndpoint& endpoint);
+    void SendText(const UdpEndpoint& endpoint, const wstring& message, uint8 version);
+    void SendFile(const UdpEndpoint& endpoint, const wstring& path, uint8 version, bool broadcast);
+    void OfferFile(const UdpEndpoint& endpoint, const string& path, uint8 version, uint64 content);
+    SendingFilePtr OpenSendingFile(const UdpEndpoint& endpoint, const string& path, uint8 version);
+    bool MapSendingFile(SendingFilesContext* ctx);
+    void UnmapSendingFile(SendingFilesContext* ctx);
+    bool ResumeSendingFile(SendingFilePtr ctx);
+    void CloseSendingFile(uint32 id, const UdpEndpoint& from);
+    void ReleaseSendingFile(SendingFilePtr ctx);
+    void AddSendingFile(SendingFilePtr ctx);
+    void SendTo(const UdpEndpoint& endpoint, const Packet& m);
     void SendReqForFileBlockMsg(UploadingFilesContext* ctx);
-    void SendFileInfoMsg(SendingFilesContext* ctx);
+    void SendReqForLostBlocksMsg(UploadingFilesContext* ctx, const vector<bool>& expired);
+    void SendFileQuery(UploadingFilesContext* ctx);
+    void SendReqForSignaturesMsg(UploadingFilesContext* ctx);
+    void SendReqToSource(const FileSource& source, const BlockRanges& ranges);
+    void StartSendingFile(SendingFilePtr ctx);
+    void SendFileInfoMsg(SendingFilePtr ctx);
+    void SendFileBlocks(SendingFilePtr ctx, const BlockRanges& ranges, Duration holdoff);
+    void SendQueuedBlocks(SendingFilePtr ctx);
+    size_t CompressBlock(SendingFilesContext* ctx, uint32 block, cc_string data, uint32 size, c_string packed);
+    void AddToParity(SendingFilesContext* ctx, uint32 block, cc_string data, uint32 size, BulkSender& sender);
+    void SendParity(SendingFilesContext* ctx, BulkSender& sender);
+    void HandlePacingTimer(SendingFilePtr ctx, const ErrorCode& error);
 };
 
 #endif // CHAT_CLIENT_H
@@ -0,0 +1,169 @@
+#include "CongestionControl.h"
+
+// Constants for RTO
+
+static const int64_t INITIAL_RTO_US = 1000 * 1000; // microseconds. Timeout until the first RTT sample.
+static const int64_t MIN_RTO_US = 5 * 1000; // microseconds. Timers are not precise enough for less.
+static const int64_t MAX_RTO_US = 4 * 1000 * 1000; // microseconds. Backoff stops here.
+static const int64_t CLOCK_GRANULARITY_US = 1000; // microseconds.
+static const uint32 BACKOFF_MAX = 10; // 2^BACKOFF_MAX is more than MAX_RTO / MIN_RTO.
+
+// Constants for LEDBAT
+
+static const int64_t TARGET_DELAY_US = 10 * 1000; // microseconds. Queuing delay, which file transfer can make.
+static const double GAIN = 1.0; // window grows by GAIN blocks per round trip, when there is no queuing delay.
+static const size_t CURRENT_FILTER = 4; // samples. Current delay is the minimal delay of them.
+static const size_t BASE_HISTORY = 10; // minutes. Base delay is the minimal delay of them.
+
+// Constants for pacing
+
+static const double PACING_BURST = 10; // blocks. So many blocks can be sent at once (one GSO send).
+static const double PACING_GAIN = 1.25; // window is sent a bit faster than in one round trip, so the queue of the sender is drained.
+
+int64_t ToMicroseconds(Duration duration)
+{
+    return chrono::duration_cast<chrono::microseconds>(duration).count();
+}
+
+RttEstimator::RttEstimator() : _srtt(Duration::zero()), _rttvar(Duration::zero()), _backoff(0)
+{
+}
+
+void RttEstimator::OnSample(Duration rtt)
+{
+    if (_srtt == Duration::zero())
+    {
+        _srtt = rtt;
+        _rttvar = rtt / 2;
+    }
+    else
+    {
+        Duration delta = (_srtt > rtt) ? _srtt - rtt : rtt - _srtt;
+        _rttvar = (_rttvar * 3 + delta) / 4;
+        _srtt = (_srtt * 7 + rtt) / 8;
+    }
+
+    // the peer answers, so the timeout is correct again
+    _backoff = 0;
+}
+
+void RttEstimator::Backoff()
+{
+    if (_backoff < BACKOFF_MAX)
+        _backoff += 1;
+}
+
+Duration RttEstimator::GetRto() const
+{
+    int64_t rto = INITIAL_RTO_US;
+    if (_srtt != Duration::zero())
+        rto = ToMicroseconds(_srtt) + max<int64_t>(CLOCK_GRANULARITY_US, 4 * ToMicroseconds(_rttvar));
+
+    rto = max<int64_t>(MIN_RTO_US, rto) << _backoff;
+    return chrono::duration_cast<Duration>(chrono::microseconds(min<int64_t>(MAX_RTO_US, rto)));
+}
+
+LedbatController::LedbatController(uint32 minWindow, uint32 initialWindow, uint32 maxWindow)
+    : _window(initialWindow)
+    , _ssthresh(maxWindow)
+    , _minWindow(minWindow)
+    , _maxWindow(maxWindow)
+    , _currentDelays(CURRENT_FILTER)
+    , _baseDelays(BASE_HISTORY)
+    , _baseDelayUpdate(Clock::now())
+{
+}
+
+void LedbatController::OnRttSample(Duration rtt)
+{
+    // the oldest sample is dropped by the buffer itself
+    _currentDelays.push_back(rtt);
+
+    // every minute starts the new minimum, old minimums are forgotten (route can be changed)
+    TimePoint now = Clock::now();
+    if (_baseDelays.empty() || now - _baseDelayUpdate > chrono::minutes(1))
+    {
+        _baseDelays.push_back(rtt);
+        _baseDelayUpdate = now;
+    }
+    else if (rtt < _baseDelays.back())
+    {
+        _baseDelays.back() = rtt;
+    }
+}
+
+void LedbatController::OnAck()
+{
+    if (_currentDelays.empty())
+    {
+        // no delay samples yet (all blocks were re-sent), grow as TCP does
+        _window += 1.0 / _window;
+    }
+    else
+    {
+        Duration current = *min_element(_currentDelays.begin(), _currentDelays.end());
+        Duration base = *min_element(_baseDelays.begin(), _baseDelays.end());
+        int64_t queuing = ToMicroseconds(current - base);
+        double offTarget = (double)(TARGET_DELAY_US - queuing) / TARGET_DELAY_US;
+
+        // slow start: window is doubled every round trip while the queue is empty
+        if (_window < _ssthresh && queuing < TARGET_DELAY_US / 2)
+            _window += 1;
+        else
+            _window += GAIN * offTarget / _window;
+    }
+
+    _window = max<double>(_minWindow, min<double>(_maxWindow, _window));
+}
+
+void LedbatController::OnLoss()
+{
+    _window = max<double>(_minWindow, _window / 2);
+    _ssthresh = _window;
+}
+
+Pacer::Pacer() : _rate(0), _tokens(PACING_BURST), _last(Clock::now())
+{
+}
+
+void Pacer::SetRate(double blocksPerSecond)
+{
+    Refill(Clock::now());
+    _rate = blocksPerSecond;
+}
+
+void Pacer::SetWindow(uint32 window, Duration rtt)
+{
+    int64_t us = ToMicroseconds(rtt);
+    SetRate(us > 0 ? PACING_GAIN * window * 1000000 / us : 0);
+}
+
+uint32 Pacer::Take(TimePoint now, uint32 wanted)
+{
+    if (_rate <= 0)
+        return wanted;
+
+    Refill(now);
+    uint32 count = min<uint32>(wanted, (uint32)_tokens);
+    _tokens -= count;
+    return count;
+}
+
+Duration Pacer::Delay(TimePoint now) const
+{
+    if (_rate <= 0)
+        return Duration::zero();
+
+    double tokens = _tokens + _rate * chrono::duration<double>(now - _last).count();
+    if (tokens >= 1)
+        return Duration::zero();
+
+    return chrono::duration_cast<Duration>(chrono::duration<double>((1 - tokens) / _rate));
+}
+
+void Pacer::Refill(TimePoint now)
+{
+    if (_rate > 0)
+        _tokens = min<double>(PACING_BURST, _tokens + _rate * chrono::duration<double>(now - _last).count());
+    _last = now;
+}
@@ -0,0 +1,78 @@
+#ifndef CONGESTION_CONTROL_H
+#define CONGESTION_CONTROL_H
+
+#include "utils.h"
+
+/*
+Retransmission timeout of the transfer (Jacobson/Karels, RFC 6298).
+Timeout is doubled after every expiration (exponential backoff) until the next RTT sample.
+*/
+class RttEstimator
+{
+public:
+    RttEstimator();
+    ~RttEstimator() { }
+
+    void OnSample(Duration rtt);
+    void Backoff();
+
+    Duration GetSmoothed() const { return _srtt; } // zero, if there are no samples yet
+    Duration GetRto() const;
+private:
+    Duration _srtt;     // smoothed round trip time
+    Duration _rttvar;   // its variation
+    uint32 _backoff;    // timeout is multiplied by 2^_backoff
+};
+
+/*
+Delay-based congestion control of the downloading file (LEDBAT, RFC 6817).
+Window is counted in blocks. It grows while the queuing delay (current RTT - base RTT) is less than the target
+and shrinks when the delay grows (somebody else uses the link) or when blocks are lost.
+So file transfers take the whole idle link, but yield to the chat and other traffic.
+*/
+class LedbatController
+{
+public:
+    LedbatController(uint32 minWindow, uint32 initialWindow, uint32 maxWindow);
+    ~LedbatController() { }
+
+    void OnRttSample(Duration rtt);
+    void OnAck();
+    void OnLoss();
+
+    uint32 GetWindow() const { return (uint32)_window; }
+private:
+    double _window;
+    double _ssthresh;
+    uint32 _minWindow;
+    uint32 _maxWindow;
+    boost::circular_buffer<Duration> _currentDelays;    // last samples, current delay is the minimal of them
+    boost::circular_buffer<Duration> _baseDelays;       // minimal delays of the last minutes, base delay is the minimal of them
+    TimePoint _baseDelayUpdate;     // when the last minute has begun
+};
+
+/*
+Token bucket, which spreads blocks of the sending file over the round trip time instead of sending the whole window at once.
+Rate 0 means "no limit".
+*/
+class Pacer
+{
+public:
+    Pacer();
+    ~Pacer() { }
+
+    void SetRate(double blocksPerSecond);
+    void SetWindow(uint32 window, Duration rtt); // window of blocks per round trip
+    uint32 Take(TimePoint now, uint32 wanted);  // returns quantity of blocks, which can be sent now
+    Duration Delay(TimePoint now) const;        // time until the next block can be sent
+private:
+    double _rate;       // blocks per second
+    double _tokens;     // blocks
+    TimePoint _last;    // tokens were counted at this moment
+
+    void Refill(TimePoint now);
+};
+
+int64_t ToMicroseconds(Duration duration);
+
+#endif // CONGESTION_CONTROL_H
@@ -0,0 +1,166 @@
+#include "Crc32c.h"
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define CRC32C_X86
+#include <nmmintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#endif
+#elif defined(__ARM_FEATURE_CRC32)
+#define CRC32C_ARM
+#include <arm_acle.h>
+#endif
+
+static const uint32 POLY = 0x82F63B78; // reflected polynomial of CRC-32C
+
+// tables of slicing by 8: table[k][b] is CRC of byte b followed by k zero bytes
+
+struct Crc32cTables
+{
+    uint32 table[8][256];
+
+    Crc32cTables()
+    {
+        for (uint32 b = 0; b < 256; ++b)
+        {
+            uint32 crc = b;
+            for (int i = 0; i < 8; ++i)
+                crc = (crc & 1) ? (crc >> 1) ^ POLY : crc >> 1;
+            table[0][b] = crc;
+        }
+        for (uint32 b = 0; b < 256; ++b)
+        {
+            for (int k = 1; k < 8; ++k)
+                table[k][b] = (table[k - 1][b] >> 8) ^ table[0][table[k - 1][b] & 0xFF];
+        }
+    }
+};
+
+static const Crc32cTables Tables;
+
+// x^(2^n) mod P, n = 0..63 (the shift by 2^n bits)
+
+struct Crc32cPowers
+{
+    uint32 power[64];
+
+    Crc32cPowers()
+    {
+        power[0] = 1u << 30;    // x^1
+        for (int n = 1; n < 64; ++n)
+            power[n] = Crc32c::Multiply(power[n - 1], power[n - 1]);
+    }
+};
+
+static const Crc32cPowers Powers;
+
+#ifdef CRC32C_X86
+static bool HasSse42()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    return (info[2] & (1 << 20)) != 0;
+#else
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("sse4.2") != 0;
+#endif
+}
+
+static const bool UseSse42 = HasSse42();
+#endif
+
+uint32 Crc32c::Compute(cc_string data, size_t size, uint32 crc)
+{
+    const uint8* bytes = (const uint8*)data;
+    crc = ~crc;
+
+#if defined(CRC32C_X86)
+    crc = UseSse42 ? ComputeSse42(crc, bytes, size) : ComputeTables(crc, bytes, size);
+#elif defined(CRC32C_ARM)
+    for (; size >= 8; size -= 8, bytes += 8)
+    {
+        uint64 word;
+        memcpy(&word, bytes, sizeof(word));
+        crc = __crc32cd(crc, word);
+    }
+    for (; size > 0; --size)
+        crc = __crc32cb(crc, *bytes++);
+#else
+    crc = ComputeTables(crc, bytes, size);
+#endif
+
+    return ~crc;
+}
+
+uint32 Crc32c::ComputeTables(uint32 crc, const uint8* data, size_t size)
+{
+    const uint32 (*t)[256] = Tables.table;
+
+    for (; size >= 8; size -= 8, data += 8)
+    {
+        uint32 low = crc ^ (data[0] | (data[1] << 8) | (data[2] << 16) | ((uint32)data[3] << 24));
+        crc = t[7][low & 0xFF] ^ t[6][(low >> 8) & 0xFF] ^ t[5][(low >> 16) & 0xFF] ^ t[4][low >> 24]
+            ^ t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    }
+    for (; size > 0; --size)
+        crc = (crc >> 8) ^ t[0][(crc ^ *data++) & 0xFF];
+
+    return crc;
+}
+
+#ifdef CRC32C_X86
+#if defined(__GNUC__) && !defined(__SSE4_2__)
+__attribute__((target("sse4.2")))
+#endif
+uint32 Crc32c::ComputeSse42(uint32 crc, const uint8* data, size_t size)
+{
+#if defined(__x86_64__) || defined(_M_X64)
+    uint64 crc64 = crc;
+    for (; size >= 8; size -= 8, data += 8)
+    {
+        uint64 word;
+        memcpy(&word, data, sizeof(word));
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32)crc64;
+#endif
+    for (; size >= 4; size -= 4, data += 4)
+    {
+        uint32 word;
+        memcpy(&word, data, sizeof(word));
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for (; size > 0; --size)
+        crc = _mm_crc32_u8(crc, *data++);
+
+    return crc;
+}
+#endif
+
+// a * b mod P (reflected: x^0 is the highest bit)
+
+uint32 Crc32c::Multiply(uint32 a, uint32 b)
+{
+    uint32 product = 0;
+    for (uint32 m = 1u << 31; m != 0; m >>= 1)
+    {
+        if (a & m)
+            product ^= b;
+        b = (b & 1) ? (b >> 1) ^ POLY : b >> 1;
+    }
+    return product;
+}
+
+// x^(8 * size) mod P
+
+uint32 Crc32c::Shift(uint64 size)
+{
+    uint32 shift = 1u << 31;    // x^0
+    for (int n = 3; size != 0 && n < 64; size >>= 1, ++n)
+    {
+        if (size & 1)
+            shift = Multiply(Powers.power[n], shift);
+    }
+    return shift;
+}
@@ -0,0 +1,30 @@
+#ifndef CRC32C_H
+#define CRC32C_H
+
+#include "utils.h"
+
+/*
+CRC-32C (Castagnoli) of file blocks and of whole files.
+It is computed by the CRC32 instruction of SSE 4.2 (checked at run time) or ARMv8,
+else by tables (slicing by 8).
+CRC of the whole file is combined from CRCs of its blocks, so blocks are read once and in any order:
+    crc(A + B) = Multiply(crc(A), Shift(size(B))) ^ crc(B)
+*/
+class Crc32c
+{
+public:
+    // crc is the CRC of the previous bytes (0 - nothing before)
+    static uint32 Compute(cc_string data, size_t size, uint32 crc = 0);
+
+    // operator of appending so many bytes (it can be computed once for blocks of the same size)
+    static uint32 Shift(uint64 size);
+    static uint32 Multiply(uint32 crc, uint32 shift);
+    static uint32 Combine(uint32 crc1, uint32 crc2, uint64 size2) { return Multiply(crc1, Shift(size2)) ^ crc2; }
+private:
+    static uint32 ComputeTables(uint32 crc, const uint8* data, size_t size);
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+    static uint32 ComputeSse42(uint32 crc, const uint8* data, size_t size);
+#endif
+};
+
+#endif // CRC32C_H
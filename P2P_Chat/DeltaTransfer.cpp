@@ -0,0 +1,179 @@
+#include "DeltaTransfer.h"
+#include "Crc32c.h"
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DELTA_SSE2
+#include <emmintrin.h>
+#endif
+
+void RollingChecksum::Reset(cc_string data, size_t size)
+{
+    Sums((const uint8*)data, size, _a, _b);
+    _size = size;
+}
+
+uint32 RollingChecksum::Compute(cc_string data, size_t size)
+{
+    RollingChecksum sum;
+    sum.Reset(data, size);
+    return sum.Get();
+}
+
+#ifdef DELTA_SSE2
+static uint32 HorizontalSum(__m128i v)
+{
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(1, 0, 3, 2)));
+    v = _mm_add_epi32(v, _mm_shuffle_epi32(v, _MM_SHUFFLE(2, 3, 0, 1)));
+    return (uint32)_mm_cvtsi128_si32(v);
+}
+#endif
+
+// b = n * a - (0 * x[0] + 1 * x[1] + ... + (n - 1) * x[n-1]), all sums are modulo 2^32
+// SSE2 counts 16 bytes per step: sums of steps (SAD), sums of previous steps (for the weight of the step)
+// and weights of bytes inside the step (multiply-add)
+
+void RollingChecksum::Sums(const uint8* data, size_t size, uint32& a, uint32& b)
+{
+    uint32 sum = 0;         // of x[i]
+    uint32 weighted = 0;    // of i * x[i]
+    size_t i = 0;
+
+#ifdef DELTA_SSE2
+    size_t steps = size / 16;
+    if (steps > 0)
+    {
+        const __m128i zero = _mm_setzero_si128();
+        const __m128i lowWeights = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+        const __m128i highWeights = _mm_setr_epi16(8, 9, 10, 11, 12, 13, 14, 15);
+        __m128i sums = zero;        // of all steps before
+        __m128i previous = zero;    // of sums before every step
+        __m128i inner = zero;       // of weights inside steps
+
+        for (size_t step = 0; step < steps; ++step)
+        {
+            __m128i bytes = _mm_loadu_si128((const __m128i*)(data + step * 16));
+            previous = _mm_add_epi32(previous, sums);
+            sums = _mm_add_epi32(sums, _mm_sad_epu8(bytes, zero));
+            inner = _mm_add_epi32(inner, _mm_madd_epi16(_mm_unpacklo_epi8(bytes, zero), lowWeights));
+            inner = _mm_add_epi32(inner, _mm_madd_epi16(_mm_unpackhi_epi8(bytes, zero), highWeights));
+        }
+
+        // step s has the weight 16 * s: sum of s * sum(s) is (steps - 1) * sum - previous
+        sum = HorizontalSum(sums);
+        weighted = 16 * ((uint32)(steps - 1) * sum - HorizontalSum(previous)) + HorizontalSum(inner);
+        i = steps * 16;
+    }
+#endif
+
+    for (; i < size; ++i)
+    {
+        sum += data[i];
+        weighted += (uint32)i * data[i];
+    }
+
+    a = sum;
+    b = (uint32)size * sum - weighted;
+}
+
+DeltaMatcher::DeltaMatcher(const vector<uint32>& weakSums, const vector<uint32>& crcs, uint64 size, uint32 blockSize)
+    : _weakSums(weakSums)
+    , _crcs(crcs)
+    , _size(size)
+    , _blockSize(blockSize)
+    , _filter((size_t)1 << DELTA_FILTER_BITS, false)
+{
+    uint32 fullBlocks = (uint32)min<uint64>(weakSums.size(), size / blockSize);
+    _index.reserve(fullBlocks);
+    for (uint32 block = 0; block < fullBlocks; ++block)
+    {
+        _index.push_back(make_pair(weakSums[block], block));
+        _filter[Slot(weakSums[block])] = true;
+    }
+    sort(_index.begin(), _index.end());
+}
+
+// full blocks are looked for at every offset of the old copy: the window jumps over the found block,
+// else it is rolled by one byte
+// the last short block is looked for on its own place and at the end of the old copy (the file is often appended)
+
+uint32 DeltaMatcher::Match(cc_string basis, uint64 basisSize, vector<uint64>& offsets) const
+{
+    uint32 blocks = (uint32)_weakSums.size();
+    offsets.assign(blocks, DELTA_NO_MATCH);
+    uint32 found = 0;
+
+    if (!_index.empty() && basisSize >= _blockSize)
+    {
+        const uint8* data = (const uint8*)basis;
+        uint64 last = basisSize - _blockSize;
+        uint64 pos = 0;
+        RollingChecksum sum;
+        sum.Reset(basis, _blockSize);
+
+        for (;;)
+        {
+            uint32 weak = sum.Get();
+            bool matched = false;
+            if (MayHave(weak))
+            {
+                uint32 crc = 0;
+                bool crcKnown = false;
+                vector<pair<uint32, uint32> >::const_iterator it = lower_bound(_index.begin(), _index.end(), make_pair(weak, (uint32)0));
+                for (; it != _index.end() && it->first == weak; ++it)
+                {
+                    uint32 block = it->second;
+                    if (offsets[block] != DELTA_NO_MATCH)
+                        continue;
+
+                    // equal blocks (zeros) are found at once
+                    if (!crcKnown)
+                    {
+                        crc = Crc32c::Compute(basis + pos, _blockSize);
+                        crcKnown = true;
+                    }
+                    if (crc != _crcs[block])
+                        continue;
+
+                    offsets[block] = pos;
+                    found += 1;
+                    matched = true;
+                }
+            }
+
+            if (matched)
+            {
+                pos += _blockSize;
+                if (pos > last)
+                    break;
+                sum.Reset(basis + pos, _blockSize);
+            }
+            else
+            {
+                if (pos == last)
+                    break;
+                sum.Roll(data[pos], data[pos + _blockSize]);
+                pos += 1;
+            }
+        }
+    }
+
+    uint64 lastOffset = (uint64)(blocks - 1) * _blockSize;
+    uint64 tail = blocks > 0 ? _size - lastOffset : 0;
+    if (tail > 0 && tail < _blockSize && offsets[blocks - 1] == DELTA_NO_MATCH)
+    {
+        uint64 places[2] = { lastOffset, basisSize >= tail ? basisSize - tail : DELTA_NO_MATCH };
+        for (int i = 0; i < 2; ++i)
+        {
+            if (places[i] == DELTA_NO_MATCH || places[i] + tail > basisSize)
+                continue;
+            if (Crc32c::Compute(basis + places[i], (size_t)tail) == _crcs[blocks - 1])
+            {
+                offsets[blocks - 1] = places[i];
+                found += 1;
+                break;
+            }
+        }
+    }
+
+    return found;
+}
@@ -0,0 +1,67 @@
+#ifndef DELTA_TRANSFER_H
+#define DELTA_TRANSFER_H
+
+#include "utils.h"
+
+#define DELTA_NO_MATCH ((uint64)-1)     // the block isn't found in the old copy
+#define DELTA_FILTER_BITS 20            // bits. Filter of weak sums: most positions of the old copy miss it without a search.
+#define DELTA_BASIS_EXTENSION ".basis"  // old copy of the file lies here, while the delta is found
+
+/*
+Delta transfer of the file, which the receiver has an older copy of (rsync algorithm, run by the receiver).
+The sender tells the signature of every block: the weak rolling sum and CRC-32C (M_FILE_SIGNATURES).
+The receiver rolls the weak sum over its old copy byte by byte, checks CRC-32C on hits of the weak sum,
+copies found blocks into the new file and downloads only the rest.
+Weak sum of n bytes x[0..n-1] (as in rsync):
+    a = x[0] + ... + x[n-1]
+    b = n * x[0] + (n - 1) * x[1] + ... + 1 * x[n-1]
+    sum = (a & 0xFFFF) | (b << 16)
+It is rolled by one byte in O(1), and the sum of the whole window is counted by SSE2 (16 bytes per step).
+*/
+class RollingChecksum
+{
+public:
+    RollingChecksum() : _a(0), _b(0), _size(0) { }
+
+    // sum of the window (it is rolled then)
+    void Reset(cc_string data, size_t size);
+    // the window moves by one byte: out leaves it, in comes
+    void Roll(uint8 out, uint8 in)
+    {
+        _a += in - out;
+        _b += _a - (uint32)_size * out;
+    }
+
+    uint32 Get() const { return (_a & 0xFFFF) | (_b << 16); }
+
+    static uint32 Compute(cc_string data, size_t size);
+private:
+    static void Sums(const uint8* data, size_t size, uint32& a, uint32& b);
+
+    uint32 _a;
+    uint32 _b;
+    size_t _size;
+};
+
+// blocks of the new file, which the old copy has (at any offset)
+class DeltaMatcher
+{
+public:
+    // signatures of all blocks of the new file (the last one can be shorter)
+    DeltaMatcher(const vector<uint32>& weakSums, const vector<uint32>& crcs, uint64 size, uint32 blockSize);
+
+    // offset of every block in the old copy (DELTA_NO_MATCH - not found), quantity of found blocks
+    uint32 Match(cc_string basis, uint64 basisSize, vector<uint64>& offsets) const;
+private:
+    bool MayHave(uint32 weak) const { return _filter[Slot(weak)]; }
+    static size_t Slot(uint32 weak) { return (weak * 2654435761u) >> (32 - DELTA_FILTER_BITS); }
+
+    const vector<uint32>& _weakSums;
+    const vector<uint32>& _crcs;
+    uint64 _size;
+    uint32 _blockSize;
+    vector<pair<uint32, uint32> > _index;  // weak sum, block (full blocks by the sum)
+    vector<bool> _filter;                   // weak sums, which are in the index
+};
+
+#endif // DELTA_TRANSFER_H
@@ -0,0 +1,100 @@
+#include "Fec.h"
+
+void FecEncoder::Add(uint32 block, cc_string data, size_t size)
+{
+    if (find(_blocks, _blocks + _count, block) != _blocks + _count)
+        return;
+
+    // bytes after the current size are zeros in the parity, so they are copied
+    size_t common = min(size, _size);
+    Xor(_parity, data, common);
+    if (size > _size)
+    {
+        memcpy(_parity + common, data + common, size - common);
+        _size = size;
+    }
+
+    _blocks[_count++] = block;
+}
+
+uint32 FecEncoder::GroupSize(uint8 loss)
+{
+    if (loss < FEC_LOSS_MIN)
+        return 0;
+    return max<uint32>(FEC_GROUP_MIN, min<uint32>(FEC_GROUP_MAX, FEC_LOSS_PER_GROUP / loss));
+}
+
+void FecEncoder::Xor(c_string dst, cc_string src, size_t size)
+{
+    size_t i = 0;
+    for (; i + sizeof(uint64) <= size; i += sizeof(uint64))
+    {
+        uint64 a, b;
+        memcpy(&a, dst + i, sizeof(a));
+        memcpy(&b, src + i, sizeof(b));
+        a ^= b;
+        memcpy(dst + i, &a, sizeof(a));
+    }
+    for (; i < size; ++i)
+        dst[i] ^= src[i];
+}
+
+void FecDecoder::Activate()
+{
+    _data.resize((size_t)FEC_KEPT_BLOCKS * FILE_BLOCK_MAX);
+    _blocks.assign(FEC_KEPT_BLOCKS, 0);
+    _sizes.assign(FEC_KEPT_BLOCKS, 0);
+}
+
+void FecDecoder::Keep(uint32 block, cc_string data, size_t size)
+{
+    size_t slot = block % FEC_KEPT_BLOCKS;
+    memcpy(&_data[slot * FILE_BLOCK_MAX], data, size);
+    _blocks[slot] = block + 1;
+    _sizes[slot] = (uint16)size;
+}
+
+bool FecDecoder::Recover(const uint32* blocks, uint32 count, cc_string parity, size_t paritySize, const vector<bool>& received,
+    uint32& missing, c_string block) const
+{
+    if (!IsActive() || paritySize > FILE_BLOCK_MAX)
+        return false;
+
+    uint32 missingCount = 0;
+    for (uint32 i = 0; i < count; ++i)
+    {
+        if (blocks[i] >= received.size())
+            return false;
+        if (received[blocks[i]])
+            continue;
+        missing = blocks[i];
+        missingCount += 1;
+    }
+    if (missingCount != 1)
+        return false;
+
+    memcpy(block, parity, paritySize);
+    for (uint32 i = 0; i < count; ++i)
+    {
+        uint32 b = blocks[i];
+        if (b == missing)
+            continue;
+
+        size_t slot = b % FEC_KEPT_BLOCKS;
+        if (_blocks[slot] != b + 1 || _sizes[slot] > paritySize)
+            return false;
+        FecEncoder::Xor(block, &_data[slot * FILE_BLOCK_MAX], _sizes[slot]);
+    }
+
+    return true;
+}
+
+void LossEstimator::OnRequested(uint32 blocks)
+{
+    _sent += blocks;
+    if (_sent < FEC_LOSS_WINDOW)
+        return;
+
+    _sent /= 2;
+    _lost /= 2;
+}
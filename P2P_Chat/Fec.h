@@ -0,0 +1,83 @@
+#ifndef FEC_H
+#define FEC_H
+
+#include "utils.h"
+#include "message_formats.h"
+
+#define FEC_LOSS_MIN 2          // 1/255. Parity isn't sent, while the receiver sees smaller loss.
+#define FEC_LOSS_PER_GROUP 85   // 1/255. Expected losses in one group (1/3 of a block): the group is so small, that one parity recovers it.
+#define FEC_GROUP_MIN 2         // blocks. Smaller groups are sent only, when the queue is sent out.
+#define FEC_LOSS_WINDOW 1024    // blocks. Counters of the loss are halved after so many blocks (old losses are forgotten).
+#define FEC_KEPT_BLOCKS FILE_WINDOW_MAX // blocks. The receiver keeps so many last blocks for recovery.
+
+/*
+Forward error correction of file blocks by XOR parity.
+The sender XORs every group of blocks, which it sends one after another (first sendings and re-sendings), into one
+parity block (M_FILE_PARITY with numbers of the blocks). The group is closed, when it is full or the queue is sent out.
+The receiver recovers one lost block of the group from the parity and the other blocks without a round trip.
+Size of the group follows the loss, which the receiver reports in its requests:
+about 1/3 of a block is lost per group, no parity is sent on clean links.
+*/
+
+// the sender: parity of the current group
+class FecEncoder
+{
+public:
+    FecEncoder() : _count(0), _size(0) { }
+
+    // the group mustn't be full, a block, which is in it already, is skipped
+    void Add(uint32 block, cc_string data, size_t size);
+    void Reset() { _count = 0; _size = 0; }
+
+    uint32 Count() const { return _count; }
+    const uint32* Blocks() const { return _blocks; }
+    cc_string Data() const { return _parity; }
+    size_t Size() const { return _size; }
+
+    // blocks in the group for this loss, 0 - parity isn't needed
+    static uint32 GroupSize(uint8 loss);
+    // dst ^= src (by machine words, the compiler vectorizes it)
+    static void Xor(c_string dst, cc_string src, size_t size);
+private:
+    uint32 _blocks[FEC_GROUP_MAX];
+    uint32 _count;
+    size_t _size;       // of the longest block (shorter ones are padded by zeros)
+    char _parity[FILE_BLOCK_MAX];
+};
+
+// the receiver: last blocks, which can be needed for recovery (memory is taken, when losses are seen)
+class FecDecoder
+{
+public:
+    FecDecoder() { }
+
+    bool IsActive() const { return !_data.empty(); }
+    void Activate();
+    void Keep(uint32 block, cc_string data, size_t size);
+
+    // lost block of the group is restored into block (FILE_BLOCK_MAX bytes, padded size is the size of the parity)
+    // false, if other blocks than one are missing or some received ones aren't kept anymore
+    bool Recover(const uint32* blocks, uint32 count, cc_string parity, size_t paritySize, const vector<bool>& received,
+        uint32& missing, c_string block) const;
+private:
+    vector<char> _data;         // FEC_KEPT_BLOCKS of FILE_BLOCK_MAX bytes (ring by block number)
+    vector<uint32> _blocks;     // block in the slot + 1 (0 - empty)
+    vector<uint16> _sizes;
+};
+
+// loss of blocks, which the receiver sees (lost blocks are recovered or requested again)
+class LossEstimator
+{
+public:
+    LossEstimator() : _sent(0), _lost(0) { }
+
+    void OnRequested(uint32 blocks);
+    void OnLost(uint32 blocks) { _lost += blocks; }
+
+    uint8 Get() const { return _sent > 0 ? (uint8)min<uint64>(255, (uint64)_lost * 255 / _sent) : 0; }
+private:
+    uint32 _sent;
+    uint32 _lost;
+};
+
+#endif // FEC_H
@@ -2,10 +2,71 @@
 
 unique_ptr<Logger> Logger::_instance;
 once_flag Logger::_onceFlag;
+atomic<int> Logger::_level(LOG_MIN_LEVEL);
 
-Logger::Logger() : _timePosted(false)
+static const uint32 LOG_POLL_MS = 10; // milliseconds. The ring is read so often (so it isn't filled by bursts).
+static const uint32 LOG_FLUSH_MS = 1000; // milliseconds. Buffered records are written to the file at least so often.
+static const size_t LOGFILE_BUFFER = 256 * 1024; // bytes. Records are written to the file by such pieces.
+
+LogRecord::Arg* LogRecord::Next(ArgType type)
+{
+    if (count == LOG_ARGS_MAX)
+        return 0;
+
+    Arg* arg = &args[count++];
+    arg->type = (uint8)type;
+    return arg;
+}
+
+void LogRecord::AddText(const char* s, size_t length)
+{
+    Arg* arg = Next(ARG_TEXT);
+    if (!arg)
+        return;
+
+    length = min<size_t>(length, LOG_TEXT_MAX - textLength);
+    memcpy(text + textLength, s, length);
+    arg->text.offset = textLength;
+    arg->text.length = (uint16)length;
+    textLength += (uint16)length;
+}
+
+string LogRecord::Format() const
+{
+    time_t seconds = (time_t)(time / 1000000);
+    char buffer[50];
+    strftime(buffer, 50, "[%Y-%m-%d %H:%M:%S]", localtime(&seconds));
+
+    stringstream ss;
+    ss << buffer;
+    for (uint8 i = 0; i < count; ++i)
+    {
+        const Arg& arg = args[i];
+        switch (arg.type)
+        {
+        case ARG_INT: ss << arg.i; break;
+        case ARG_UINT: ss << arg.u; break;
+        case ARG_DOUBLE: ss << arg.d; break;
+        case ARG_CHAR: ss << arg.c; break;
+        case ARG_TEXT: ss.write(text + arg.text.offset, arg.text.length); break;
+        }
+    }
+    ss << endl;
+    return ss.str();
+}
+
+Logger::Logger()
+    : _ring(new Cell[LOG_RING_SIZE])
+    , _enqueuePos(0)
+    , _dequeuePos(0)
+    , _dropped(0)
+    , _maxFileSize(LOGFILE_MAX_SIZE)
+    , _keepFiles(LOGFILE_KEEP)
+    , _enable(false)
 {
-    _loggerMutex.initialize();
+    for (size_t i = 0; i < LOG_RING_SIZE; ++i)
+        _ring[i].sequence.store(i, memory_order_relaxed);
+
     Enable();
 }
 
@@ -13,8 +74,6 @@ Logger::Logger() : _timePosted(false)
 Logger::~Logger()
 {
     Disable();
-    _logFile.close();
-    _loggerMutex.destroy();
 }
 
 void Logger::Enable()
@@ -36,46 +95,176 @@ void Logger::Disable()
 }
 
 
-SmartLoggerPtr Logger::GetInstance()
+Logger* Logger::GetInstance()
 {
     call_once(_onceFlag, [] {
         _instance.reset(new Logger);
     }
     );
-    return SmartLoggerPtr(*_instance.get());
+    return _instance.get();
 }
 
+int64_t Logger::Now()
+{
+    return chrono::duration_cast<chrono::microseconds>(chrono::system_clock::now().time_since_epoch()).count();
+}
+
+// take a free cell of the ring (0, if the ring is full)
 
-void Logger::InsertTimeInString(stringstream& strStream)
+LogRecord* Logger::Claim(size_t& position)
 {
-    time_t rawTime;
-    struct tm* timeinfo;
-    char buffer[50];
+    position = _enqueuePos.load(memory_order_relaxed);
+    for (;;)
+    {
+        Cell& cell = _ring[position & (LOG_RING_SIZE - 1)];
+        size_t sequence = cell.sequence.load(memory_order_acquire);
+        intptr_t diff = (intptr_t)sequence - (intptr_t)position;
+        if (diff == 0)
+        {
+            if (_enqueuePos.compare_exchange_weak(position, position + 1, memory_order_relaxed))
+                return &cell.record;
+        }
+        else if (diff < 0)
+        {
+            // LOG_THREAD hasn't written this cell yet
+            return 0;
+        }
+        else
+        {
+            position = _enqueuePos.load(memory_order_relaxed);
+        }
+    }
+}
+
+void Logger::Publish(size_t position)
+{
+    _ring[position & (LOG_RING_SIZE - 1)].sequence.store(position + 1, memory_order_release);
+}
 
-    time(&rawTime);
-    timeinfo = localtime(&rawTime);
+// format all published records and free their cells (LOG_THREAD)
+
+void Logger::WriteRecords(LogFile& file)
+{
+    file.SetLimits(_maxFileSize, _keepFiles);
+
+    for (;;)
+    {
+        Cell& cell = _ring[_dequeuePos & (LOG_RING_SIZE - 1)];
+        if (cell.sequence.load(memory_order_acquire) != _dequeuePos + 1)
+            break;
 
-    strftime(buffer, 50, "[%Y-%m-%d %H:%M:%S]", timeinfo);
-    strStream << buffer;
+        file.Write(cell.record.Format());
+        cell.sequence.store(_dequeuePos + LOG_RING_SIZE, memory_order_release);
+        _dequeuePos += 1;
+    }
+
+    uint64_t dropped = _dropped.exchange(0);
+    if (dropped)
+    {
+        LogRecord record;
+        record.Start(Now());
+        record.Add(dropped);
+        record.Add(" log records were dropped (the ring is full)");
+        file.Write(record.Format());
+    }
 }
 
 // Thread function: LOG_THREAD
 
 void Logger::MessageQueueHandler()
 {
+    LogFile file(LOGFILE_PATH);
+
+    uint32 sinceFlush = 0;
     while (!DoShutdown && _enable)
     {
-        boost::this_thread::sleep(boost::posix_time::seconds(1));
+        boost::this_thread::sleep(boost::posix_time::milliseconds(LOG_POLL_MS));
+        WriteRecords(file);
+
+        // the buffer is written by itself, when it is full
+        sinceFlush += LOG_POLL_MS;
+        if (sinceFlush >= LOG_FLUSH_MS)
         {
-            ScopedLock lk(_loggerMutex);
-            _logFile.open(LOGFILE_PATH, ios_base::app);
-            while (!_messageQueue.empty())
-            {
-                _logFile << _messageQueue.front();
-                _messageQueue.pop();
-            }
-            _logFile.close();
+            file.Flush();
+            sinceFlush = 0;
         }
     }
 
+    // the last records (file is flushed by its destructor)
+    WriteRecords(file);
+}
+
+LogFile::LogFile(const string& path)
+    : _path(path)
+    , _maxSize(LOGFILE_MAX_SIZE)
+    , _keepFiles(LOGFILE_KEEP)
+    , _size(0)
+    , _buffer(LOGFILE_BUFFER)
+{
+    Open();
+}
+
+LogFile::~LogFile()
+{
+    _file.close();
+}
+
+void LogFile::SetLimits(uint64_t maxSize, uint32 keepFiles)
+{
+    _maxSize = maxSize;
+    _keepFiles = keepFiles;
+}
+
+void LogFile::Open()
+{
+    // buffer must be set before the file is opened
+    _file.rdbuf()->pubsetbuf(&_buffer[0], _buffer.size());
+    _file.open(_path.c_str(), ios_base::app);
+
+    ErrorCode ec;
+    _size = boost::filesystem::file_size(_path, ec);
+    if (ec)
+        _size = 0;
+}
+
+void LogFile::Write(const string& text)
+{
+    if (_size > 0 && _size + text.size() > _maxSize)
+        Rotate();
+
+    _file.write(text.data(), text.size());
+    _size += text.size();
+}
+
+void LogFile::Flush()
+{
+    _file.flush();
+}
+
+string LogFile::RotatedPath(uint32 index) const
+{
+    stringstream ss;
+    ss << _path << "." << index;
+    return ss.str();
+}
+
+void LogFile::Rotate()
+{
+    _file.close();
+
+    ErrorCode ec;
+    if (_keepFiles == 0)
+    {
+        boost::filesystem::remove(_path, ec);
+    }
+    else
+    {
+        boost::filesystem::remove(RotatedPath(_keepFiles), ec);
+        for (uint32 i = _keepFiles - 1; i > 0; --i)
+            boost::filesystem::rename(RotatedPath(i), RotatedPath(i + 1), ec);
+        boost::filesystem::rename(_path, RotatedPath(1), ec);
+    }
+
+    _file.clear();
+    Open();
 }
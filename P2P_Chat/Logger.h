@@ -3,101 +3,227 @@
 
 #include "utils.h"
 #include <mutex>
-#include <queue>
+#include <atomic>
+#include <type_traits>
 
 #define LOGFILE_PATH "chat_client.log"
+#define LOGFILE_MAX_SIZE (16 * 1024 * 1024)  // bytes. The file is rotated, when it reaches this size.
+#define LOGFILE_KEEP 4                      // rotated files (chat_client.log.1 is the newest one)
+
+// Log levels
+#define LOG_LEVEL_TRACE 0   // every packet
+#define LOG_LEVEL_DEBUG 1   // unusual packets, timeouts
+#define LOG_LEVEL_INFO 2    // peers and files
+#define LOG_LEVEL_ERROR 3
+
+// Calls of lower levels are removed by the preprocessor (Release builds use LOG_LEVEL_INFO)
+#ifndef LOG_MIN_LEVEL
+#define LOG_MIN_LEVEL LOG_LEVEL_TRACE
+#endif
+
+// Level is checked before anything is done (even before the logger is created)
+#define LOG_AT(level, ...) do { if (Logger::IsEnabled(level)) Logger::GetInstance()->Trace(__VA_ARGS__); } while (0)
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_TRACE
+#define LOG_TRACE(...) LOG_AT(LOG_LEVEL_TRACE, __VA_ARGS__)
+#else
+#define LOG_TRACE(...) ((void)0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_AT(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...) ((void)0)
+#endif
+
+#if LOG_MIN_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_AT(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...) ((void)0)
+#endif
+
+#define LOG_ERROR(...) LOG_AT(LOG_LEVEL_ERROR, __VA_ARGS__)
+
+#define LOG_RING_SIZE 4096  // records (power of 2)
+#define LOG_ARGS_MAX 12     // arguments of one record
+#define LOG_TEXT_MAX 240    // bytes of strings of one record
+
+/*
+One message of the log in the binary form: time and arguments as they were passed to Trace.
+Numbers are kept as numbers, strings are copied (and truncated) into the text of the record.
+Records are formatted only by LOG_THREAD.
+*/
+struct LogRecord
+{
+    enum ArgType { ARG_INT, ARG_UINT, ARG_DOUBLE, ARG_CHAR, ARG_TEXT };
+
+    struct Arg
+    {
+        uint8 type;
+        union
+        {
+            int64_t i;
+            uint64_t u;
+            double d;
+            char c;
+            struct { uint16 offset, length; } text;
+        };
+    };
+
+    int64_t time;   // microseconds since epoch
+    uint8 count;    // quantity of args
+    uint16 textLength;
+    Arg args[LOG_ARGS_MAX];
+    char text[LOG_TEXT_MAX];
+
+    void Start(int64_t now) { time = now; count = 0; textLength = 0; }
+
+    void Add(const char* s) { AddText(s, s ? strlen(s) : 0); }
+    void Add(const string& s) { AddText(s.data(), s.size()); }
+    void Add(char c) { if (Arg* arg = Next(ARG_CHAR)) arg->c = c; }
+
+    template <typename T> void Add(const T& value)
+    {
+        AddValue(value, typename is_integral<T>::type(), typename is_floating_point<T>::type());
+    }
+
+    string Format() const;
+
+private:
+    Arg* Next(ArgType type);
+    void AddText(const char* s, size_t length);
+
+    template <typename T> void AddValue(const T& value, true_type, false_type)
+    {
+        if (Arg* arg = Next(is_signed<T>::value ? ARG_INT : ARG_UINT))
+        {
+            if (is_signed<T>::value)
+                arg->i = (int64_t)value;
+            else
+                arg->u = (uint64_t)value;
+        }
+    }
+
+    template <typename T> void AddValue(const T& value, false_type, true_type)
+    {
+        if (Arg* arg = Next(ARG_DOUBLE))
+            arg->d = (double)value;
+    }
 
-class SmartLoggerPtr;
+    // other types are formatted right now (slow, but there are no such calls on hot paths)
+    template <typename T> void AddValue(const T& value, false_type, false_type)
+    {
+        stringstream ss;
+        ss << value;
+        Add(ss.str());
+    }
+};
+
+/*
+Log file, which is kept open (LOG_THREAD only).
+Records are collected in a large buffer and written, when it is full or by Flush.
+When the file reaches the max size, it is renamed to path.1 (path.1 to path.2 and so on), the oldest one is removed.
+*/
+class LogFile
+{
+public:
+    LogFile(const string& path);
+    ~LogFile();
+
+    void SetLimits(uint64_t maxSize, uint32 keepFiles);
+    void Write(const string& text);
+    void Flush();
+private:
+    string _path;
+    uint64_t _maxSize;
+    uint32 _keepFiles;
+    uint64_t _size;         // current size of the file (with buffered data)
+    vector<char> _buffer;
+    OutFile _file;
+
+    void Open();
+    void Rotate();
+    string RotatedPath(uint32 index) const;
+
+    LogFile(const LogFile& src);
+    LogFile& operator=(const LogFile& rval);
+};
 
+/*
+Trace can be called by any thread: it takes a free cell of the ring (lock-free, Vyukov's bounded queue),
+fills it in place and publishes it. LOG_THREAD reads published cells in order, formats and writes them.
+If the ring is full, the record is dropped and counted, nobody waits for the log.
+*/
 class Logger
 {
 public:
     virtual ~Logger();
-    static SmartLoggerPtr GetInstance();
+    static Logger* GetInstance();
     void Enable();
     void Disable();
     bool IsEnable() { return _enable; }
-    template <typename T> void Trace(const T& t);
-    template <typename First, typename... Rest> void Trace(const First& first, const Rest&... rest);
-    queue<string>& GetQueue() { return _messageQueue; }
-    friend SmartLoggerPtr;
+    void SetRotation(uint64_t maxSize, uint32 keepFiles) { _maxFileSize = maxSize; _keepFiles = keepFiles; }
+    static void SetLevel(int level) { _level.store(level, memory_order_relaxed); }
+    static bool IsEnabled(int level) { return level >= _level.load(memory_order_relaxed); }
+    template <typename... Args> void Trace(const Args&... args);
 private:
+    struct Cell
+    {
+        atomic<size_t> sequence;    // == position: free for the producer, == position + 1: ready for LOG_THREAD
+        LogRecord record;
+    };
+
     // singleton class
     static unique_ptr<Logger> _instance;
     static once_flag _onceFlag;
-
-    Mutex _loggerMutex;
-    OutFile _logFile;
-    stringstream _stringToInsert;
-    queue<string> _messageQueue;
-    bool _enable;
-    bool _timePosted;
+    static atomic<int> _level;      // runtime level (not less than LOG_MIN_LEVEL)
+
+    unique_ptr<Cell[]> _ring;
+    char _pad0[64];
+    atomic<size_t> _enqueuePos;     // producers
+    char _pad1[64];
+    size_t _dequeuePos;             // LOG_THREAD only
+    atomic<uint64_t> _dropped;      // records, which didn't find a free cell
+    atomic<uint64_t> _maxFileSize;
+    atomic<uint32> _keepFiles;
+    atomic<bool> _enable;
 
     Logger();
     Logger(const Logger& src);
     Logger& operator=(const Logger& rval);
 
-    void InsertStringInFile(stringstream& strStream);
-    void InsertTimeInString(stringstream& strStream);
+    LogRecord* Claim(size_t& position);
+    void Publish(size_t position);
+    void WriteRecords(LogFile& file);
     void MessageQueueHandler();
-};
-
-template <typename T>
-void Logger::Trace(const T& t)
-{
-    if (!_enable)
-        return;
-
-    if (!_timePosted)
-        InsertTimeInString(_stringToInsert);
-    _stringToInsert << t << endl;
-
-    string toInsert = _stringToInsert.str();
-    _messageQueue.push(toInsert);
-
-    _stringToInsert.str("");
-    _timePosted = false;
-}
 
+    static int64_t Now();
+    static void AddArgs(LogRecord&) { }
+    template <typename First, typename... Rest>
+    static void AddArgs(LogRecord& record, const First& first, const Rest&... rest)
+    {
+        record.Add(first);
+        AddArgs(record, rest...);
+    }
+};
 
-template <typename First, typename... Rest>
-void Logger::Trace(const First& first, const Rest&... rest)
+template <typename... Args>
+void Logger::Trace(const Args&... args)
 {
     if (!_enable)
         return;
 
-    if (!_timePosted)
+    size_t position;
+    LogRecord* record = Claim(position);
+    if (!record)
     {
-        InsertTimeInString(_stringToInsert);
-        _timePosted = true;
-    }        
-
-    _stringToInsert << first;
-
-    Trace(rest...);
-}
-
-
-class SmartLoggerPtr
-{
-public:
-    SmartLoggerPtr(Logger& instance)
-    {
-        _logger = &instance;
-        _logger->_loggerMutex.lock();
-    }
-
-    ~SmartLoggerPtr()
-    {
-        _logger->_loggerMutex.unlock();
+        _dropped.fetch_add(1, memory_order_relaxed);
+        return;
     }
 
-    Logger* operator ->()
-    {
-        return _logger;
-    }
-private:
-    Logger* _logger;
-};
+    record->Start(Now());
+    AddArgs(*record, args...);
+    Publish(position);
+}
 
 #endif // LOGGER_H
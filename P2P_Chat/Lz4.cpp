@@ -0,0 +1,193 @@
+#include "Lz4.h"
+
+static const size_t MIN_MATCH = 4;        // bytes. Shortest match.
+static const size_t LAST_LITERALS = 5;    // bytes. The end of the block is always literals (format rule).
+static const size_t MF_LIMIT = 12;        // bytes. The last match starts so far from the end at least (format rule).
+static const int HASH_LOG = 12;           // bits. Entries of the hash table.
+static const int SKIP_STRENGTH = 6;       // the step of the search grows by 1 after 2^6 misses
+
+static uint32 Load32(const uint8* p)
+{
+    uint32 value;
+    memcpy(&value, p, sizeof(value));
+    return value;
+}
+
+static uint32 Hash(uint32 sequence)
+{
+    return (sequence * 2654435761u) >> (32 - HASH_LOG);
+}
+
+// extra bytes of the length (after 15 in the token), false if there is no room for them
+
+static bool PutLength(uint8*& out, const uint8* outEnd, size_t length)
+{
+    if ((size_t)(outEnd - out) < length / 255 + 1)
+        return false;
+
+    for (; length >= 255; length -= 255)
+        *out++ = 255;
+    *out++ = (uint8)length;
+    return true;
+}
+
+static bool GetLength(const uint8*& in, const uint8* inEnd, size_t& length)
+{
+    uint8 byte;
+    do
+    {
+        if (in == inEnd)
+            return false;
+        byte = *in++;
+        length += byte;
+    } while (byte == 255);
+
+    return true;
+}
+
+// token, literals, then the offset and the length of the match (if it isn't the last sequence)
+
+static bool PutSequence(uint8*& out, const uint8* outEnd, const uint8* literals, size_t literalLength, size_t offset, size_t matchLength)
+{
+    bool last = offset == 0;
+    if (out == outEnd)
+        return false;
+
+    uint8* token = out++;
+    *token = (uint8)(min<size_t>(literalLength, 15) << 4);
+    if (literalLength >= 15 && !PutLength(out, outEnd, literalLength - 15))
+        return false;
+
+    if ((size_t)(outEnd - out) < literalLength + (last ? 0 : 2))
+        return false;
+    memcpy(out, literals, literalLength);
+    out += literalLength;
+    if (last)
+        return true;
+
+    *out++ = (uint8)(offset & 0xFF);
+    *out++ = (uint8)(offset >> 8);
+
+    matchLength -= MIN_MATCH;
+    *token |= (uint8)min<size_t>(matchLength, 15);
+    return matchLength < 15 || PutLength(out, outEnd, matchLength - 15);
+}
+
+size_t Lz4::Compress(cc_string src, size_t size, c_string dst, size_t capacity)
+{
+    if (size > LZ4_INPUT_MAX)
+        throw logic_error("data is too large for compression");
+
+    const uint8* in = (const uint8*)src;
+    const uint8* end = in + size;
+    uint8* out = (uint8*)dst;
+    const uint8* outEnd = out + capacity;
+    const uint8* anchor = in;   // the first literal, which isn't written yet
+
+    // positions from the start (0 is also "empty": every candidate is compared)
+    uint16 table[1 << HASH_LOG];
+    memset(table, 0, sizeof(table));
+
+    if (size > MF_LIMIT)
+    {
+        const uint8* matchLimit = end - LAST_LITERALS;
+        const uint8* lastMatch = end - MF_LIMIT;
+        const uint8* ip = in;
+        uint32 misses = 1 << SKIP_STRENGTH;
+
+        while (ip <= lastMatch)
+        {
+            uint32 sequence = Load32(ip);
+            uint32 h = Hash(sequence);
+            const uint8* ref = in + table[h];
+            table[h] = (uint16)(ip - in);
+
+            if (ref >= ip || Load32(ref) != sequence)
+            {
+                ip += misses++ >> SKIP_STRENGTH;
+                continue;
+            }
+
+            // the match is extended back (over literals) and forward
+            while (ip > anchor && ref > in && ip[-1] == ref[-1])
+            {
+                --ip;
+                --ref;
+            }
+            const uint8* matchEnd = ip + MIN_MATCH;
+            for (const uint8* r = ref + MIN_MATCH; matchEnd < matchLimit && *matchEnd == *r; ++r)
+                ++matchEnd;
+
+            if (!PutSequence(out, outEnd, anchor, ip - anchor, ip - ref, matchEnd - ip))
+                return 0;
+
+            ip = anchor = matchEnd;
+            misses = 1 << SKIP_STRENGTH;
+            if (ip <= lastMatch)
+                table[Hash(Load32(ip - 2))] = (uint16)(ip - 2 - in);
+        }
+    }
+
+    if (!PutSequence(out, outEnd, anchor, end - anchor, 0, 0))
+        return 0;
+
+    return (c_string)out - dst;
+}
+
+bool Lz4::Decompress(cc_string src, size_t size, c_string dst, size_t capacity, size_t& decompressed)
+{
+    const uint8* in = (const uint8*)src;
+    const uint8* inEnd = in + size;
+    uint8* out = (uint8*)dst;
+    uint8* outEnd = out + capacity;
+
+    for (;;)
+    {
+        if (in == inEnd)
+            return false;
+        uint8 token = *in++;
+
+        size_t literalLength = token >> 4;
+        if (literalLength == 15 && !GetLength(in, inEnd, literalLength))
+            return false;
+        if (literalLength > (size_t)(inEnd - in) || literalLength > (size_t)(outEnd - out))
+            return false;
+        memcpy(out, in, literalLength);
+        in += literalLength;
+        out += literalLength;
+
+        // the last sequence has no match
+        if (in == inEnd)
+            break;
+
+        if (inEnd - in < 2)
+            return false;
+        size_t offset = in[0] | (in[1] << 8);
+        in += 2;
+        if (offset == 0 || offset > (size_t)(out - (uint8*)dst))
+            return false;
+
+        size_t matchLength = token & 15;
+        if (matchLength == 15 && !GetLength(in, inEnd, matchLength))
+            return false;
+        matchLength += MIN_MATCH;
+        if (matchLength > (size_t)(outEnd - out))
+            return false;
+
+        // the match can overlap the output (repeated bytes), then it is copied byte by byte
+        const uint8* match = out - offset;
+        if (offset >= matchLength)
+        {
+            memcpy(out, match, matchLength);
+        }
+        else
+        {
+            for (size_t i = 0; i < matchLength; ++i)
+                out[i] = match[i];
+        }
+        out += matchLength;
+    }
+
+    decompressed = out - (uint8*)dst;
+    return true;
+}
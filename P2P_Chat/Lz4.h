@@ -0,0 +1,24 @@
+#ifndef LZ4_H
+#define LZ4_H
+
+#include "utils.h"
+
+#define LZ4_INPUT_MAX 0xFFFF    // bytes. Positions in the hash table are 16-bit (file blocks are much smaller).
+
+/*
+Compression of file blocks in the LZ4 block format (sequences of literals and matches, no frame).
+Compressor is the fast one of LZ4: 4-byte matches are found by a hash table, the search skips
+faster and faster over data without matches, so incompressible blocks cost little.
+Output is limited: compression gives up as soon as it exceeds the limit (block is sent raw then).
+Decompressor checks every length and offset, broken data can't write out of the buffer.
+*/
+class Lz4
+{
+public:
+    // size of the compressed data, 0 - it doesn't fit into capacity
+    static size_t Compress(cc_string src, size_t size, c_string dst, size_t capacity);
+    // false, if data is broken or doesn't fit into capacity
+    static bool Decompress(cc_string src, size_t size, c_string dst, size_t capacity, size_t& decompressed);
+};
+
+#endif // LZ4_H
@@ -1,97 +1,731 @@
 #include "MessageBuilder.h"
 #include "message_formats.h"
+#include "MessageSchema.h"
 #include "utils.h"
 
-std::string MessageBuilder::System(cc_string action, const string& peerId)
+// Encoding of v2 messages
+
+static void PutUint32(Packet& raw, uint32 value)
 {
-    string raw;
-    size_t rawLen = strlen(action) + 1;
-    raw.resize(rawLen + SZ_MESSAGE_SYS, 0);
+    for (int i = 0; i < 4; ++i)
+        raw += (char)((value >> (8 * i)) & 0xFF);
+}
 
-    MessageSystem* msgSys = (MessageSystem*)raw.data();
+static void PutUint64(Packet& raw, uint64 value)
+{
+    PutUint32(raw, (uint32)value);
+    PutUint32(raw, (uint32)(value >> 32));
+}
 
-    msgSys->_code = M_SYS;
-    memcpy(msgSys->_action, action, rawLen);
-    memcpy(msgSys->_peerId, peerId.c_str(), PEER_ID_SIZE + 1);
+static void PutVarint(Packet& raw, uint32 value)
+{
+    while (value >= 0x80)
+    {
+        raw += (char)(value | 0x80);
+        value >>= 7;
+    }
+    raw += (char)value;
+}
+
+static void PutString(Packet& raw, const string& str)
+{
+    PutVarint(raw, (uint32)str.size());
+    raw += str;
+}
 
+// records of M_FILE_BEGIN extensions (without the magic)
+
+static void PutFileExtensions(Packet& raw, const FileExtensions& extensions)
+{
+    if (extensions.identity.IsKnown())
+    {
+        PutVarint(raw, FILE_EXT_IDENTITY);
+        PutVarint(raw, 2 * sizeof(uint64));
+        PutUint64(raw, extensions.identity.size);
+        PutUint64(raw, extensions.identity.hash);
+    }
+
+    if (extensions.crcKnown)
+    {
+        PutVarint(raw, FILE_EXT_CRC32C);
+        PutVarint(raw, sizeof(uint32));
+        PutUint32(raw, extensions.crc);
+    }
+
+    if (extensions.codecs != 0)
+    {
+        PutVarint(raw, FILE_EXT_CODECS);
+        PutVarint(raw, sizeof(uint8));
+        raw += (char)extensions.codecs;
+    }
+
+    if (extensions.content != 0)
+    {
+        PutVarint(raw, FILE_EXT_CONTENT);
+        PutVarint(raw, sizeof(uint64));
+        PutUint64(raw, extensions.content);
+    }
+
+    if (extensions.source)
+    {
+        PutVarint(raw, FILE_EXT_SOURCE);
+        PutVarint(raw, 0);
+    }
+
+    if (extensions.signatures)
+    {
+        PutVarint(raw, FILE_EXT_SIGNATURES);
+        PutVarint(raw, 0);
+    }
+}
+
+static Packet HeaderV2(uint8 code, const Peer& sender)
+{
+    Packet raw;
+    raw += (char)(code | M_V2);
+    PutUint32(raw, sender.GetToken());
     return raw;
 }
 
-std::string MessageBuilder::PeerData(const wstring& nick, const string& id)
+// reads fields of v2 message, any read after the end makes it broken
+
+struct ReaderV2
 {
-    string raw;
-    size_t rawLen = nick.length() * sizeof(wchar_t);
-    raw.resize(rawLen + SZ_MESSAGE_PEERDATA, 0);
+    const uint8* pos;
+    const uint8* end;
+    bool ok;
 
-    MessagePeerData* msgPeerData = (MessagePeerData*)raw.data();
+    ReaderV2(cc_string data, size_t size) : pos((const uint8*)data), end((const uint8*)data + size), ok(true) { }
 
-    msgPeerData->_code = M_PEER_DATA;
-    memcpy(msgPeerData->_id, id.c_str(), PEER_ID_SIZE + 1);
-    msgPeerData->_nicknameLength = nick.length();
-    memcpy(msgPeerData->_nickname, nick.data(), rawLen);
+    size_t Left() const { return end - pos; }
+
+    uint32 Varint()
+    {
+        uint32 value = 0;
+        for (int shift = 0; shift < 35; shift += 7)
+        {
+            if (pos == end)
+                break;
+            uint8 byte = *pos++;
+            value |= (uint32)(byte & 0x7F) << shift;
+            if (!(byte & 0x80))
+                return value;
+        }
+        ok = false;
+        return 0;
+    }
+
+    cc_string Bytes(size_t size)
+    {
+        if (Left() < size)
+        {
+            ok = false;
+            return 0;
+        }
+        cc_string bytes = (cc_string)pos;
+        pos += size;
+        return bytes;
+    }
+
+    string String()
+    {
+        uint32 size = Varint();
+        cc_string bytes = Bytes(size);
+        return ok ? string(bytes, size) : string();
+    }
+
+    uint32 Uint32()
+    {
+        cc_string bytes = Bytes(sizeof(uint32));
+        return bytes ? MessageBuilder::LoadUint32(bytes) : 0;
+    }
+
+    uint64 Uint64()
+    {
+        const uint8* b = (const uint8*)Bytes(sizeof(uint64));
+        if (!b)
+            return 0;
+
+        uint64 value = 0;
+        for (int i = 7; i >= 0; --i)
+            value = (value << 8) | b[i];
+        return value;
+    }
+};
+
+Packet MessageBuilder::SystemV1(cc_string action, cc_string peerId)
+{
+    Packet raw;
+    size_t rawLen = strlen(action) + 1;
+    MessageSystem* msgSys = BeginMessage<MessageSystem>(raw, rawLen, peerId);
+
+    memcpy(msgSys->_action, action, rawLen);
 
     return raw;
 }
 
-std::string MessageBuilder::Text(const wstring& msg, const string& peerId)
+Packet MessageBuilder::PeerData(const Peer& sender)
 {
-    string raw;
-    size_t rawLen = msg.length() * sizeof(wchar_t);
-    raw.resize(rawLen + SZ_MESSAGE_TEXT, 0);
+    vector<uint16> nick = to_utf16(sender.GetNickname());
 
-    MessageText* msgText = (MessageText*)raw.data();
+    Packet raw;
+    size_t rawLen = nick.size() * sizeof(uint16);
+    MessagePeerData* msgPeerData = BeginMessage<MessagePeerData>(raw, rawLen, sender.GetId().c_str());
 
-    msgText->_code = M_TEXT;
-    msgText->_length = msg.length();
-    memcpy(msgText->_text, msg.data(), rawLen);
-    memcpy(msgText->_peerId, peerId.c_str(), PEER_ID_SIZE + 1);
+    msgPeerData->_nicknameLength = nick.size();
+    if (rawLen > 0)
+        memcpy(msgPeerData->_nickname, &nick[0], rawLen);
+
+    // old clients read only the nickname, new ones find the trailer (PeerDataTrailer) after it
+    raw.append(PEER_DATA_MAGIC, sizeof(PEER_DATA_MAGIC) - 1);
+    raw += (char)PROTOCOL_VERSION;
+    PutUint32(raw, sender.GetToken());
+
+    return raw;
+}
+
+Packet MessageBuilder::TextV1(const vector<uint16>& text, cc_string peerId)
+{
+    Packet raw;
+    size_t rawLen = text.size() * sizeof(uint16);
+    MessageText* msgText = BeginMessage<MessageText>(raw, rawLen, peerId);
+
+    msgText->_length = text.size();
+    if (rawLen > 0)
+        memcpy(msgText->_text, &text[0], rawLen);
 
     return raw;
 }
 
-std::string MessageBuilder::FileBegin(uint32 id, uint32 totalBlocks, const string& name, const string& peerId)
+Packet MessageBuilder::FileBeginV1(uint32 id, uint32 totalBlocks, const string& name, cc_string peerId)
 {
-    string raw;
+    Packet raw;
     size_t rawLen = name.length() * sizeof(char);
-    raw.resize(rawLen + SZ_MESSAGE_FILE_INFO, 0);
+    MessageFileInfo* msgFileInfo = BeginMessage<MessageFileInfo>(raw, rawLen, peerId);
 
-    MessageFileInfo* msgFileInfo = (MessageFileInfo*)raw.data();
-    msgFileInfo->_code = M_FILE_BEGIN;
     msgFileInfo->_id = id;
     msgFileInfo->_totalBlocks = totalBlocks;
     msgFileInfo->_nameLength = name.length();
     memcpy(msgFileInfo->_name, name.data(), rawLen);
-    memcpy(msgFileInfo->_peerId, peerId.c_str(), PEER_ID_SIZE + 1);
 
     return raw;
 }
 
-std::string MessageBuilder::FileBlock(uint32 id, uint32 block, cc_string data, uint32 size, const string& peerId)
+Packet MessageBuilder::FileBeginV1(uint32 id, uint32 totalBlocks, const string& name, const FileExtensions& extensions, cc_string peerId)
 {
-    string raw;
-    raw.resize(FILE_BLOCK_MAX + size, 0);
-    MessageFileBlock* msgFileBlock = (MessageFileBlock*)raw.data();
+    Packet raw = FileBeginV1(id, totalBlocks, name, peerId);
+    if (extensions.identity.IsKnown() || extensions.crcKnown || extensions.codecs != 0 || extensions.content != 0 || extensions.source
+        || extensions.signatures)
+    {
+        raw.append(FILE_INFO_MAGIC, sizeof(FILE_INFO_MAGIC) - 1);
+        PutFileExtensions(raw, extensions);
+    }
+    return raw;
+}
+
+// only the header of M_FILE_BLOCK, data of the block is sent right after it (see BulkSender)
+
+Packet MessageBuilder::FileBlockHeaderV1(uint32 id, uint32 block, uint32 size, cc_string peerId)
+{
+    Packet raw;
+    MessageFileBlock* msgFileBlock = BeginMessage<MessageFileBlock>(raw, 0, peerId);
 
-    msgFileBlock->_code = M_FILE_BLOCK;
     msgFileBlock->_id = id;
     msgFileBlock->_block = block;
     msgFileBlock->_size = size;
-    memcpy(msgFileBlock->_data, data, size);
-    memcpy(msgFileBlock->_peerId, peerId.c_str(), PEER_ID_SIZE + 1);
 
     return raw;
 }
 
-std::string MessageBuilder::RequestForFileBlock(uint32 id, uint32 block, const string& peerId)
+Packet MessageBuilder::RequestForFileBlockV1(uint32 id, uint32 block, cc_string peerId)
 {
-    string raw;
-    raw.resize(SZ_MESSAGE_REQUEST_FOR_FILE_BLOCK, 0);
-    MessageRequestForFileBlock* msgReqForFileBlock = (MessageRequestForFileBlock*)raw.data();
+    Packet raw;
+    MessageRequestForFileBlock* msgReqForFileBlock = BeginMessage<MessageRequestForFileBlock>(raw, 0, peerId);
 
-    msgReqForFileBlock->_code = M_REQ_FOR_FILE_BLOCK;
     msgReqForFileBlock->_id = id;
     msgReqForFileBlock->_block = block;
-    memcpy(msgReqForFileBlock->_peerId, peerId.c_str(), PEER_ID_SIZE + 1);
 
     return raw;
 }
+
+Packet MessageBuilder::RequestForFileBlocksV1(uint32 id, const BlockRanges& ranges, uint32 window, uint32 rtt, cc_string peerId)
+{
+    Packet raw;
+    size_t rawLen = ranges.size() * sizeof(FileBlocksRange);
+    MessageRequestForFileBlocks* msgReqForFileBlocks = BeginMessage<MessageRequestForFileBlocks>(raw, rawLen, peerId);
+
+    msgReqForFileBlocks->_id = id;
+    msgReqForFileBlocks->_count = ranges.size();
+    msgReqForFileBlocks->_window = window;
+    msgReqForFileBlocks->_rtt = rtt;
+    for (size_t i = 0; i < ranges.size(); ++i)
+    {
+        msgReqForFileBlocks->_ranges[i]._first = ranges[i].first;
+        msgReqForFileBlocks->_ranges[i]._last = ranges[i].second;
+    }
+
+    return raw;
+}
+
+// the header of M_FILE_PARITY and numbers of blocks, the parity is appended by the caller
+
+Packet MessageBuilder::FileParityHeaderV1(uint32 id, const uint32* blocks, uint32 count, uint32 size, cc_string peerId)
+{
+    Packet raw;
+    size_t rawLen = count * sizeof(uint32);
+    MessageFileParity* msgFileParity = BeginMessage<MessageFileParity>(raw, rawLen, peerId);
+
+    msgFileParity->_id = id;
+    msgFileParity->_count = count;
+    msgFileParity->_size = size;
+    memcpy(msgFileParity->_blocks, blocks, rawLen);
+
+    return raw;
+}
+
+Packet MessageBuilder::FileQueryV1(uint64 size, uint64 content, uint32 crc, cc_string peerId)
+{
+    Packet raw;
+    MessageFileQuery* msgFileQuery = BeginMessage<MessageFileQuery>(raw, 0, peerId);
+
+    msgFileQuery->_size = size;
+    msgFileQuery->_content = content;
+    msgFileQuery->_crc = crc;
+
+    return raw;
+}
+
+Packet MessageBuilder::RequestForFileSignaturesV1(uint32 id, uint32 first, uint32 count, cc_string peerId)
+{
+    Packet raw;
+    MessageRequestForFileSignatures* msgReqForSignatures = BeginMessage<MessageRequestForFileSignatures>(raw, 0, peerId);
+
+    msgReqForSignatures->_id = id;
+    msgReqForSignatures->_first = first;
+    msgReqForSignatures->_count = count;
+
+    return raw;
+}
+
+// the header of M_FILE_SIGNATURES, signatures are appended by the caller
+
+Packet MessageBuilder::FileSignaturesV1(uint32 id, uint32 page, uint32 count, cc_string peerId)
+{
+    Packet raw;
+    MessageFileSignatures* msgFileSignatures = BeginMessage<MessageFileSignatures>(raw, 0, peerId);
+
+    msgFileSignatures->_id = id;
+    msgFileSignatures->_page = page;
+    msgFileSignatures->_count = count;
+
+    return raw;
+}
+
+// Messages of the negotiated version
+
+Packet MessageBuilder::System(cc_string action, const Peer& sender, uint8 version)
+{
+    if (version < PROTOCOL_V2)
+        return SystemV1(action, sender.GetId().c_str());
+
+    Packet raw(HeaderV2(M_SYS, sender));
+    raw += action;
+    return raw;
+}
+
+// old peers read the action till its end, new ones find the id after it
+
+Packet MessageBuilder::FileResult(cc_string action, uint32 id, const Peer& sender, uint8 version)
+{
+    Packet raw = System(action, sender, version);
+    if (version >= PROTOCOL_V2)
+        raw += '\0';
+    PutUint32(raw, id);
+    return raw;
+}
+
+Packet MessageBuilder::Text(const wstring& msg, const Peer& sender, uint8 version)
+{
+    if (version < PROTOCOL_V2)
+        return TextV1(to_utf16(msg), sender.GetId().c_str());
+
+    Packet raw(HeaderV2(M_TEXT, sender));
+    PutString(raw, to_string(msg));
+    return raw;
+}
+
+Packet MessageBuilder::FileBegin(uint32 id, uint32 totalBlocks, const string& name, const FileExtensions& extensions, const Peer& sender, uint8 version)
+{
+    if (version < PROTOCOL_V2)
+        return FileBeginV1(id, totalBlocks, name, extensions, sender.GetId().c_str());
+
+    Packet raw(HeaderV2(M_FILE_BEGIN, sender));
+    PutVarint(raw, id);
+    PutVarint(raw, totalBlocks);
+    PutString(raw, name);
+    PutFileExtensions(raw, extensions);
+    return raw;
+}
+
+Packet MessageBuilder::FileBlockHeader(uint32 id, uint32 block, uint32 size, const Peer& sender, uint8 version)
+{
+    if (version < PROTOCOL_V2)
+        return FileBlockHeaderV1(id, block, size, sender.GetId().c_str());
+
+    Packet raw(HeaderV2(M_FILE_BLOCK, sender));
+    PutVarint(raw, id);
+    PutVarint(raw, block);
+    PutVarint(raw, size);
+    return raw;
+}
+
+Packet MessageBuilder::RequestForFileBlock(uint32 id, uint32 block, const Peer& sender, uint8 version)
+{
+    if (version < PROTOCOL_V2)
+        return RequestForFileBlockV1(id, block, sender.GetId().c_str());
+
+    Packet raw(HeaderV2(M_REQ_FOR_FILE_BLOCK, sender));
+    PutVarint(raw, id);
+    PutVarint(raw, block);
+    return raw;
+}
+
+Packet MessageBuilder::RequestForFileBlocks(uint32 id, const BlockRanges& ranges, uint32 window, uint32 rtt, uint8 codecs, uint8 loss, const Peer& sender, uint8 version)
+{
+    Packet raw;
+    if (version < PROTOCOL_V2)
+    {
+        raw = RequestForFileBlocksV1(id, ranges, window, rtt, sender.GetId().c_str());
+    }
+    else
+    {
+        raw = HeaderV2(M_REQ_FOR_FILE_BLOCKS, sender);
+        PutVarint(raw, id);
+        PutVarint(raw, window);
+        PutVarint(raw, rtt);
+        PutVarint(raw, (uint32)ranges.size());
+        for (size_t i = 0; i < ranges.size(); ++i)
+        {
+            PutVarint(raw, ranges[i].first);
+            PutVarint(raw, ranges[i].second - ranges[i].first);
+        }
+    }
+
+    // the same trailer in both versions
+    raw += (char)codecs;
+    raw += (char)loss;
+    return raw;
+}
+
+Packet MessageBuilder::FileParityHeader(uint32 id, const uint32* blocks, uint32 count, uint32 size, const Peer& sender, uint8 version)
+{
+    if (version < PROTOCOL_V2)
+        return FileParityHeaderV1(id, blocks, count, size, sender.GetId().c_str());
+
+    Packet raw(HeaderV2(M_FILE_PARITY, sender));
+    PutVarint(raw, id);
+    PutVarint(raw, count);
+    PutVarint(raw, size);
+    for (uint32 i = 0; i < count; ++i)
+        PutVarint(raw, blocks[i]);
+    return raw;
+}
+
+Packet MessageBuilder::FileQuery(uint64 size, uint64 content, uint32 crc, const Peer& sender, uint8 version)
+{
+    if (version < PROTOCOL_V2)
+        return FileQueryV1(size, content, crc, sender.GetId().c_str());
+
+    Packet raw(HeaderV2(M_FILE_QUERY, sender));
+    PutUint64(raw, size);
+    PutUint64(raw, content);
+    PutUint32(raw, crc);
+    return raw;
+}
+
+Packet MessageBuilder::RequestForFileSignatures(uint32 id, uint32 first, uint32 count, const Peer& sender, uint8 version)
+{
+    if (version < PROTOCOL_V2)
+        return RequestForFileSignaturesV1(id, first, count, sender.GetId().c_str());
+
+    Packet raw(HeaderV2(M_REQ_FOR_FILE_SIGNATURES, sender));
+    PutVarint(raw, id);
+    PutVarint(raw, first);
+    PutVarint(raw, count);
+    return raw;
+}
+
+// v1 signatures are in the host order, as other fields of v1 messages
+
+Packet MessageBuilder::FileSignatures(uint32 id, uint32 page, const uint32* weakSums, const uint32* crcs, uint32 count, const Peer& sender, uint8 version)
+{
+    Packet raw;
+    if (version < PROTOCOL_V2)
+    {
+        raw = FileSignaturesV1(id, page, count, sender.GetId().c_str());
+        for (uint32 i = 0; i < count; ++i)
+        {
+            FileBlockSignature signature;
+            signature._weak = weakSums[i];
+            signature._crc = crcs[i];
+            raw.append((cc_string)&signature, sizeof(signature));
+        }
+        return raw;
+    }
+
+    raw = HeaderV2(M_FILE_SIGNATURES, sender);
+    PutVarint(raw, id);
+    PutVarint(raw, page);
+    PutVarint(raw, count);
+    for (uint32 i = 0; i < count; ++i)
+    {
+        PutUint32(raw, weakSums[i]);
+        PutUint32(raw, crcs[i]);
+    }
+    return raw;
+}
+
+uint32 MessageBuilder::LoadUint32(cc_string bytes)
+{
+    const uint8* b = (const uint8*)bytes;
+    return b[0] | (b[1] << 8) | (b[2] << 16) | ((uint32)b[3] << 24);
+}
+
+void MessageBuilder::StoreUint32(uint32 value, c_string bytes)
+{
+    for (int i = 0; i < 4; ++i)
+        bytes[i] = (char)((value >> (8 * i)) & 0xFF);
+}
+
+// v2 message of the peer is rebuilt in the v1 layout (M_V2 is kept in the code)
+
+// v1 message is larger (the id instead of the token, UTF-16 text instead of UTF-8), so the size of variable ones
+// is checked before they are built: the packet can't be larger than PACKET_LARGE
+
+bool MessageBuilder::UnpackV2(cc_string data, size_t size, cc_string peerId, Packet& message)
+{
+    if (size < SZ_MESSAGE_V2_HEADER)
+        return false;
+
+    ReaderV2 reader(data + SZ_MESSAGE_V2_HEADER, size - SZ_MESSAGE_V2_HEADER);
+    switch ((uint8)data[0] & ~M_V2)
+    {
+    case M_SYS:
+    {
+        size_t length = reader.Left();
+        cc_string bytes = reader.Bytes(length);
+        if (SZ_MESSAGE_SYS + length + 1 > PACKET_LARGE)
+            return false;
+
+        string action(bytes, strnlen(bytes, length));
+        message = SystemV1(action.c_str(), peerId);
+
+        // bytes after the action are kept as in v1
+        if (action.length() + 1 < length)
+            message.append(bytes + action.length() + 1, length - action.length() - 1);
+        break;
+    }
+    case M_TEXT:
+    {
+        vector<uint16> text = to_utf16(to_wstring(reader.String()));
+        if (!reader.ok || SZ_MESSAGE_TEXT + text.size() * sizeof(uint16) > PACKET_LARGE)
+            return false;
+
+        message = TextV1(text, peerId);
+        break;
+    }
+    case M_FILE_BEGIN:
+    {
+        uint32 id = reader.Varint();
+        uint32 totalBlocks = reader.Varint();
+        string name = reader.String();
+
+        // extensions are checked and copied after the magic as they are
+        cc_string extensions = (cc_string)reader.pos;
+        while (reader.ok && reader.Left() > 0)
+        {
+            reader.Varint();
+            reader.Bytes(reader.Varint());
+        }
+
+        size_t extensionsSize = reader.ok ? (cc_string)reader.pos - extensions : 0;
+        if (SZ_MESSAGE_FILE_INFO + name.length() + sizeof(FILE_INFO_MAGIC) - 1 + extensionsSize > PACKET_LARGE)
+            return false;
+
+        message = FileBeginV1(id, totalBlocks, name, peerId);
+        if (extensionsSize > 0)
+        {
+            message.append(FILE_INFO_MAGIC, sizeof(FILE_INFO_MAGIC) - 1);
+            message.append(extensions, extensionsSize);
+        }
+        break;
+    }
+    case M_FILE_BLOCK:
+    {
+        uint32 id = reader.Varint();
+        uint32 block = reader.Varint();
+        uint32 blockSize = reader.Varint();
+        cc_string blockData = reader.Bytes(blockSize);
+        if (!reader.ok || SZ_MESSAGE_FILE_BLOCK + blockSize + SZ_FILE_BLOCK_CRC + SZ_FILE_BLOCK_CODEC > PACKET_LARGE)
+            return false;
+
+        message = FileBlockHeaderV1(id, block, blockSize, peerId);
+        message.append(blockData, blockSize);
+
+        // CRC and the codec of the data go after it, as in v1 (old senders don't send them)
+        size_t trailerSize = min<size_t>(reader.Left(), SZ_FILE_BLOCK_CRC + SZ_FILE_BLOCK_CODEC);
+        if (trailerSize >= SZ_FILE_BLOCK_CRC)
+            message.append(reader.Bytes(trailerSize), trailerSize);
+        break;
+    }
+    case M_REQ_FOR_FILE_BLOCK:
+    {
+        uint32 id = reader.Varint();
+        uint32 block = reader.Varint();
+        message = RequestForFileBlockV1(id, block, peerId);
+        break;
+    }
+    case M_REQ_FOR_FILE_BLOCKS:
+    {
+        uint32 id = reader.Varint();
+        uint32 window = reader.Varint();
+        uint32 rtt = reader.Varint();
+        uint32 count = reader.Varint();
+        if (count > FILE_BLOCKS_RANGES_MAX)
+            return false;
+
+        // ranges are appended right into the message
+        message = RequestForFileBlocksV1(id, BlockRanges(), window, rtt, peerId);
+        for (uint32 i = 0; i < count && reader.ok; ++i)
+        {
+            FileBlocksRange range;
+            range._first = reader.Varint();
+            range._last = range._first + reader.Varint();
+            message.append((cc_string)&range, sizeof(range));
+        }
+        ((MessageRequestForFileBlocks*)message.data())->_count = count;
+
+        // accepted codecs and the loss go after the ranges, as in v1
+        size_t trailerSize = min<size_t>(reader.Left(), SZ_FILE_BLOCKS_CODECS + SZ_FILE_BLOCKS_LOSS);
+        if (reader.ok && trailerSize > 0)
+            message.append(reader.Bytes(trailerSize), trailerSize);
+        break;
+    }
+    case M_FILE_PARITY:
+    {
+        uint32 id = reader.Varint();
+        uint32 count = reader.Varint();
+        uint32 paritySize = reader.Varint();
+        if (count > FEC_GROUP_MAX)
+            return false;
+
+        uint32 blocks[FEC_GROUP_MAX];
+        for (uint32 i = 0; i < count; ++i)
+            blocks[i] = reader.Varint();
+        cc_string parity = reader.Bytes(paritySize);
+        cc_string crc = reader.Bytes(SZ_FILE_BLOCK_CRC);
+        if (!reader.ok || SZ_MESSAGE_FILE_PARITY + count * sizeof(uint32) + paritySize + SZ_FILE_BLOCK_CRC > PACKET_LARGE)
+            return false;
+
+        message = FileParityHeaderV1(id, blocks, count, paritySize, peerId);
+        message.append(parity, paritySize);
+        message.append(crc, SZ_FILE_BLOCK_CRC);
+        break;
+    }
+    case M_FILE_QUERY:
+    {
+        uint64 fileSize = reader.Uint64();
+        uint64 content = reader.Uint64();
+        uint32 crc = reader.Uint32();
+        message = FileQueryV1(fileSize, content, crc, peerId);
+        break;
+    }
+    case M_REQ_FOR_FILE_SIGNATURES:
+    {
+        uint32 id = reader.Varint();
+        uint32 first = reader.Varint();
+        uint32 count = reader.Varint();
+        message = RequestForFileSignaturesV1(id, first, count, peerId);
+        break;
+    }
+    case M_FILE_SIGNATURES:
+    {
+        uint32 id = reader.Varint();
+        uint32 page = reader.Varint();
+        uint32 count = reader.Varint();
+        if (count > FILE_SIGNATURES_MAX)
+            return false;
+
+        message = FileSignaturesV1(id, page, count, peerId);
+        for (uint32 i = 0; i < count && reader.ok; ++i)
+        {
+            FileBlockSignature signature;
+            signature._weak = reader.Uint32();
+            signature._crc = reader.Uint32();
+            message.append((cc_string)&signature, sizeof(signature));
+        }
+        break;
+    }
+    default:
+        return false;
+    }
+
+    if (!reader.ok)
+        return false;
+
+    message[0] |= M_V2;
+    return true;
+}
+
+// extensions of M_FILE_BEGIN (bytes after the name), unknown records are skipped
+
+bool MessageBuilder::ReadFileExtensions(cc_string data, size_t size, FileExtensions& extensions)
+{
+    size_t magicSize = sizeof(FILE_INFO_MAGIC) - 1;
+    if (size < magicSize || memcmp(data, FILE_INFO_MAGIC, magicSize) != 0)
+        return false;
+
+    ReaderV2 reader(data + magicSize, size - magicSize);
+    while (reader.ok && reader.Left() > 0)
+    {
+        uint32 type = reader.Varint();
+        uint32 length = reader.Varint();
+        cc_string bytes = reader.Bytes(length);
+        if (!reader.ok)
+            break;
+
+        ReaderV2 record(bytes, length);
+
+        if (type == FILE_EXT_IDENTITY)
+        {
+            extensions.identity.size = record.Uint64();
+            extensions.identity.hash = record.Uint64();
+            if (!record.ok)
+                extensions.identity = FileIdentity();
+        }
+        else if (type == FILE_EXT_CRC32C)
+        {
+            extensions.crc = record.Uint32();
+            extensions.crcKnown = record.ok;
+        }
+        else if (type == FILE_EXT_CODECS)
+        {
+            cc_string codecs = record.Bytes(sizeof(uint8));
+            extensions.codecs = codecs ? (uint8)codecs[0] : 0;
+        }
+        else if (type == FILE_EXT_CONTENT)
+        {
+            extensions.content = record.Uint64();
+        }
+        else if (type == FILE_EXT_SOURCE)
+        {
+            extensions.source = true;
+        }
+        else if (type == FILE_EXT_SIGNATURES)
+        {
+            extensions.signatures = true;
+        }
+    }
+
+    return reader.ok;
+}
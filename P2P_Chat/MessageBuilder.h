@@ -2,16 +2,52 @@
 #define MESSAGE_BUILDER_H
 
 #include "utils.h"
+#include "Peer.h"
+#include "PacketPool.h"
+#include "message_formats.h"
 
+/*
+Messages are built in the version, which the receiver understands (see message_formats.h).
+M_PEER_DATA is always v1 (everybody reads it), with the trailer for new clients.
+*/
 class MessageBuilder
 {
 public:
-    static string System(cc_string action, const string& peerId);
-    static string PeerData(const wstring& nick, const string& id);
-    static string Text(const wstring& msg, const string& peerId);
-    static string FileBegin(uint32 id, uint32 totalBlocks, const string& name, const string& peerId);
-    static string FileBlock(uint32 id, uint32 block, cc_string data, uint32 size, const string& peerId);
-    static string RequestForFileBlock(uint32 id, uint32 block, const string& peerId);
+    static Packet System(cc_string action, const Peer& sender, uint8 version);
+    // "filedone" or "filecorrupted" with the id of the file on the sender side after the action
+    static Packet FileResult(cc_string action, uint32 id, const Peer& sender, uint8 version);
+    static Packet PeerData(const Peer& sender);
+    static Packet Text(const wstring& msg, const Peer& sender, uint8 version);
+    static Packet FileBegin(uint32 id, uint32 totalBlocks, const string& name, const FileExtensions& extensions, const Peer& sender, uint8 version);
+    static Packet FileBlockHeader(uint32 id, uint32 block, uint32 size, const Peer& sender, uint8 version);
+    static Packet RequestForFileBlock(uint32 id, uint32 block, const Peer& sender, uint8 version);
+    static Packet RequestForFileBlocks(uint32 id, const BlockRanges& ranges, uint32 window, uint32 rtt, uint8 codecs, uint8 loss, const Peer& sender, uint8 version);
+    static Packet FileParityHeader(uint32 id, const uint32* blocks, uint32 count, uint32 size, const Peer& sender, uint8 version);
+    static Packet FileQuery(uint64 size, uint64 content, uint32 crc, const Peer& sender, uint8 version);
+    static Packet RequestForFileSignatures(uint32 id, uint32 first, uint32 count, const Peer& sender, uint8 version);
+    static Packet FileSignatures(uint32 id, uint32 page, const uint32* weakSums, const uint32* crcs, uint32 count, const Peer& sender, uint8 version);
+
+    // little-endian token (of v2 message header or PeerDataTrailer)
+    static uint32 Token(cc_string bytes) { return LoadUint32(bytes); }
+    // little-endian numbers (tokens, CRC of file blocks)
+    static uint32 LoadUint32(cc_string bytes);
+    static void StoreUint32(uint32 value, c_string bytes);
+    // rebuild v2 message of the peer (id is PEER_ID_SIZE + 1 bytes) in the v1 layout, false if it is broken or too large
+    static bool UnpackV2(cc_string data, size_t size, cc_string peerId, Packet& message);
+    // extensions of M_FILE_BEGIN (bytes after the name), false if there are none or they are broken
+    static bool ReadFileExtensions(cc_string data, size_t size, FileExtensions& extensions);
+private:
+    static Packet SystemV1(cc_string action, cc_string peerId);
+    static Packet TextV1(const vector<uint16>& text, cc_string peerId);
+    static Packet FileBeginV1(uint32 id, uint32 totalBlocks, const string& name, cc_string peerId);
+    static Packet FileBeginV1(uint32 id, uint32 totalBlocks, const string& name, const FileExtensions& extensions, cc_string peerId);
+    static Packet FileBlockHeaderV1(uint32 id, uint32 block, uint32 size, cc_string peerId);
+    static Packet RequestForFileBlockV1(uint32 id, uint32 block, cc_string peerId);
+    static Packet RequestForFileBlocksV1(uint32 id, const BlockRanges& ranges, uint32 window, uint32 rtt, cc_string peerId);
+    static Packet FileParityHeaderV1(uint32 id, const uint32* blocks, uint32 count, uint32 size, cc_string peerId);
+    static Packet FileQueryV1(uint64 size, uint64 content, uint32 crc, cc_string peerId);
+    static Packet RequestForFileSignaturesV1(uint32 id, uint32 first, uint32 count, cc_string peerId);
+    static Packet FileSignaturesV1(uint32 id, uint32 page, uint32 count, cc_string peerId);
 };
 
 #endif // MESSAGE_BUILDER_H
@@ -0,0 +1,188 @@
+#ifndef MESSAGE_SCHEMA_H
+#define MESSAGE_SCHEMA_H
+
+#include "utils.h"
+#include "message_formats.h"
+#include "PacketPool.h"
+
+/*
+Schema of v1 messages: for every structure of message_formats.h it tells
+    code        - code of the message
+    fixedSize   - size of the fixed part (SZ_ macro)
+    Sender()    - field with the id of the sender
+    Check()     - limits of the fields (sizes, which are never sent by us)
+    TailSize()  - size of the variable part, which the fixed part declares
+                  (bytes, which are available after the fixed part, are passed for messages without the length)
+Read-only views (MessageView) and the v1 encoder (BeginMessage) are generated from it.
+*/
+template <class T>
+struct MessageSchema;
+
+template <>
+struct MessageSchema<MessageSystem>
+{
+    enum { code = M_SYS, fixedSize = SZ_MESSAGE_SYS };
+    static cc_string Sender(const MessageSystem& msg) { return msg._peerId; }
+    static char* Sender(MessageSystem& msg) { return msg._peerId; }
+    static bool Check(const MessageSystem&) { return true; }
+    static uint64 TailSize(const MessageSystem&, size_t available) { return max<size_t>(available, 1); } // action till the end, not empty
+};
+
+template <>
+struct MessageSchema<MessagePeerData>
+{
+    enum { code = M_PEER_DATA, fixedSize = SZ_MESSAGE_PEERDATA };
+    static cc_string Sender(const MessagePeerData& msg) { return msg._id; }
+    static char* Sender(MessagePeerData& msg) { return msg._id; }
+    static bool Check(const MessagePeerData&) { return true; }
+    static uint64 TailSize(const MessagePeerData& msg, size_t) { return (uint64)msg._nicknameLength * sizeof(uint16); }
+};
+
+template <>
+struct MessageSchema<MessageText>
+{
+    enum { code = M_TEXT, fixedSize = SZ_MESSAGE_TEXT };
+    static cc_string Sender(const MessageText& msg) { return msg._peerId; }
+    static char* Sender(MessageText& msg) { return msg._peerId; }
+    static bool Check(const MessageText&) { return true; }
+    static uint64 TailSize(const MessageText& msg, size_t) { return (uint64)msg._length * sizeof(uint16); }
+};
+
+template <>
+struct MessageSchema<MessageFileInfo>
+{
+    enum { code = M_FILE_BEGIN, fixedSize = SZ_MESSAGE_FILE_INFO };
+    static cc_string Sender(const MessageFileInfo& msg) { return msg._peerId; }
+    static char* Sender(MessageFileInfo& msg) { return msg._peerId; }
+    static bool Check(const MessageFileInfo&) { return true; }
+    static uint64 TailSize(const MessageFileInfo& msg, size_t) { return msg._nameLength; }
+};
+
+template <>
+struct MessageSchema<MessageFileBlock>
+{
+    enum { code = M_FILE_BLOCK, fixedSize = SZ_MESSAGE_FILE_BLOCK };
+    static cc_string Sender(const MessageFileBlock& msg) { return msg._peerId; }
+    static char* Sender(MessageFileBlock& msg) { return msg._peerId; }
+    static bool Check(const MessageFileBlock& msg) { return msg._size <= FILE_BLOCK_MAX; }
+    static uint64 TailSize(const MessageFileBlock& msg, size_t) { return msg._size; }
+};
+
+template <>
+struct MessageSchema<MessageRequestForFileBlock>
+{
+    enum { code = M_REQ_FOR_FILE_BLOCK, fixedSize = SZ_MESSAGE_REQUEST_FOR_FILE_BLOCK };
+    static cc_string Sender(const MessageRequestForFileBlock& msg) { return msg._peerId; }
+    static char* Sender(MessageRequestForFileBlock& msg) { return msg._peerId; }
+    static bool Check(const MessageRequestForFileBlock&) { return true; }
+    static uint64 TailSize(const MessageRequestForFileBlock&, size_t) { return 0; }
+};
+
+template <>
+struct MessageSchema<MessageRequestForFileBlocks>
+{
+    enum { code = M_REQ_FOR_FILE_BLOCKS, fixedSize = SZ_MESSAGE_REQUEST_FOR_FILE_BLOCKS };
+    static cc_string Sender(const MessageRequestForFileBlocks& msg) { return msg._peerId; }
+    static char* Sender(MessageRequestForFileBlocks& msg) { return msg._peerId; }
+    static bool Check(const MessageRequestForFileBlocks& msg) { return msg._count <= FILE_BLOCKS_RANGES_MAX; }
+    static uint64 TailSize(const MessageRequestForFileBlocks& msg, size_t) { return (uint64)msg._count * sizeof(FileBlocksRange); }
+};
+
+template <>
+struct MessageSchema<MessageFileParity>
+{
+    enum { code = M_FILE_PARITY, fixedSize = SZ_MESSAGE_FILE_PARITY };
+    static cc_string Sender(const MessageFileParity& msg) { return msg._peerId; }
+    static char* Sender(MessageFileParity& msg) { return msg._peerId; }
+    static bool Check(const MessageFileParity& msg)
+    {
+        return msg._size <= FILE_BLOCK_MAX && msg._count >= 1 && msg._count <= FEC_GROUP_MAX;
+    }
+    static uint64 TailSize(const MessageFileParity& msg, size_t) { return (uint64)msg._count * sizeof(uint32) + msg._size; }
+};
+
+template <>
+struct MessageSchema<MessageFileQuery>
+{
+    enum { code = M_FILE_QUERY, fixedSize = SZ_MESSAGE_FILE_QUERY };
+    static cc_string Sender(const MessageFileQuery& msg) { return msg._peerId; }
+    static char* Sender(MessageFileQuery& msg) { return msg._peerId; }
+    static bool Check(const MessageFileQuery&) { return true; }
+    static uint64 TailSize(const MessageFileQuery&, size_t) { return 0; }
+};
+
+template <>
+struct MessageSchema<MessageRequestForFileSignatures>
+{
+    enum { code = M_REQ_FOR_FILE_SIGNATURES, fixedSize = SZ_MESSAGE_REQUEST_FOR_FILE_SIGNATURES };
+    static cc_string Sender(const MessageRequestForFileSignatures& msg) { return msg._peerId; }
+    static char* Sender(MessageRequestForFileSignatures& msg) { return msg._peerId; }
+    static bool Check(const MessageRequestForFileSignatures&) { return true; }
+    static uint64 TailSize(const MessageRequestForFileSignatures&, size_t) { return 0; }
+};
+
+template <>
+struct MessageSchema<MessageFileSignatures>
+{
+    enum { code = M_FILE_SIGNATURES, fixedSize = SZ_MESSAGE_FILE_SIGNATURES };
+    static cc_string Sender(const MessageFileSignatures& msg) { return msg._peerId; }
+    static char* Sender(MessageFileSignatures& msg) { return msg._peerId; }
+    static bool Check(const MessageFileSignatures& msg) { return msg._count >= 1 && msg._count <= FILE_SIGNATURES_MAX; }
+    static uint64 TailSize(const MessageFileSignatures& msg, size_t) { return (uint64)msg._count * sizeof(FileBlockSignature); }
+};
+
+/*
+Read-only view of the received message (bytes aren't copied).
+The datagram is checked once by Validate (code, fixed part, limits, declared tail),
+after that all fields and the tail can be read without checks.
+Bytes after the declared tail (trailers of newer versions) are Rest().
+*/
+template <class T>
+class MessageView
+{
+public:
+    typedef MessageSchema<T> Schema;
+
+    MessageView(cc_string data, size_t size) : _msg((const T*)data), _size(size) { }
+
+    static bool Validate(cc_string data, size_t size)
+    {
+        if (size < (size_t)Schema::fixedSize || ((uint8)data[0] & ~M_V2) != Schema::code)
+            return false;
+
+        const T& msg = *(const T*)data;
+        return Schema::Check(msg) && Schema::TailSize(msg, size - Schema::fixedSize) <= size - Schema::fixedSize;
+    }
+
+    const T* operator->() const { return _msg; }
+    const T& operator*() const { return *_msg; }
+
+    cc_string Sender() const { return Schema::Sender(*_msg); }     // PEER_ID_SIZE + 1 bytes (zero can be absent)
+    uint8 Version() const { return (_msg->_code & M_V2) ? PROTOCOL_V2 : PROTOCOL_V1; }
+
+    cc_string Data() const { return (cc_string)_msg; }
+    size_t Size() const { return _size; }
+
+    cc_string Tail() const { return (cc_string)_msg + Schema::fixedSize; }
+    size_t TailSize() const { return (size_t)Schema::TailSize(*_msg, _size - Schema::fixedSize); }
+    cc_string Rest() const { return Tail() + TailSize(); }
+    size_t RestSize() const { return _size - Schema::fixedSize - TailSize(); }
+private:
+    const T* _msg;
+    size_t _size;
+};
+
+// v1 encoder: fixed part and the zeroed tail of this size, the code and the sender are filled, the rest is left to the caller
+
+template <class T>
+T* BeginMessage(Packet& raw, size_t tailSize, cc_string peerId)
+{
+    raw.resize(MessageSchema<T>::fixedSize + tailSize, 0);
+
+    T* msg = (T*)raw.data();
+    msg->_code = MessageSchema<T>::code;
+    memcpy(MessageSchema<T>::Sender(*msg), peerId, PEER_ID_SIZE + 1);
+    return msg;
+}
+
+#endif // MESSAGE_SCHEMA_H
@@ -0,0 +1,159 @@
+#include "PacketPool.h"
+
+Packet::Packet(const Packet& src) : _buffer(src._buffer), _size(src._size)
+{
+    if (_buffer)
+        _buffer->refs.fetch_add(1, memory_order_relaxed);
+}
+
+Packet& Packet::operator=(const Packet& rval)
+{
+    if (rval._buffer)
+        rval._buffer->refs.fetch_add(1, memory_order_relaxed);
+    Release();
+    _buffer = rval._buffer;
+    _size = rval._size;
+    return *this;
+}
+
+void Packet::Release()
+{
+    if (_buffer && _buffer->refs.fetch_sub(1, memory_order_acq_rel) == 1)
+        PacketPool::Free(_buffer);
+    _buffer = 0;
+}
+
+// small buffer is replaced by the large one (bytes are copied), when it is too small
+
+void Packet::reserve(size_t capacity)
+{
+    if (capacity <= this->capacity())
+        return;
+    if (capacity > PACKET_LARGE)
+        throw logic_error("message is too large");
+
+    PacketBuffer* buffer = PacketPool::Acquire(capacity);
+    if (_size > 0)
+        memcpy(buffer->Data(), _buffer->Data(), _size);
+
+    size_t size = _size;
+    Release();
+    _buffer = buffer;
+    _size = size;
+}
+
+void Packet::resize(size_t size, char c)
+{
+    reserve(size);
+    if (size > _size)
+        memset(data() + _size, c, size - _size);
+    _size = size;
+}
+
+void Packet::allocate(size_t size)
+{
+    Release();
+    _size = 0;
+    reserve(size);
+    _size = size;
+}
+
+void Packet::append(cc_string bytes, size_t size)
+{
+    reserve(_size + size);
+    memcpy(data() + _size, bytes, size);
+    _size += size;
+}
+
+PacketPool& PacketPool::GetInstance()
+{
+    // never destroyed: threads give buffers back to it till the end
+    static PacketPool* instance = new PacketPool;
+    return *instance;
+}
+
+PacketBuffer* PacketPool::Acquire(size_t size)
+{
+    int sizeClass = size <= PACKET_SMALL ? 0 : 1;
+
+    PacketPool& pool = GetInstance();
+    FreeList& list = pool.Cache().lists[sizeClass];
+    if (!list.head)
+        pool.Refill(list, sizeClass);
+
+    PacketBuffer* buffer = list.Pop();
+    buffer->refs.store(1, memory_order_relaxed);
+    return buffer;
+}
+
+void PacketPool::Free(PacketBuffer* buffer)
+{
+    int sizeClass = buffer->capacity == PACKET_SMALL ? 0 : 1;
+
+    PacketPool& pool = GetInstance();
+    FreeList& list = pool.Cache().lists[sizeClass];
+    list.Push(buffer);
+    if (list.count > PACKET_THREAD_CACHE)
+        pool.Drain(list, sizeClass, PACKET_THREAD_CACHE / 2);
+}
+
+PacketPool::ThreadCache& PacketPool::Cache()
+{
+    ThreadCache* cache = _cache.get();
+    if (!cache)
+    {
+        cache = new ThreadCache;
+        _cache.reset(cache);
+    }
+    return *cache;
+}
+
+// thread is finished: its buffers go to the shared lists
+
+PacketPool::ThreadCache::~ThreadCache()
+{
+    for (int sizeClass = 0; sizeClass < 2; ++sizeClass)
+        GetInstance().Drain(lists[sizeClass], sizeClass, 0);
+}
+
+// take a half of the cache from the shared list (new slab is allocated, if it is empty)
+
+void PacketPool::Refill(FreeList& list, int sizeClass)
+{
+    ScopedLock lk(_mutex);
+
+    FreeList& shared = _lists[sizeClass];
+    if (!shared.head)
+        AllocateSlab(sizeClass);
+
+    while (shared.head && list.count < PACKET_THREAD_CACHE / 2)
+        list.Push(shared.Pop());
+}
+
+void PacketPool::Drain(FreeList& list, int sizeClass, size_t keep)
+{
+    ScopedLock lk(_mutex);
+
+    FreeList& shared = _lists[sizeClass];
+    while (list.count > keep)
+        shared.Push(list.Pop());
+}
+
+// _mutex must be locked
+
+void PacketPool::AllocateSlab(int sizeClass)
+{
+    size_t stride = sizeof(PacketBuffer) + Capacity(sizeClass);
+    size_t count = max<size_t>(1, PACKET_SLAB / stride);
+
+    char* slab = new char[count * stride];
+    _slabs.push_back(slab);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        PacketBuffer* buffer = new (slab + i * stride) PacketBuffer;
+        buffer->refs.store(0, memory_order_relaxed);
+        buffer->capacity = (uint32)Capacity(sizeClass);
+        _lists[sizeClass].Push(buffer);
+    }
+}
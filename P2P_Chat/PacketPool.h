@@ -0,0 +1,108 @@
+#ifndef PACKET_POOL_H
+#define PACKET_POOL_H
+
+#include "utils.h"
+
+#include <atomic>
+
+#define PACKET_SMALL (8 * 1024)         // bytes. Messages and received datagrams, which fit into it (all file blocks)
+#define PACKET_LARGE (64 * 1024)        // bytes. Any datagram fits into it (the receive ring)
+#define PACKET_SLAB (512 * 1024)        // bytes. Buffers are allocated by such slabs
+#define PACKET_THREAD_CACHE 128         // buffers of one size, which one thread keeps for itself
+
+// pooled buffer: header and data right after it
+struct PacketBuffer
+{
+    atomic<uint32> refs;
+    uint32 capacity;
+    PacketBuffer* next;     // in free lists
+
+    char* Data() { return (char*)(this + 1); }
+};
+
+/*
+Handle of a pooled buffer. Copies of the handle share the buffer (reference counter),
+the buffer goes back to the pool with the last handle. So a message can be handed to another thread
+(or kept in a queue) without copying. Every handle has its own size, the bytes are shared.
+Interface is like the std::string one (messages are built and read in the same way).
+Buffer is taken on the first write: small one, if the size fits into it, else large one (bigger sizes throw logic_error).
+*/
+class Packet
+{
+public:
+    Packet() : _buffer(0), _size(0) { }
+    Packet(const Packet& src);
+    Packet& operator=(const Packet& rval);
+    ~Packet() { Release(); }
+
+    char* data() { return _buffer ? _buffer->Data() : 0; }
+    cc_string data() const { return _buffer ? _buffer->Data() : 0; }
+    size_t size() const { return _size; }
+    size_t capacity() const { return _buffer ? _buffer->capacity : 0; }
+    bool empty() const { return _size == 0; }
+    char& operator[](size_t i) { return data()[i]; }
+
+    void reserve(size_t capacity);
+    void resize(size_t size, char c = 0);
+    void allocate(size_t size);     // new buffer of this size, bytes aren't filled (receive buffers)
+    void append(cc_string bytes, size_t size);
+    void append(const string& str) { append(str.data(), str.size()); }
+    void clear() { _size = 0; }
+
+    Packet& operator+=(char c) { append(&c, 1); return *this; }
+    Packet& operator+=(const string& str) { append(str); return *this; }
+    Packet& operator+=(cc_string str) { append(str, strlen(str)); return *this; }
+private:
+    PacketBuffer* _buffer;
+    size_t _size;
+
+    void Release();
+};
+
+/*
+Free buffers of two sizes. Every thread takes and gives back buffers to its own cache without locks,
+the cache exchanges halves of it with the shared lists, when it is empty or full.
+Buffers are never freed: the pool grows to the peak of traffic and stays so (slabs live till the end of the process).
+*/
+class PacketPool
+{
+public:
+    static PacketBuffer* Acquire(size_t size);
+    static void Free(PacketBuffer* buffer);
+private:
+    struct FreeList
+    {
+        FreeList() : head(0), count(0) { }
+
+        PacketBuffer* head;
+        size_t count;
+
+        void Push(PacketBuffer* buffer) { buffer->next = head; head = buffer; count += 1; }
+        PacketBuffer* Pop() { PacketBuffer* buffer = head; head = buffer->next; count -= 1; return buffer; }
+    };
+
+    struct ThreadCache
+    {
+        FreeList lists[2];  // small and large
+        ~ThreadCache();
+    };
+
+    Mutex _mutex;           // guards shared lists and slabs
+    FreeList _lists[2];
+    vector<char*> _slabs;
+    boost::thread_specific_ptr<ThreadCache> _cache;
+
+    static PacketPool& GetInstance();
+    static size_t Capacity(int sizeClass) { return sizeClass == 0 ? PACKET_SMALL : PACKET_LARGE; }
+
+    ThreadCache& Cache();
+    void Refill(FreeList& list, int sizeClass);
+    void Drain(FreeList& list, int sizeClass, size_t keep);
+    void AllocateSlab(int sizeClass);
+
+    PacketPool() { }
+    PacketPool(const PacketPool& src);
+    PacketPool& operator=(const PacketPool& rval);
+};
+
+#endif // PACKET_POOL_H
@@ -1,19 +1,21 @@
 #include "Peer.h"
+#include "message_formats.h"
 
-Peer::Peer(const wstring& nick, const string& peerId) : _pingSent(false)
+#include <random>
+
+Peer::Peer(const wstring& nick, const string& peerId) : _token(0), _version(PROTOCOL_V1)
 {    
     SetNickname(nick);
     if (!peerId.empty())
         _id = peerId;
     else
         GenerateId();
-    SetLastActivityCheck(time(0));
 }
 
-Peer::Peer() : _pingSent(false)
+Peer::Peer() : _version(PROTOCOL_VERSION)
 {
     GenerateId();
-    SetLastActivityCheck(time(0));
+    GenerateToken();
 }
 
 
@@ -38,7 +40,7 @@ void Peer::GenerateId()
     char id[PEER_ID_SIZE + 1];
     const char extAlphabet[] = { "0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZ" };
     size_t extAlphLen = strlen(extAlphabet);
-    srand(unsigned int(time(0)));
+    srand((unsigned int)time(0));
 
     size_t i;
     for (i = 0; i < PEER_ID_SIZE; ++i)
@@ -50,3 +52,14 @@ void Peer::GenerateId()
     _id.assign(id);
 
 }
+
+// token of this peer for the current session (never 0)
+
+void Peer::GenerateToken()
+{
+    random_device rd;
+    do
+    {
+        _token = rd();
+    } while (_token == 0);
+}
@@ -11,28 +11,25 @@ public:
     Peer();
     ~Peer() { }
 
-    bool WasPingSent() { return _pingSent; }
-
     void SetNickname(const wstring& nick);
     void SetIp(const string& ip);
-    void SetLastActivityCheck(time_t time) { _lastActivityCheck = time; }
-    void SetPingSentTime(time_t time) { _pingSentTime = time; }
-    void SetPingSent(bool flag) { _pingSent = flag; }
+    void SetToken(uint32 token) { _token = token; }
+    void SetVersion(uint8 version) { _version = version; }
 
     const wstring& GetNickname() const { return _nickname; }
     const string& GetId() const { return _id; }
     const string& GetIp() const { return _ip; }
-    time_t GetLastActivityCheck() { return _lastActivityCheck; }
-    time_t GetPingSentTime() { return _pingSentTime; }
+    uint32 GetToken() const { return _token; }
+    uint8 GetVersion() const { return _version; }
 private:
     wstring _nickname;
     string _ip;
     string _id;
-    time_t _lastActivityCheck;
-    time_t _pingSentTime;
-    bool _pingSent;
+    uint32 _token;      // session token (v2 messages carry it instead of the id)
+    uint8 _version;     // max version of messages, which the peer understands
 
     void GenerateId();
+    void GenerateToken();
 };
 
 #endif // PEER_H
@@ -0,0 +1,243 @@
+#include "PeerTable.h"
+
+PeerTable::PeerTable()
+    : _size(0)
+    , _byId(PEER_INDEX_INITIAL, 0)
+    , _byToken(PEER_INDEX_INITIAL, 0)
+{
+}
+
+PeerHandle PeerTable::Add(const Peer& peer, time_t now)
+{
+    PeerKey key;
+    MakeKey(peer.GetId().c_str(), key);
+    if (Find(key.id) != PEER_NONE || (peer.GetToken() != 0 && FindByToken(peer.GetToken()) != PEER_NONE))
+        return PEER_NONE;
+    if (_size == PEER_TABLE_MAX)
+        return PEER_NONE;
+
+    if ((_size + 1) * 2 > _byId.size())
+        Grow();
+
+    uint32 slot;
+    if (!_freeSlots.empty())
+    {
+        slot = _freeSlots.back();
+        _freeSlots.pop_back();
+        _peers[slot] = peer;
+    }
+    else
+    {
+        slot = (uint32)_peers.size();
+        _peers.push_back(peer);
+        _keys.push_back(key);
+        _idHashes.push_back(0);
+        _tokens.push_back(0);
+        _tokenHashes.push_back(0);
+        _generations.push_back(0);
+        _used.push_back(0);
+        _lastActivity.push_back(0);
+        _pingSentTime.push_back(0);
+        _pingSent.push_back(0);
+    }
+
+    // generation 0 is never used, so PEER_NONE is never valid
+    if (++_generations[slot] == 0)
+        _generations[slot] = 1;
+
+    _keys[slot] = key;
+    _idHashes[slot] = HashId(key);
+    _tokens[slot] = peer.GetToken();
+    _tokenHashes[slot] = HashToken(peer.GetToken());
+    _used[slot] = 1;
+    _lastActivity[slot] = now;
+    _pingSentTime[slot] = 0;
+    _pingSent[slot] = 0;
+    _size += 1;
+
+    Insert(_byId, _idHashes, slot);
+    if (_tokens[slot] != 0)
+        Insert(_byToken, _tokenHashes, slot);
+
+    return Handle(slot);
+}
+
+void PeerTable::Remove(PeerHandle handle)
+{
+    if (!IsValid(handle))
+        return;
+
+    uint32 slot = Slot(handle);
+    Erase(_byId, _idHashes, slot);
+    if (_tokens[slot] != 0)
+        Erase(_byToken, _tokenHashes, slot);
+
+    _used[slot] = 0;
+    _freeSlots.push_back(slot);
+    _size -= 1;
+}
+
+void PeerTable::Clear()
+{
+    for (uint32 slot = 0; slot < _used.size(); ++slot)
+    {
+        if (_used[slot])
+            Remove(Handle(slot));
+    }
+}
+
+PeerHandle PeerTable::Find(cc_string id) const
+{
+    PeerKey key;
+    MakeKey(id, key);
+    uint32 hash = HashId(key);
+
+    size_t mask = _byId.size() - 1;
+    for (size_t i = hash & mask; _byId[i] != 0; i = (i + 1) & mask)
+    {
+        uint32 slot = _byId[i] - 1;
+        if (_idHashes[slot] == hash && memcmp(_keys[slot].id, key.id, sizeof(key.id)) == 0)
+            return Handle(slot);
+    }
+
+    return PEER_NONE;
+}
+
+PeerHandle PeerTable::FindByToken(uint32 token) const
+{
+    if (token == 0)
+        return PEER_NONE;
+
+    size_t mask = _byToken.size() - 1;
+    for (size_t i = HashToken(token) & mask; _byToken[i] != 0; i = (i + 1) & mask)
+    {
+        uint32 slot = _byToken[i] - 1;
+        if (_tokens[slot] == token)
+            return Handle(slot);
+    }
+
+    return PEER_NONE;
+}
+
+PeerHandle PeerTable::FindByIp(const string& ip) const
+{
+    for (PeerHandle handle = First(); handle != PEER_NONE; handle = Next(handle))
+    {
+        if (Get(handle).GetIp() == ip)
+            return handle;
+    }
+
+    return PEER_NONE;
+}
+
+bool PeerTable::IsValid(PeerHandle handle) const
+{
+    uint32 slot = Slot(handle);
+    return slot < _used.size() && _used[slot] && _generations[slot] == (handle >> 16);
+}
+
+void PeerTable::Touch(PeerHandle handle, time_t now)
+{
+    uint32 slot = Slot(handle);
+    _lastActivity[slot] = now;
+    _pingSent[slot] = 0;
+}
+
+void PeerTable::SetPingSent(PeerHandle handle, time_t now)
+{
+    uint32 slot = Slot(handle);
+    _pingSentTime[slot] = now;
+    _pingSent[slot] = 1;
+}
+
+// first used slot starting from this one
+
+PeerHandle PeerTable::Scan(uint32 slot) const
+{
+    for (; slot < _used.size(); ++slot)
+    {
+        if (_used[slot])
+            return Handle(slot);
+    }
+
+    return PEER_NONE;
+}
+
+// id without the terminating zero (it can be absent in a broken message)
+
+void PeerTable::MakeKey(cc_string id, PeerKey& key)
+{
+    memset(key.id, 0, sizeof(key.id));
+    memcpy(key.id, id, strnlen(id, PEER_ID_SIZE));
+}
+
+// FNV-1a
+
+uint32 PeerTable::HashId(const PeerKey& key)
+{
+    uint32 hash = 2166136261u;
+    for (size_t i = 0; i < PEER_ID_SIZE; ++i)
+    {
+        hash ^= (uint8)key.id[i];
+        hash *= 16777619u;
+    }
+    return hash;
+}
+
+// tokens are random, but they are mixed anyway (Fibonacci hashing, high bits are folded into the low ones)
+
+uint32 PeerTable::HashToken(uint32 token)
+{
+    uint32 hash = token * 2654435769u;
+    return hash ^ (hash >> 16);
+}
+
+void PeerTable::Insert(vector<uint32>& index, const vector<uint32>& hashes, uint32 slot)
+{
+    size_t mask = index.size() - 1;
+    size_t i = hashes[slot] & mask;
+    while (index[i] != 0)
+        i = (i + 1) & mask;
+    index[i] = slot + 1;
+}
+
+// backward shift deletion: the next cells of the chain are moved into the hole, so there are no tombstones
+
+void PeerTable::Erase(vector<uint32>& index, const vector<uint32>& hashes, uint32 slot)
+{
+    size_t mask = index.size() - 1;
+    size_t hole = hashes[slot] & mask;
+    while (index[hole] != slot + 1)
+    {
+        if (index[hole] == 0)
+            return;
+        hole = (hole + 1) & mask;
+    }
+
+    for (size_t i = (hole + 1) & mask; index[i] != 0; i = (i + 1) & mask)
+    {
+        // the cell can be moved, if its home isn't between the hole and itself
+        size_t home = hashes[index[i] - 1] & mask;
+        if (((i - home) & mask) >= ((i - hole) & mask))
+        {
+            index[hole] = index[i];
+            hole = i;
+        }
+    }
+    index[hole] = 0;
+}
+
+void PeerTable::Grow()
+{
+    _byId.assign(_byId.size() * 2, 0);
+    _byToken.assign(_byToken.size() * 2, 0);
+
+    for (uint32 slot = 0; slot < _used.size(); ++slot)
+    {
+        if (!_used[slot])
+            continue;
+        Insert(_byId, _idHashes, slot);
+        if (_tokens[slot] != 0)
+            Insert(_byToken, _tokenHashes, slot);
+    }
+}
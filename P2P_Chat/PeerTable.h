@@ -0,0 +1,91 @@
+#ifndef PEER_TABLE_H
+#define PEER_TABLE_H
+
+#include "utils.h"
+#include "Peer.h"
+
+typedef uint32 PeerHandle;  // generation of the slot << 16 | slot
+
+#define PEER_NONE 0
+#define PEER_TABLE_MAX 0xFFFF       // peers (slot is 16 bits)
+#define PEER_INDEX_INITIAL 64       // cells of the indexes (power of 2)
+
+/*
+Remote peers of the chat. Every peer gets a handle on the first contact,
+after that messages find it by the id (or by the token of v2 messages) without allocations:
+ids and tokens are kept in open-addressing indexes (linear probing, cell keeps slot + 1, 0 - empty cell),
+which are never filled more than by half.
+Peers are kept by value in slots of flat arrays, liveness fields (checked every second) have their own arrays.
+Handle of the removed peer doesn't find the next peer in its slot: the slot gets the new generation.
+Table isn't thread-safe (ChatClient guards it by _peersMutex).
+*/
+class PeerTable
+{
+public:
+    PeerTable();
+    ~PeerTable() { }
+
+    PeerHandle Add(const Peer& peer, time_t now);  // PEER_NONE, if the id or the token is taken or the table is full
+    void Remove(PeerHandle handle);
+    void Clear();
+
+    PeerHandle Find(cc_string id) const;            // id is PEER_ID_SIZE + 1 bytes at most
+    PeerHandle FindByToken(uint32 token) const;
+    PeerHandle FindByIp(const string& ip) const;    // slow, for commands of the user
+
+    bool IsValid(PeerHandle handle) const;
+    size_t Size() const { return _size; }
+    bool Empty() const { return _size == 0; }
+
+    // for (PeerHandle h = First(); h != PEER_NONE; h = Next(h)), the current peer can be removed
+    PeerHandle First() const { return Scan(0); }
+    PeerHandle Next(PeerHandle handle) const { return Scan(Slot(handle) + 1); }
+
+    // handle must be valid
+    const Peer& Get(PeerHandle handle) const { return _peers[Slot(handle)]; }
+    cc_string GetId(PeerHandle handle) const { return _keys[Slot(handle)].id; } // PEER_ID_SIZE + 1 bytes
+
+    // liveness
+    void Touch(PeerHandle handle, time_t now);      // the peer has sent something, it is alive
+    void SetPingSent(PeerHandle handle, time_t now);
+    bool WasPingSent(PeerHandle handle) const { return _pingSent[Slot(handle)] != 0; }
+    time_t GetLastActivity(PeerHandle handle) const { return _lastActivity[Slot(handle)]; }
+    time_t GetPingSentTime(PeerHandle handle) const { return _pingSentTime[Slot(handle)]; }
+private:
+    struct PeerKey
+    {
+        char id[PEER_ID_SIZE + 1];  // padded by zeros
+    };
+
+    // slots
+    vector<Peer> _peers;
+    vector<PeerKey> _keys;
+    vector<uint32> _idHashes;
+    vector<uint32> _tokens;
+    vector<uint32> _tokenHashes;
+    vector<uint16> _generations;
+    vector<uint8> _used;
+    vector<time_t> _lastActivity;
+    vector<time_t> _pingSentTime;
+    vector<uint8> _pingSent;
+    vector<uint32> _freeSlots;
+    size_t _size;
+
+    // indexes
+    vector<uint32> _byId;
+    vector<uint32> _byToken;
+
+    static uint32 Slot(PeerHandle handle) { return handle & 0xFFFF; }
+    PeerHandle Handle(uint32 slot) const { return ((uint32)_generations[slot] << 16) | slot; }
+    PeerHandle Scan(uint32 slot) const;
+
+    static void MakeKey(cc_string id, PeerKey& key);
+    static uint32 HashId(const PeerKey& key);
+    static uint32 HashToken(uint32 token);
+
+    static void Insert(vector<uint32>& index, const vector<uint32>& hashes, uint32 slot);
+    static void Erase(vector<uint32>& index, const vector<uint32>& hashes, uint32 slot);
+    void Grow();
+};
+
+#endif // PEER_TABLE_H
@@ -0,0 +1,140 @@
+#include "TransferJournal.h"
+#include "Logger.h"
+
+// FNV-1a (64 bits)
+
+static void Mix(uint64& hash, cc_string data, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        hash ^= (uint8)data[i];
+        hash *= 1099511628211ull;
+    }
+}
+
+// number of this size (bytes) in little-endian order: the hash is the same on every peer
+
+static void MixNumber(uint64& hash, uint64 value, size_t size)
+{
+    for (size_t i = 0; i < size; ++i)
+    {
+        char byte = (char)(value >> (8 * i));
+        Mix(hash, &byte, 1);
+    }
+}
+
+// reading of the whole file would take too long for big files: the time of the last change stands for the middle
+
+FileIdentity TransferJournal::Identify(cc_string data, uint64 size, time_t lastWrite)
+{
+    uint64 hash = 14695981039346656037ull;
+    int64_t changed = (int64_t)lastWrite;
+    Mix(hash, (cc_string)&size, sizeof(size));
+    Mix(hash, (cc_string)&changed, sizeof(changed));
+
+    size_t edge = (size_t)min<uint64>(size, FILE_BLOCK_MAX);
+    if (edge > 0)
+    {
+        Mix(hash, data, edge);
+        Mix(hash, data + size - edge, edge);
+    }
+
+    FileIdentity identity;
+    identity.size = size;
+    identity.hash = hash != 0 ? hash : 1;
+    return identity;
+}
+
+// CRCs of blocks are computed anyway, the file isn't read again (and the time of the change doesn't matter)
+
+uint64 TransferJournal::HashContent(uint64 size, const vector<uint32>& blockCrcs)
+{
+    uint64 hash = 14695981039346656037ull;
+    MixNumber(hash, size, sizeof(size));
+    for (size_t i = 0; i < blockCrcs.size(); ++i)
+        MixNumber(hash, blockCrcs[i], sizeof(uint32));
+
+    return hash != 0 ? hash : 1;
+}
+
+bool TransferJournal::Load(const string& fileName, const FileIdentity& identity, uint32 blockSize,
+    vector<bool>& received, vector<uint32>& crcs)
+{
+    InFile journal(PathOf(fileName).c_str(), ios_base::in | ios_base::binary);
+    if (!journal.is_open())
+        return false;
+
+    // the count of blocks follows from the size: broken journal can't make vectors larger than the file needs
+    Header header;
+    if (!journal.read((c_string)&header, sizeof(header))
+        || memcmp(header.magic, JOURNAL_MAGIC, sizeof(header.magic)) != 0
+        || header.blockSize != blockSize || header.size != identity.size || header.hash != identity.hash
+        || header.blocks != (identity.size + blockSize - 1) / blockSize)
+        return false;
+
+    vector<char> bitmap((header.blocks + 7) / 8);
+    if (!bitmap.empty() && !journal.read(&bitmap[0], bitmap.size()))
+        return false;
+
+    crcs.assign(header.blocks, 0);
+    if (!crcs.empty() && !journal.read((c_string)&crcs[0], crcs.size() * sizeof(uint32)))
+        return false;
+
+    received.assign(header.blocks, false);
+    for (uint32 block = 0; block < header.blocks; ++block)
+        received[block] = (bitmap[block / 8] >> (block % 8)) & 1;
+
+    return true;
+}
+
+bool TransferJournal::Save(const string& fileName, const FileIdentity& identity, uint32 blockSize,
+    const vector<bool>& received, const vector<uint32>& crcs)
+{
+    Header header;
+    memcpy(header.magic, JOURNAL_MAGIC, sizeof(header.magic));
+    header.blockSize = blockSize;
+    header.size = identity.size;
+    header.hash = identity.hash;
+    header.blocks = (uint32)received.size();
+
+    vector<char> bitmap((received.size() + 7) / 8, 0);
+    for (size_t block = 0; block < received.size(); ++block)
+    {
+        if (received[block])
+            bitmap[block / 8] |= (char)(1 << (block % 8));
+    }
+
+    // the old journal stays valid, until the new one is written completely
+    string path = PathOf(fileName);
+    string temp = path + ".tmp";
+    {
+        OutFile journal(temp.c_str(), ios_base::out | ios_base::trunc | ios_base::binary);
+        journal.write((cc_string)&header, sizeof(header));
+        if (!bitmap.empty())
+            journal.write(&bitmap[0], bitmap.size());
+        if (!crcs.empty())
+            journal.write((cc_string)&crcs[0], crcs.size() * sizeof(uint32));
+        journal.close();
+        if (!journal)
+        {
+            LOG_ERROR("Can't write journal ", path);
+            return false;
+        }
+    }
+
+    ErrorCode ec;
+    boost::filesystem::rename(temp, path, ec);
+    if (ec)
+    {
+        LOG_ERROR("Can't write journal ", path, ": ", ec.message());
+        return false;
+    }
+
+    return true;
+}
+
+void TransferJournal::Remove(const string& fileName)
+{
+    ErrorCode ec;
+    boost::filesystem::remove(PathOf(fileName), ec);
+}
@@ -0,0 +1,49 @@
+#ifndef TRANSFER_JOURNAL_H
+#define TRANSFER_JOURNAL_H
+
+#include "utils.h"
+#include "message_formats.h"
+
+#define JOURNAL_EXTENSION ".journal"
+#define JOURNAL_MAGIC "P2J2"
+#define JOURNAL_INTERVAL 1024           // blocks. Journal of the download is saved after receiving so many blocks.
+
+/*
+Journal of the partial download. It lies next to the file (name.journal) and tells,
+which blocks of what file (FileIdentity) are on the disk already, so the download of the same file
+is resumed from it, even after restart of the receiver or the sender.
+Journal is rewritten as a whole (header, bitmap of blocks (LSB first), then CRC-32C of every block)
+and replaces the old one by rename. CRCs of blocks, which are on the disk, let the receiver check the whole file
+without reading it again.
+Blocks are flushed into the file before the journal is saved: it never claims blocks, which aren't written.
+*/
+class TransferJournal
+{
+public:
+    // identity of the file, which is sent (data is the whole file)
+    static FileIdentity Identify(cc_string data, uint64 size, time_t lastWrite);
+    // hash of the content (see FILE_EXT_CONTENT) by CRC-32C of all blocks
+    static uint64 HashContent(uint64 size, const vector<uint32>& blockCrcs);
+
+    // false, if there is no journal or it is of another file (or of other blocks)
+    static bool Load(const string& fileName, const FileIdentity& identity, uint32 blockSize,
+        vector<bool>& received, vector<uint32>& crcs);
+    static bool Save(const string& fileName, const FileIdentity& identity, uint32 blockSize,
+        const vector<bool>& received, const vector<uint32>& crcs);
+    static void Remove(const string& fileName);
+private:
+#pragma pack(push, 1)
+    struct Header
+    {
+        char magic[4];      // JOURNAL_MAGIC
+        uint32 blockSize;   // bytes
+        uint64 size;        // identity of the file
+        uint64 hash;
+        uint32 blocks;      // bits in the bitmap, CRCs after it
+    };
+#pragma pack(pop)
+
+    static string PathOf(const string& fileName) { return fileName + JOURNAL_EXTENSION; }
+};
+
+#endif // TRANSFER_JOURNAL_H
@@ -3,316 +3,750 @@
 #include "message_formats.h"
 #include "Logger.h"
 
-ChatClient* ChatClient::Handler::_chatClient = 0;
+#include <boost/bind.hpp>
 
-void ChatClient::HandlerSys::handle(cc_string data, size_t size)
+// dispatch table, in the order of MessageType
+
+const ChatClient::MessageHandler ChatClient::_handlers[LAST + 1] =
+{
+    // M_SYS
+    { &MessageView<MessageSystem>::Validate,
+      &ChatClient::RouteToChat,
+      &ChatClient::HandleMessage<MessageSystem, &ChatClient::OnSystem> },
+    // M_TEXT
+    { &MessageView<MessageText>::Validate,
+      &ChatClient::RouteToChat,
+      &ChatClient::HandleMessage<MessageText, &ChatClient::OnText> },
+    // M_FILE_BEGIN
+    { &MessageView<MessageFileInfo>::Validate,
+      &ChatClient::RouteToChat,
+      &ChatClient::HandleMessage<MessageFileInfo, &ChatClient::OnFileInfo> },
+    // M_FILE_BLOCK
+    { &MessageView<MessageFileBlock>::Validate,
+      &ChatClient::RouteMessage<MessageFileBlock, &ChatClient::RouteFileBlock>,
+      &ChatClient::HandleMessage<MessageFileBlock, &ChatClient::OnFileBlock> },
+    // M_REQ_FOR_FILE_BLOCK
+    { &MessageView<MessageRequestForFileBlock>::Validate,
+      &ChatClient::RouteMessage<MessageRequestForFileBlock, &ChatClient::RouteRequestForFileBlock>,
+      &ChatClient::HandleMessage<MessageRequestForFileBlock, &ChatClient::OnRequestForFileBlock> },
+    // M_PEER_DATA
+    { &MessageView<MessagePeerData>::Validate,
+      &ChatClient::RouteToChat,
+      &ChatClient::HandleMessage<MessagePeerData, &ChatClient::OnPeerData> },
+    // M_REQ_FOR_FILE_BLOCKS
+    { &MessageView<MessageRequestForFileBlocks>::Validate,
+      &ChatClient::RouteMessage<MessageRequestForFileBlocks, &ChatClient::RouteRequestForFileBlocks>,
+      &ChatClient::HandleMessage<MessageRequestForFileBlocks, &ChatClient::OnRequestForFileBlocks> },
+    // M_FILE_PARITY
+    { &MessageView<MessageFileParity>::Validate,
+      &ChatClient::RouteMessage<MessageFileParity, &ChatClient::RouteFileParity>,
+      &ChatClient::HandleMessage<MessageFileParity, &ChatClient::OnFileParity> },
+    // M_FILE_QUERY
+    { &MessageView<MessageFileQuery>::Validate,
+      &ChatClient::RouteToChat,
+      &ChatClient::HandleMessage<MessageFileQuery, &ChatClient::OnFileQuery> },
+    // M_REQ_FOR_FILE_SIGNATURES
+    { &MessageView<MessageRequestForFileSignatures>::Validate,
+      &ChatClient::RouteMessage<MessageRequestForFileSignatures, &ChatClient::RouteRequestForFileSignatures>,
+      &ChatClient::HandleMessage<MessageRequestForFileSignatures, &ChatClient::OnRequestForFileSignatures> },
+    // M_FILE_SIGNATURES
+    { &MessageView<MessageFileSignatures>::Validate,
+      &ChatClient::RouteMessage<MessageFileSignatures, &ChatClient::RouteFileSignatures>,
+      &ChatClient::HandleMessage<MessageFileSignatures, &ChatClient::OnFileSignatures> },
+};
+
+// the handler gets its own copy of the message (the buffer of the current one is released after return)
+
+template <class T>
+void ChatClient::Reroute(Strand& strand, const MessageView<T>& msg, const UdpEndpoint& from)
 {
-    MessageSystem* msgSys = (MessageSystem*)data;
+    Packet packet;
+    packet.append(msg.Data(), msg.Size());
+    strand.post(boost::bind(&ChatClient::HandlePacket, this, &_handlers[MessageSchema<T>::code], packet, from));
+}
 
+void ChatClient::OnSystem(const MessageView<MessageSystem>& msg, const UdpEndpoint& from)
+{
     string action;
-    action.assign(msgSys->_action);
-    string peerId;
-    peerId.assign(msgSys->_peerId);
+    action.assign(msg.Tail(), strnlen(msg.Tail(), msg.TailSize()));
 
-    Peers::iterator it = _chatClient->_peersMap.find(peerId);
+    // new peers send the id of the file after "filedone" and "filecorrupted"
+    bool fileKnown = msg.TailSize() >= action.length() + 1 + sizeof(uint32);
+    uint32 fileId = fileKnown ? MessageBuilder::LoadUint32(msg.Tail() + action.length() + 1) : 0;
 
-    if (peerId == _chatClient->_thisPeer.GetId())
-    {
-        return;
-    }
-    else if (it == _chatClient->_peersMap.end())
-    {
-        Logger::GetInstance()->Trace("Received '", action, "' message from unknown peer ", peerId);
+    ScopedLock lk(_peersMutex);
+    PeerHandle peer = FindSender(msg.Sender(), action.c_str());
+    if (peer == PEER_NONE)
         return;
-    }
-
-    Peer* peer = (*it).second;
-
-    peer->SetLastActivityCheck(time(0));
-    peer->SetPingSent(false);
 
     if (action == "quit")
     {
-        wcout << peer->GetNickname();
+        wcout << _peers.Get(peer).GetNickname();
         cout << " left out chat." << endl;
-        Logger::GetInstance()->Trace("Peer ", peer->GetId(), " left out chat. Removing it from peers map");
-        _chatClient->_peersMap.erase(it->first);
+        LOG_INFO("Peer ", _peers.GetId(peer), " left out chat. Removing it from peers table");
+        _peers.Remove(peer);
     }
     else if (action == "ping")
     {
-        UdpEndpoint endp = _chatClient->_recvEndpoint;
-        endp.port(_chatClient->_port);
-        _chatClient->SendTo(endp, MessageBuilder::System("pong", _chatClient->_thisPeer.GetId()));
+        UdpEndpoint endp = from;
+        endp.port(_port);
+        SendTo(endp, MessageBuilder::System("pong", _thisPeer, _peers.Get(peer).GetVersion()));
     }
     else if (action == "filedone")
     {
-        Logger::GetInstance()->Trace("File was successfully sent");
-        cout << "\n File was successfully sent" << endl;
+        // the file, which is sent to all, is done by every peer one by one
+        LOG_INFO("File was successfully sent to ", _peers.GetId(peer));
+        cout << "\n File was successfully sent to ";
+        wcout << _peers.Get(peer).GetNickname() << endl;
+
+        lk.unlock();
+        if (fileKnown)
+            CloseSendingFile(fileId, from);
+    }
+    else if (action == "filecorrupted")
+    {
+        LOG_ERROR("File was sent, but its CRC doesn't match on the receiver");
+        cout << "\n File was sent, but the receiver got it corrupted" << endl;
+
+        lk.unlock();
+        if (fileKnown)
+            CloseSendingFile(fileId, from);
     }
 }
 
-void ChatClient::HandlerText::handle(cc_string data, size_t size)
+void ChatClient::OnText(const MessageView<MessageText>& msg, const UdpEndpoint&)
 {
-    MessageText* msgText = (MessageText*)data;
-
-    string peerId;
-    peerId.assign(msgText->_peerId);
-
-    Peers::iterator it = _chatClient->_peersMap.find(peerId);
-
-    if (peerId == _chatClient->_thisPeer.GetId())
-    {
-        wcout << _chatClient->_thisPeer.GetNickname() << " > ";
-    }
-    else if (it == _chatClient->_peersMap.end())
-    {
-        Logger::GetInstance()->Trace("Received text message from unknown peer ", peerId);
-        return;
-    }
-    else
+    wstring nick;
     {
-        Peer* peer = (*it).second;
-        peer->SetLastActivityCheck(time(0));
-        peer->SetPingSent(false);
-        wcout << peer->GetNickname() << " > ";
+        ScopedLock lk(_peersMutex);
+        if (IsThisPeer(msg.Sender()))
+        {
+            nick = _thisPeer.GetNickname();
+        }
+        else
+        {
+            PeerHandle peer = FindSender(msg.Sender(), "text message");
+            if (peer == PEER_NONE)
+                return;
+            nick = _peers.Get(peer).GetNickname();
+        }
     }
-    wcout.write(msgText->_text, msgText->_length);
-    wcout << endl;
+    wcout << nick << " > " << from_utf16((cc_string)msg->_text, msg->_length) << endl;
 }
 
-void ChatClient::HandlerPeerData::handle(cc_string data, size_t size)
+void ChatClient::OnPeerData(const MessageView<MessagePeerData>& msg, const UdpEndpoint& from)
 {
-    MessagePeerData* msgPeerData = (MessagePeerData*)data;
+    ScopedLock lk(_peersMutex);
 
-    string peerId;
-    peerId.assign(msgPeerData->_id);
-    wstring peerNick;
-    peerNick.assign(msgPeerData->_nickname, msgPeerData->_nicknameLength);
-
-    Peers::iterator it = _chatClient->_peersMap.find(peerId);
-
-    if (peerId != _chatClient->_thisPeer.GetId() && it == _chatClient->_peersMap.end())
+    if (!IsThisPeer(msg.Sender()) && _peers.Find(msg.Sender()) == PEER_NONE)
     {
-        Logger::GetInstance()->Trace("Found peer: ", peerId, ", adding to peers map");
+        string peerId;
+        peerId.assign(msg.Sender(), strnlen(msg.Sender(), PEER_ID_SIZE));
+        wstring peerNick = from_utf16((cc_string)msg->_nickname, msg->_nicknameLength);
+
+        Peer peer(peerNick, peerId);
+        peer.SetIp(from.address().to_string());
+
+        // new client appends its token and version after the nickname
+        if (msg.RestSize() >= sizeof(PeerDataTrailer))
+        {
+            const PeerDataTrailer* trailer = (const PeerDataTrailer*)msg.Rest();
+            uint32 token = MessageBuilder::Token((cc_string)&trailer->_token);
+            if (memcmp(trailer->_magic, PEER_DATA_MAGIC, sizeof(trailer->_magic)) == 0 && trailer->_version >= PROTOCOL_V2
+                && token != 0 && _peers.FindByToken(token) == PEER_NONE)
+            {
+                peer.SetToken(token);
+                peer.SetVersion(min<uint8>(trailer->_version, PROTOCOL_VERSION));
+            }
+        }
+
+        if (_peers.Add(peer, time(0)) == PEER_NONE)
+        {
+            LOG_ERROR("Table of peers is full, peer ", peerId, " is ignored");
+            return;
+        }
 
+        LOG_INFO("Found peer: ", peerId, ", adding to peers table");
         wcout << peerNick;
         cout << " entered chat." << endl;
 
-        Peer* peer = new Peer(peerNick, peerId);
-        peer->SetIp(_chatClient->_recvEndpoint.address().to_string());
-        peer->SetLastActivityCheck(time(0));
-        peer->SetPingSent(false);
-        _chatClient->_peersMap[peerId] = peer;
-        UdpEndpoint endp = _chatClient->_recvEndpoint;
-        endp.port(_chatClient->_port);
-        _chatClient->SendTo(endp, MessageBuilder::PeerData(_chatClient->_thisPeer.GetNickname(), _chatClient->_thisPeer.GetId()));
+        UdpEndpoint endp = from;
+        endp.port(_port);
+        SendTo(endp, MessageBuilder::PeerData(_thisPeer));
     }    
 }
 
-void ChatClient::HandlerFileInfo::handle(cc_string data, size_t)
+// new sender tells the identity of the file: the partial download of it is resumed (see TransferJournal)
+// and its CRC-32C: the file is checked, when all blocks are received
+// peer, which offers the file with the content of the downloading one, becomes one more source of it
+// the old copy of the file (it isn't resumed) is moved aside: its blocks are found by signatures (see DeltaTransfer.h)
+
+void ChatClient::OnFileInfo(const MessageView<MessageFileInfo>& msg, const UdpEndpoint& from)
 {
-    MessageFileInfo* msgFileInfo = (MessageFileInfo*)data;
+    PeerHandle peer;
+    {
+        ScopedLock lk(_peersMutex);
+        peer = FindSender(msg.Sender(), "file info message");
+        if (peer == PEER_NONE)
+            return;
+    }
+
+    UploadingFilePtr ctx(new UploadingFilesContext(_ioService));
 
-    string peerId;
-    peerId.assign(msgFileInfo->_peerId);
+    string name(msg->_name, min<uint32>(msg->_nameLength, 256));
 
-    Peers::iterator peer_it = _chatClient->_peersMap.find(peerId);
+    // maybe we have the same already (is downloading)
+    // (file info messages are handled on the chat strand only, so nobody adds it until we finish)
+    TransferKey key(from, msg->_id);
 
-    if (peerId == _chatClient->_thisPeer.GetId())
+    // M_FI is repeated, when the request is lost or the file is sent to all (then the download may be finished already)
+    if (FindUploadingFile(key))
     {
+        LOG_DEBUG("This file is already downloading '", name, "'");
         return;
     }
-    else if (peer_it == _chatClient->_peersMap.end())
+    if (IsFinishedFile(key))
     {
-        Logger::GetInstance()->Trace("Received file info message from unknown peer ", peerId);
+        LOG_DEBUG("File ", name, " is received already");
         return;
     }
-    Peer* peer = (*peer_it).second;
-
-    peer->SetLastActivityCheck(time(0));
-    peer->SetPingSent(false);
-
-    auto_ptr< UploadingFilesContext > ctx(new UploadingFilesContext);
 
-    // maybe we have the same already (is downloading)
-    stringstream ss;
-    ss << _chatClient->_recvEndpoint.address().to_string() << ":" << msgFileInfo->_id;
-    string key(ss.str());
+    FileExtensions extensions;
+    MessageBuilder::ReadFileExtensions(msg.Rest(), msg.RestSize(), extensions);
+    const FileIdentity& identity = extensions.identity;
 
-    UploadingFilesMap::iterator it = _chatClient->_uploadingFiles.find(key);
-    if (it != _chatClient->_uploadingFiles.end())
+    if (extensions.source)
     {
-        ss.str(string());
-        ss << "This file is already downloading '" << msgFileInfo->_name << "'";
-        cout << ss.str();
+        UploadingFilePtr download = FindUploadingContent(extensions);
+        if (!download || download->blocks != msg->_totalBlocks)
+        {
+            LOG_DEBUG("File ", name, " is offered, but it isn't downloading");
+            return;
+        }
+
+        FileSource source;
+        source.peer = peer;
+        source.key = key;
+        source.endpoint = from;
+        source.endpoint.port(_port);
+        source.id = msg->_id;
+        source.version = msg.Version();
+        source.codecs = COMPRESS_FILE_BLOCKS == 1 ? (extensions.codecs & FILE_CODEC_LZ4) : 0;
+        download->strand.post(boost::bind(&ChatClient::AddFileSource, this, download, source));
         return;
     }
 
-    // try to open
+    // old copy, which is left by the crash, belongs to no download: the file could be changed since then
+    ErrorCode ec;
+    string basis = name + DELTA_BASIS_EXTENSION;
+    boost::filesystem::remove(basis, ec);
 
-    if (msgFileInfo->_nameLength > 256)
-        msgFileInfo->_nameLength = 256;
+    // blocks from the journal are on the disk, the file is opened without truncation
+    bool resumed = identity.IsKnown() && (uint64)msg->_totalBlocks * FILE_BLOCK_MAX >= identity.size
+        && TransferJournal::Load(name, identity, FILE_BLOCK_MAX, ctx->received, ctx->blockCrcs)
+        && ctx->received.size() == msg->_totalBlocks;
+    if (resumed)
+    {
+        ctx->fp.open(name.c_str(), ios_base::in | ios_base::out | ios_base::binary);
+        resumed = ctx->fp.is_open();
+    }
 
-    msgFileInfo->_name[msgFileInfo->_nameLength] = '\0';
+    if (!resumed && DELTA_FILE_BLOCKS == 1 && extensions.signatures && identity.IsKnown() && extensions.crcKnown && msg->_totalBlocks > 0)
+    {
+        if (boost::filesystem::file_size(name, ec) > 0 && !ec)
+            boost::filesystem::rename(name, basis, ec);
+        if (!ec && boost::filesystem::exists(basis, ec))
+        {
+            ctx->delta.reset(new DeltaState());
+            ctx->delta->basis = basis;
+            ctx->delta->weakSums.assign(msg->_totalBlocks, 0);
+            ctx->delta->crcs.assign(msg->_totalBlocks, 0);
+            ctx->delta->pages.assign((msg->_totalBlocks + FILE_SIGNATURES_MAX - 1) / FILE_SIGNATURES_MAX, false);
+            ctx->delta->pagesReceived = 0;
+            ctx->delta->nextPage = 0;
+        }
+    }
+
+    // try to open
 
-    ctx->fp.open(msgFileInfo->_name, ios_base::out | ios_base::trunc | ios_base::binary);
+    if (!resumed)
+    {
+        ctx->received.assign(msg->_totalBlocks, false);
+        ctx->blockCrcs.assign(msg->_totalBlocks, 0);
+        ctx->fp.open(name.c_str(), ios_base::out | ios_base::trunc | ios_base::binary);
+    }
 
     if (!ctx->fp.is_open())
     {
-        ss.str(string());
-        ss << "Can't open for writing '" << msgFileInfo->_name << "'";
-        cout << ss.str();
+        // the old copy is put back, it isn't lost for the next try
+        if (ctx->delta)
+            boost::filesystem::rename(basis, name, ec);
+        cout << "Can't open for writing '" << name << "'";
         return;
     }
-    
-    Logger::GetInstance()->Trace("Start uploading file ", msgFileInfo->_name);
-    cout << "\nStart uploading file " << msgFileInfo->_name << endl;
+
+    uint32 blocksReceived = (uint32)count(ctx->received.begin(), ctx->received.end(), true);
+    if (resumed)
+    {
+        LOG_INFO("Resume uploading file ", name, " (", blocksReceived, " from ", msg->_totalBlocks, " blocks are received)");
+        cout << "\nResume uploading file " << name << endl;
+    }
+    else if (ctx->delta)
+    {
+        LOG_INFO("Start uploading file ", name, " (only changes of the old copy)");
+        cout << "\nStart uploading changes of file " << name << endl;
+    }
+    else
+    {
+        LOG_INFO("Start uploading file ", name);
+        cout << "\nStart uploading file " << name << endl;
+    }
 
     // fill in the fields
-    ctx->endpoint = _chatClient->_recvEndpoint;
-    ctx->endpoint.port(_chatClient->_port);
-    ctx->id = msgFileInfo->_id;
-    ctx->blocks = msgFileInfo->_totalBlocks;
-    ctx->resendCount = 0;
-    ctx->blocksReceived = 0;
-    ctx->name = string(msgFileInfo->_name, msgFileInfo->_nameLength);
-    ctx->ts = time(0);
-
-    // requesting the first packet
-    _chatClient->SendReqForFileBlockMsg(ctx.get());
+    FileSource source;
+    source.peer = peer;
+    source.key = key;
+    source.endpoint = from;
+    source.endpoint.port(_port);
+    source.id = msg->_id;
+    source.version = msg.Version();
+    source.codecs = COMPRESS_FILE_BLOCKS == 1 ? (extensions.codecs & FILE_CODEC_LZ4) : 0;
+    ctx->sources.push_back(source);
+    ctx->key = key;
+    ctx->blocks = msg->_totalBlocks;
+    ctx->blocksReceived = blocksReceived;
+    ctx->firstMissing = 0;
+    while (ctx->firstMissing < ctx->blocks && ctx->received[ctx->firstMissing])
+        ctx->firstMissing += 1;
+    ctx->nextBlock = ctx->firstMissing;
+    ctx->progress = 0;
+    ctx->identity = identity;
+    ctx->crc = extensions.crc;
+    ctx->crcKnown = extensions.crcKnown;
+    ctx->content = identity.IsKnown() && extensions.crcKnown ? extensions.content : 0;
+    ctx->journaled = blocksReceived;
+    ctx->name = name;
 
     // save this for the next use
-    _chatClient->_uploadingFiles[key] = ctx.release();
+    {
+        ScopedLock lk(_filesMutex);
+        _uploadingFiles[key] = ctx;
+    }
+
+    // requesting the first window of blocks (on the strand of this file)
+    ctx->strand.post(boost::bind(&ChatClient::StartUploadingFile, this, ctx));
     return;
 }
 
-void ChatClient::HandlerFileBlock::handle(cc_string data, size_t)
+// blocks of one file are handled on the strand of the file
+
+Strand ChatClient::RouteFileBlock(const MessageView<MessageFileBlock>& msg, const UdpEndpoint& from)
+{
+    UploadingFilePtr ctx = FindUploadingFile(TransferKey(from, msg->_id));
+    return ctx ? ctx->strand : _chatStrand;
+}
+
+void ChatClient::OnFileBlock(const MessageView<MessageFileBlock>& msg, const UdpEndpoint& from)
 {
-    MessageFileBlock* msgFileBlock = (MessageFileBlock*)data;
+    const MessageFileBlock* msgFileBlock = &*msg;
 
-    string peerId;
-    peerId.assign(msgFileBlock->_peerId);
+    {
+        ScopedLock lk(_peersMutex);
+        if (FindSender(msg.Sender(), "file block") == PEER_NONE)
+            return;
+    }
+
+    TransferKey key(from, msgFileBlock->_id);
+    UploadingFilePtr ctx = FindUploadingFile(key);
+
+    if (!ctx || msgFileBlock->_block >= ctx->blocks)
+    {
+        LOG_DEBUG("Received block ", msgFileBlock->_block, " of unknown file ", msgFileBlock->_id);
+        return;
+    }
 
-    Peers::iterator peer_it = _chatClient->_peersMap.find(peerId);
+    // the block was routed to the chat strand before the download was registered
+    if (!ctx->strand.running_in_this_thread())
+    {
+        Reroute(ctx->strand, msg, from);
+        return;
+    }
 
-    if (peerId == _chatClient->_thisPeer.GetId())
+    // blocks may come in any order, so drop only duplicates
+    if (ctx->received[msgFileBlock->_block])
     {
+        LOG_TRACE("Received block ", msgFileBlock->_block, " for file ", ctx->name, " is duplicate");
         return;
     }
-    else if (peer_it == _chatClient->_peersMap.end())
+
+    size_t index = FindSource(ctx.get(), key);
+    FileSource& source = ctx->sources[index];
+
+    // compressed block is unpacked first (CRC is of the original data)
+    cc_string data = msgFileBlock->_data;
+    size_t size = msgFileBlock->_size;
+    char unpacked[FILE_BLOCK_MAX];
+    uint8 codec = msg.RestSize() >= SZ_FILE_BLOCK_CRC + SZ_FILE_BLOCK_CODEC ? (uint8)msg.Rest()[SZ_FILE_BLOCK_CRC] : 0;
+    if (codec != 0)
     {
-        Logger::GetInstance()->Trace("Received file block from unknown peer ", peerId);
+        if (codec != FILE_CODEC_LZ4 || !(source.codecs & codec) || !Lz4::Decompress(data, size, unpacked, sizeof(unpacked), size))
+        {
+            LOG_DEBUG("Received block ", msgFileBlock->_block, " for file ", ctx->name, " can't be decompressed");
+            return;
+        }
+        data = unpacked;
+    }
+
+    // corrupted block is dropped: it is requested again as a lost one
+    uint32 crc = Crc32c::Compute(data, size);
+    if (msg.RestSize() >= SZ_FILE_BLOCK_CRC && crc != MessageBuilder::LoadUint32(msg.Rest()))
+    {
+        LOG_DEBUG("Received block ", msgFileBlock->_block, " for file ", ctx->name, " is corrupted");
         return;
     }
-    Peer* peer = (*peer_it).second;
 
-    peer->SetLastActivityCheck(time(0));
-    peer->SetPingSent(false);
+    // round trip of the block, it isn't measured for re-requested blocks (and blocks, which were requested from other sources)
+    uint32 slot = msgFileBlock->_block % FILE_WINDOW_MAX;
+    TimePoint& requestedAt = ctx->requestedAt[slot];
+    TimePoint now = Clock::now();
+    if (requestedAt != TimePoint() && ctx->requestedFrom[slot] == index)
+    {
+        source.rtt.OnSample(now - requestedAt);
+        source.congestion.OnRttSample(now - requestedAt);
+    }
+    requestedAt = TimePoint();
+
+    StoreFileBlock(ctx, index, msgFileBlock->_block, data, size, crc);
+}
+
+// parity is handled on the strand of the file (with its blocks)
 
-    stringstream ss;
-    ss << _chatClient->_recvEndpoint.address().to_string() << ":" << msgFileBlock->_id;
+Strand ChatClient::RouteFileParity(const MessageView<MessageFileParity>& msg, const UdpEndpoint& from)
+{
+    UploadingFilePtr ctx = FindUploadingFile(TransferKey(from, msg->_id));
+    return ctx ? ctx->strand : _chatStrand;
+}
+
+// one lost block of the group is recovered from the parity (without a request and the timeout)
+
+void ChatClient::OnFileParity(const MessageView<MessageFileParity>& msg, const UdpEndpoint& from)
+{
+    {
+        ScopedLock lk(_peersMutex);
+        if (FindSender(msg.Sender(), "file parity") == PEER_NONE)
+            return;
+    }
 
-    string key(ss.str());
-    UploadingFilesContext* ctx = 0;
-    UploadingFilesMap::iterator it = _chatClient->_uploadingFiles.find(key);
-    if (it != _chatClient->_uploadingFiles.end())
-        ctx = _chatClient->_uploadingFiles[key];
+    TransferKey key(from, msg->_id);
+    UploadingFilePtr ctx = FindUploadingFile(key);
+    if (!ctx || msg.RestSize() < SZ_FILE_BLOCK_CRC || Crc32c::Compute(msg.Tail(), msg.TailSize()) != MessageBuilder::LoadUint32(msg.Rest()))
+        return;
 
-    if (ctx == 0 || msgFileBlock->_block >= ctx->blocks)
+    if (!ctx->strand.running_in_this_thread())
     {
-        Logger::GetInstance()->Trace("Received block for file ", ctx->name, " is out of queue!");
+        Reroute(ctx->strand, msg, from);
+        return;
+    }
+
+    // numbers of blocks (count is validated already), then the parity
+    uint32 blocks[FEC_GROUP_MAX];
+    memcpy(blocks, msg.Tail(), msg->_count * sizeof(uint32));
+    cc_string parity = msg.Tail() + msg->_count * sizeof(uint32);
+
+    char data[FILE_BLOCK_MAX];
+    uint32 block;
+    if (!ctx->fec.Recover(blocks, msg->_count, parity, msg->_size, ctx->received, block, data))
         return;
+
+    // size of the recovered block (only the last one is shorter, its size is known from the identity)
+    size_t size = FILE_BLOCK_MAX;
+    if (block + 1 == ctx->blocks)
+    {
+        if (!ctx->identity.IsKnown())
+            return;
+        size = (size_t)(ctx->identity.size - (uint64)block * FILE_BLOCK_MAX);
     }
+    if (size > msg->_size)
+        return;
+
+    LOG_TRACE("File: ", ctx->name, ". Block ", block, " is recovered by the parity");
+    size_t source = FindSource(ctx.get(), key);
+    ctx->sources[source].loss.OnLost(1);
+    ctx->requestedAt[block % FILE_WINDOW_MAX] = TimePoint();
+    StoreFileBlock(ctx, source, block, data, size, Crc32c::Compute(data, size));
+}
 
-    ctx->fp.write(msgFileBlock->_data, msgFileBlock->_size);
-    ctx->resendCount = 0;
+// write the block on its own place in the file, then request the next blocks (or finish the file)
+// from is the source, which has sent the block (it may be requested from another one)
+
+void ChatClient::StoreFileBlock(UploadingFilePtr ctx, size_t from, uint32 block, cc_string data, size_t size, uint32 crc)
+{
+    ctx->fp.seekp((streamoff)block * FILE_BLOCK_MAX);
+    ctx->fp.write(data, size);
+    ctx->received[block] = true;
+    ctx->blockCrcs[block] = crc;
     ctx->blocksReceived += 1;
-    ctx->ts = time(0);
+    if (ctx->fec.IsActive())
+        ctx->fec.Keep(block, data, size);
 
-    // we have all blocks?
+    // the block isn't waited from its source anymore (blocks after the next one come unrequested, when the file is sent to all)
+    if (block < ctx->nextBlock)
+    {
+        FileSource& owner = ctx->sources[ctx->requestedFrom[block % FILE_WINDOW_MAX]];
+        if (owner.inFlight > 0)
+            owner.inFlight -= 1;
+    }
+
+    // the source answers, so its retransmission deadline is moved (the timer is re-armed, when it expires)
+    FileSource& source = ctx->sources[from];
+    TimePoint now = Clock::now();
+    source.lastReceived = now;
+    source.retransmitAt = now + source.rtt.GetRto();
+    source.silent = false;
 
-    ss.str(string());
-    ss << "File: " << ctx->name << ". " << "Downloaded block " << ctx->blocksReceived << " from " << ctx->blocks;
-    Logger::GetInstance()->Trace(ss.str());
-    cout << endl << ss.str() << endl;
+    while (ctx->firstMissing < ctx->blocks && ctx->received[ctx->firstMissing])
+        ctx->firstMissing += 1;
+
+    // window grows while there is no queue on the way from the source, and shrinks when the queue grows
+    source.congestion.OnAck();
+
+    LOG_TRACE("File: ", ctx->name, ". Downloaded block ", block, " (", ctx->blocksReceived, " from ", ctx->blocks, ")");
+
+    // don't flood the console, show only changes of progress
+    uint32 progress = (uint32)((uint64_t)ctx->blocksReceived * 100 / ctx->blocks);
+    if (progress != ctx->progress)
+    {
+        ctx->progress = progress;
+        cout << endl << "File: " << ctx->name << ". Downloaded " << progress << "%" << endl;
+    }
+
+    // we have all blocks?
 
     if (ctx->blocks == ctx->blocksReceived)
     {
-        Logger::GetInstance()->Trace("Done uploading file ", ctx->name);
-        cout << "\nDone uploading file " << ctx->name << endl;
-        _chatClient->_uploadingFiles.erase(_chatClient->_uploadingFiles.find(key));
-        ctx->fp.close();
-        _chatClient->SendTo(ctx->endpoint, MessageBuilder::System("filedone", _chatClient->_thisPeer.GetId()));
-        delete ctx;
+        FinishUploadingFile(ctx);
         return;
     }
 
-    // requesting the next block
+    if (ctx->blocksReceived - ctx->journaled >= JOURNAL_INTERVAL)
+        SaveJournal(ctx.get());
+
+    // requesting the next blocks (keep the window full)
 
-    _chatClient->SendTo(ctx->endpoint, MessageBuilder::RequestForFileBlock(ctx->id, ctx->blocksReceived, _chatClient->_thisPeer.GetId()));
+    SendReqForFileBlockMsg(ctx.get());
 
     return;
 }
 
-void ChatClient::HandlerRequestForFileBlock::handle(cc_string data, size_t)
+// requests for blocks of one file are handled on the strand of the file
+
+Strand ChatClient::RouteRequestForFileBlock(const MessageView<MessageRequestForFileBlock>& msg, const UdpEndpoint&)
 {
-    MessageRequestForFileBlock* msgReqForFileBlock = (MessageRequestForFileBlock*)data;
+    SendingFilePtr fsc = FindSendingFile(msg->_id);
+    return fsc ? fsc->strand : _chatStrand;
+}
+
+void ChatClient::OnRequestForFileBlock(const MessageView<MessageRequestForFileBlock>& msg, const UdpEndpoint&)
+{
+    {
+        ScopedLock lk(_peersMutex);
+        if (FindSender(msg.Sender(), "request for file block") == PEER_NONE)
+            return;
+    }
+
+    SendingFilePtr fsc = FindSendingFile(msg->_id);
+    if (!fsc || msg->_block >= fsc->totalBlocks || !ResumeSendingFile(fsc))
+        return;
 
-    string peerId;
-    peerId.assign(msgReqForFileBlock->_peerId);
+    fsc->ranges.assign(1, make_pair(msg->_block, msg->_block));
+    SendFileBlocks(fsc, fsc->ranges, Duration::zero());
+}
 
-    Peers::iterator peer_it = _chatClient->_peersMap.find(peerId);
+Strand ChatClient::RouteRequestForFileBlocks(const MessageView<MessageRequestForFileBlocks>& msg, const UdpEndpoint&)
+{
+    SendingFilePtr fsc = FindSendingFile(msg->_id);
+    return fsc ? fsc->strand : _chatStrand;
+}
 
-    if (peerId == _chatClient->_thisPeer.GetId())
+void ChatClient::OnRequestForFileBlocks(const MessageView<MessageRequestForFileBlocks>& msg, const UdpEndpoint&)
+{
     {
+        ScopedLock lk(_peersMutex);
+        if (FindSender(msg.Sender(), "request for file blocks") == PEER_NONE)
+            return;
+    }
+
+    SendingFilePtr fsc = FindSendingFile(msg->_id);
+    if (!fsc || !ResumeSendingFile(fsc))
         return;
+
+    // count of ranges is validated already
+    // the receiver never requests further than its window from the first block of the request,
+    // so larger spans are cut (one small datagram can't make us send the whole file to any endpoint)
+    uint32 base = msg->_count > 0 ? msg->_ranges[0]._first : 0;
+    uint32 end = (uint32)min<uint64>((uint64)base + FILE_WINDOW_MAX, fsc->totalBlocks);
+    uint32 queued = 0;
+    BlockRanges& ranges = fsc->ranges;
+    ranges.clear();
+    for (uint32 i = 0; i < msg->_count && queued < FILE_WINDOW_MAX; ++i)
+    {
+        const FileBlocksRange& range = msg->_ranges[i];
+        if (range._first > range._last || range._first < base || range._first >= end)
+            continue;
+        uint32 last = min(min(range._last, end - 1), range._first + (FILE_WINDOW_MAX - queued) - 1);
+        ranges.push_back(make_pair(range._first, last));
+        queued += last - range._first + 1;
     }
-    else if (peer_it == _chatClient->_peersMap.end())
+
+    // the receiver accepts compression and tells its loss in every request (the first one can be lost)
+    if (COMPRESS_FILE_BLOCKS == 1 && msg.RestSize() >= SZ_FILE_BLOCKS_CODECS && (msg.Rest()[0] & FILE_CODEC_LZ4))
+        fsc->codec = FILE_CODEC_LZ4;
+    if (FEC_FILE_BLOCKS == 1 && msg.RestSize() >= SZ_FILE_BLOCKS_CODECS + SZ_FILE_BLOCKS_LOSS)
+        fsc->loss = (uint8)msg.Rest()[SZ_FILE_BLOCKS_CODECS];
+
+    // the sender sends the receiver's window once per its round trip
+    fsc->pacer.SetWindow(msg->_window, chrono::microseconds(msg->_rtt));
+
+    SendFileBlocks(fsc, ranges, chrono::microseconds(msg->_rtt));
+}
+
+// the peer looks for sources of the file, which it downloads: the file with the same content is offered to it
+// (if it isn't sent to this peer already)
+
+void ChatClient::OnFileQuery(const MessageView<MessageFileQuery>& msg, const UdpEndpoint& from)
+{
+    uint8 version;
     {
-        Logger::GetInstance()->Trace("Received request for file block from unknown peer ", peerId);
-        return;
+        ScopedLock lk(_peersMutex);
+        PeerHandle peer = FindSender(msg.Sender(), "file query");
+        if (peer == PEER_NONE)
+            return;
+        version = _peers.Get(peer).GetVersion();
+    }
+
+    string path;
+    {
+        ScopedLock lk(_filesMutex);
+        SharedFilesMap::const_iterator it = _sharedFiles.find(msg->_content);
+        if (it == _sharedFiles.end() || it->second.size != msg->_size || it->second.crc != msg->_crc)
+            return;
+        path = it->second.path;
+
+        for (SendingFilesMap::const_iterator sending = _sendingFiles.begin(); sending != _sendingFiles.end(); ++sending)
+        {
+            const SendingFilesContext& fsc = *sending->second;
+            if (fsc.path == path && (fsc.broadcast || fsc.endpoint.address() == from.address()))
+                return;
+        }
     }
-    Peer* peer = (*peer_it).second;
 
-    peer->SetLastActivityCheck(time(0));
-    peer->SetPingSent(false);
+    UdpEndpoint endpoint = from;
+    endpoint.port(_port);
+    OfferFile(endpoint, path, version, msg->_content);
+}
+
+// signatures of the sent file are handled on its strand
+
+Strand ChatClient::RouteRequestForFileSignatures(const MessageView<MessageRequestForFileSignatures>& msg, const UdpEndpoint&)
+{
+    SendingFilePtr fsc = FindSendingFile(msg->_id);
+    return fsc ? fsc->strand : _chatStrand;
+}
 
-    if (SIMULATE_PACKET_LOOSING == 1)
+// the receiver has an old copy of the file: it finds blocks in it by their signatures (see DeltaTransfer.h)
+// weak sums are counted on the first request (CRCs of blocks are counted already), pages go to the requester only
+
+void ChatClient::OnRequestForFileSignatures(const MessageView<MessageRequestForFileSignatures>& msg, const UdpEndpoint& from)
+{
     {
-        srand((uint32)time(NULL));
-        if ((rand() % 10 + 1) > 7)
+        ScopedLock lk(_peersMutex);
+        if (FindSender(msg.Sender(), "request for file signatures") == PEER_NONE)
             return;
     }
 
-    if (_chatClient->_sendingFiles.find(msgReqForFileBlock->_id) == _chatClient->_sendingFiles.end())
+    SendingFilePtr fsc = FindSendingFile(msg->_id);
+    if (!fsc || fsc->blockCrcs.size() != fsc->totalBlocks || !ResumeSendingFile(fsc))
         return;
 
-    SendingFilesContext * fsc = _chatClient->_sendingFiles[msgReqForFileBlock->_id];
-    if (msgReqForFileBlock->_block >= fsc->totalBlocks)
-        return;
+    fsc->requested = true;
+
+    if (fsc->weakSums.empty())
+    {
+        cc_string file = (cc_string)fsc->region.get_address();
+        fsc->weakSums.resize(fsc->totalBlocks);
+        for (uint32 block = 0; block < fsc->totalBlocks; ++block)
+        {
+            uint64 offset = (uint64)block * FILE_BLOCK_MAX;
+            size_t size = (size_t)min<uint64>(FILE_BLOCK_MAX, fsc->size - offset);
+            fsc->weakSums[block] = RollingChecksum::Compute(file + offset, size);
+        }
+    }
+
+    UdpEndpoint endpoint = from;
+    endpoint.port(_port);
+
+    uint32 pages = (fsc->totalBlocks + FILE_SIGNATURES_MAX - 1) / FILE_SIGNATURES_MAX;
+    for (uint32 page = msg->_first; page < pages && page - msg->_first < msg->_count; ++page)
+    {
+        uint32 first = page * FILE_SIGNATURES_MAX;
+        uint32 count = min<uint32>(FILE_SIGNATURES_MAX, fsc->totalBlocks - first);
+        SendTo(endpoint, MessageBuilder::FileSignatures(fsc->id, page, &fsc->weakSums[first], &fsc->blockCrcs[first], count,
+            _thisPeer, msg.Version()));
+    }
+}
+
+// signatures of the downloading file are handled on its strand
+
+Strand ChatClient::RouteFileSignatures(const MessageView<MessageFileSignatures>& msg, const UdpEndpoint& from)
+{
+    UploadingFilePtr ctx = FindUploadingFile(TransferKey(from, msg->_id));
+    return ctx ? ctx->strand : _chatStrand;
+}
+
+// blocks are looked for in the old copy, when all pages of signatures are received
 
-    // open file
+void ChatClient::OnFileSignatures(const MessageView<MessageFileSignatures>& msg, const UdpEndpoint& from)
+{
+    {
+        ScopedLock lk(_peersMutex);
+        if (FindSender(msg.Sender(), "file signatures") == PEER_NONE)
+            return;
+    }
+
+    UploadingFilePtr ctx = FindUploadingFile(TransferKey(from, msg->_id));
+    if (!ctx)
+        return;
 
-    ifstream input;
-    input.open(fsc->path.c_str(), ifstream::in | ios_base::binary);
-    if (!input.is_open())
+    if (!ctx->strand.running_in_this_thread())
     {
-        Logger::GetInstance()->Trace("File: ", fsc->path, ". Can't open it!");
+        Reroute(ctx->strand, msg, from);
         return;
     }
 
-    // read and send needed block
+    if (!ctx->delta || msg->_page >= ctx->delta->pages.size() || ctx->delta->pages[msg->_page])
+        return;
 
-    char raw[FILE_BLOCK_MAX];
-    input.seekg(msgReqForFileBlock->_block * FILE_BLOCK_MAX);
-    input.read(raw, sizeof(raw));
+    DeltaState& delta = *ctx->delta;
+    uint32 first = msg->_page * FILE_SIGNATURES_MAX;
+    if (msg->_count != min<uint32>(FILE_SIGNATURES_MAX, ctx->blocks - first))
+        return;
 
-    _chatClient->SendTo(fsc->endpoint,
-        MessageBuilder::FileBlock(msgReqForFileBlock->_id, msgReqForFileBlock->_block, raw,
-        (uint32)input.gcount(), _chatClient->_thisPeer.GetId()));
+    for (uint32 i = 0; i < msg->_count; ++i)
+    {
+        delta.weakSums[first + i] = msg->_signatures[i]._weak;
+        delta.crcs[first + i] = msg->_signatures[i]._crc;
+    }
+    delta.pages[msg->_page] = true;
+    delta.pagesReceived += 1;
 
-    input.close();
+    // the sender answers, so the deadline is moved
+    FileSource& source = ctx->sources[0];
+    TimePoint now = Clock::now();
+    source.lastReceived = now;
+    source.retransmitAt = now + source.rtt.GetRto();
 
-    if (msgReqForFileBlock->_block == 0)
-        fsc->firstBlockSent = true;
+    if (delta.pagesReceived == delta.pages.size())
+        ApplyDelta(ctx);
+    else
+        SendReqForSignaturesMsg(ctx.get());
 }
@@ -11,8 +11,13 @@ enum MessageType
     M_FILE_BLOCK,
     M_REQ_FOR_FILE_BLOCK,
     M_PEER_DATA,
+    M_REQ_FOR_FILE_BLOCKS,
+    M_FILE_PARITY,
+    M_FILE_QUERY,
+    M_REQ_FOR_FILE_SIGNATURES,
+    M_FILE_SIGNATURES,
     FIRST = M_SYS,
-    LAST = M_PEER_DATA
+    LAST = M_FILE_SIGNATURES
 };
 
 /*
@@ -45,7 +50,7 @@ struct MessagePeerData
     uint8 _code;
     uint32 _nicknameLength;
     char _id[PEER_ID_SIZE + 1];
-    wchar_t _nickname[1];
+    uint16 _nickname[1];    // UTF-16, length is in its units
 };
 
 #define SZ_MESSAGE_PEERDATA (sizeof(uint8) + sizeof(uint32) + sizeof(char[PEER_ID_SIZE + 1]))
@@ -57,7 +62,8 @@ struct MessageText
     uint32 _length;
     char _peerId[PEER_ID_SIZE + 1];
     // "open array", we don't know about size of data. This field will have address in struct.
-    wchar_t _text[1];
+    // UTF-16 on every platform, length is in its units
+    uint16 _text[1];
 };
 
 #define SZ_MESSAGE_TEXT (sizeof(uint8) + sizeof(uint32) + sizeof(char[PEER_ID_SIZE + 1]))
@@ -75,6 +81,49 @@ struct MessageFileInfo
 
 #define SZ_MESSAGE_FILE_INFO (sizeof(uint8) + 3 * sizeof(uint32) + sizeof(char[PEER_ID_SIZE + 1]))
 
+/*
+Extensions of M_FILE_BEGIN (after the name): FILE_INFO_MAGIC, then records till the end:
+    varint type, varint length, data
+v2 message has the same records without the magic. Old clients don't read them, unknown records are skipped.
+*/
+#define FILE_INFO_MAGIC "FX"
+
+#define FILE_EXT_IDENTITY 1     // uint64 size, uint64 hash (little-endian): download of the same file is resumed
+#define FILE_EXT_CRC32C 2       // uint32 CRC-32C of the whole file (little-endian): downloaded file is checked
+#define FILE_EXT_CODECS 3       // uint8 FILE_CODEC_ bits, which the sender can compress blocks with
+#define FILE_EXT_CONTENT 4      // uint64 hash of the content (little-endian): with the size and the CRC it names the file on any peer
+#define FILE_EXT_SOURCE 5       // no data: the file isn't sent, it's offered as one more source of the download of the same content
+#define FILE_EXT_SIGNATURES 6   // no data: signatures of blocks can be requested (the receiver with an old copy downloads only the delta)
+
+// codecs of file blocks: the receiver accepts them in M_REQ_FOR_FILE_BLOCKS, only then blocks are compressed
+#define FILE_CODEC_LZ4 1        // LZ4 block format (see Lz4.h)
+
+// what file is sent (FILE_EXT_IDENTITY), 0 - unknown (old sender)
+struct FileIdentity
+{
+    FileIdentity() : size(0), hash(0) { }
+
+    uint64 size;    // bytes
+    uint64 hash;    // of the size, the time of the last change and the first and the last blocks
+
+    bool IsKnown() const { return hash != 0; }
+    bool operator==(const FileIdentity& other) const { return size == other.size && hash == other.hash; }
+};
+
+// known extensions of M_FILE_BEGIN
+struct FileExtensions
+{
+    FileExtensions() : crc(0), crcKnown(false), codecs(0), content(0), source(false), signatures(false) { }
+
+    FileIdentity identity;  // FILE_EXT_IDENTITY
+    uint32 crc;             // FILE_EXT_CRC32C
+    bool crcKnown;
+    uint8 codecs;           // FILE_EXT_CODECS
+    uint64 content;         // FILE_EXT_CONTENT, 0 - unknown
+    bool source;            // FILE_EXT_SOURCE
+    bool signatures;        // FILE_EXT_SIGNATURES
+};
+
 // File block message
 struct MessageFileBlock
 {
@@ -88,8 +137,18 @@ struct MessageFileBlock
 
 #define SZ_MESSAGE_FILE_BLOCK (sizeof(uint8) + 3 * sizeof(uint32) + sizeof(char[PEER_ID_SIZE + 1]))
 
+// new sender appends CRC-32C of the data (uint32, little-endian) right after it (old clients don't read it)
+#define SZ_FILE_BLOCK_CRC sizeof(uint32)
+// compressed block: the codec (FILE_CODEC_) goes after the CRC, _size is of the compressed data, CRC is of the original one
+#define SZ_FILE_BLOCK_CODEC sizeof(uint8)
+
 #define FILE_BLOCK_MAX (6 * 1024)
 
+// Sliding window of the downloading: how many blocks (starting from the first missing one) can be requested
+#define FILE_WINDOW_MIN 1
+#define FILE_WINDOW_INITIAL 4
+#define FILE_WINDOW_MAX 256
+
 // File block message, which is re-sent
 struct MessageRequestForFileBlock
 {
@@ -101,6 +160,135 @@ struct MessageRequestForFileBlock
 
 #define SZ_MESSAGE_REQUEST_FOR_FILE_BLOCK (sizeof(uint8) + 2 * sizeof(uint32) + sizeof(char[PEER_ID_SIZE + 1]))
 
+// Range of file blocks [_first, _last]
+struct FileBlocksRange
+{
+    uint32 _first;
+    uint32 _last;
+};
+
+// Request for several ranges of file blocks (all holes of the downloading file in one message)
+// window and RTT of the receiver are used by the sender for pacing
+struct MessageRequestForFileBlocks
+{
+    uint8 _code;
+    uint32 _id;
+    uint32 _count;
+    uint32 _window; // blocks
+    uint32 _rtt;    // microseconds (0 - unknown)
+    char _peerId[PEER_ID_SIZE + 1];
+    FileBlocksRange _ranges[1];
+};
+
+#define SZ_MESSAGE_REQUEST_FOR_FILE_BLOCKS (sizeof(uint8) + 4 * sizeof(uint32) + sizeof(char[PEER_ID_SIZE + 1]))
+
+// new receiver appends codecs (uint8 FILE_CODEC_ bits), which it accepts, and the loss of blocks (uint8, 1/255),
+// which it sees, after the ranges (old senders read only the codecs)
+#define SZ_FILE_BLOCKS_CODECS sizeof(uint8)
+#define SZ_FILE_BLOCKS_LOSS sizeof(uint8)
+
+// Parity of a group of file blocks: XOR of their data (shorter blocks are padded by zeros), see Fec.h
+// it is sent only to receivers, which report the loss
+// tail: numbers of blocks (uint32 * _count), the parity (_size bytes), then CRC-32C of both (SZ_FILE_BLOCK_CRC)
+struct MessageFileParity
+{
+    uint8 _code;
+    uint32 _id;
+    uint32 _count;
+    uint32 _size;
+    char _peerId[PEER_ID_SIZE + 1];
+    uint32 _blocks[1];
+};
+
+#define SZ_MESSAGE_FILE_PARITY (sizeof(uint8) + 3 * sizeof(uint32) + sizeof(char[PEER_ID_SIZE + 1]))
+
+#define FEC_GROUP_MAX 32        // blocks (a group of one block is a copy of it)
+
+// Query of sources of the downloading file (it is broadcast by the receiver)
+// peers, which have the file with this content, offer it (M_FILE_BEGIN with FILE_EXT_SOURCE), blocks are requested from all of them
+struct MessageFileQuery
+{
+    uint8 _code;
+    uint64 _size;       // bytes
+    uint64 _content;    // see FILE_EXT_CONTENT
+    uint32 _crc;        // CRC-32C of the file
+    char _peerId[PEER_ID_SIZE + 1];
+};
+
+#define SZ_MESSAGE_FILE_QUERY (sizeof(uint8) + 2 * sizeof(uint64) + sizeof(uint32) + sizeof(char[PEER_ID_SIZE + 1]))
+
+#define FILE_BLOCKS_RANGES_MAX 256
+
+// Request for signatures of file blocks (pages [_first, _first + _count)), see DeltaTransfer.h
+struct MessageRequestForFileSignatures
+{
+    uint8 _code;
+    uint32 _id;
+    uint32 _first;
+    uint32 _count;
+    char _peerId[PEER_ID_SIZE + 1];
+};
+
+#define SZ_MESSAGE_REQUEST_FOR_FILE_SIGNATURES (sizeof(uint8) + 3 * sizeof(uint32) + sizeof(char[PEER_ID_SIZE + 1]))
+
+// Signature of the file block: the weak rolling sum and CRC-32C
+struct FileBlockSignature
+{
+    uint32 _weak;
+    uint32 _crc;
+};
+
+// Page of signatures: blocks [_page * FILE_SIGNATURES_MAX, +_count), _count is less than the max only on the last page
+struct MessageFileSignatures
+{
+    uint8 _code;
+    uint32 _id;
+    uint32 _page;
+    uint32 _count;
+    char _peerId[PEER_ID_SIZE + 1];
+    FileBlockSignature _signatures[1];
+};
+
+#define SZ_MESSAGE_FILE_SIGNATURES (sizeof(uint8) + 3 * sizeof(uint32) + sizeof(char[PEER_ID_SIZE + 1]))
+
+#define FILE_SIGNATURES_MAX 512     // signatures in one page (4 KB, less than a file block)
+
+/*
+Version 2 (compact) of messages.
+Peer, which supports it, appends PeerDataTrailer with its session token to M_PEER_DATA (old clients don't read it).
+Messages to such peers are sent as:
+    uint8 code | M_V2
+    uint32 token of the sender (little-endian)
+    payload: numbers are varints (7 bits per byte, little-endian), strings are UTF-8 (length is a varint):
+        M_SYS:                  action (till the end), "filedone" and "filecorrupted" are followed by 0 and the file id (uint32, little-endian)
+        M_TEXT:                 text
+        M_FILE_BEGIN:           id, totalBlocks, name, extensions (see FILE_INFO_MAGIC) till the end
+        M_FILE_BLOCK:           id, block, size, data, CRC-32C of the data (uint32, little-endian, new senders), codec
+        M_REQ_FOR_FILE_BLOCK:   id, block
+        M_REQ_FOR_FILE_BLOCKS:  id, window, rtt, count, (first, last - first) * count, codecs, loss
+        M_FILE_PARITY:          id, count, size, blocks * count, data, CRC-32C as in v1 (uint32, little-endian)
+        M_FILE_QUERY:           size (uint64), content (uint64), CRC-32C (uint32), little-endian
+        M_REQ_FOR_FILE_SIGNATURES: id, first, count
+        M_FILE_SIGNATURES:      id, page, count, (weak, CRC-32C) * count (uint32, little-endian)
+Received v2 messages are unpacked into the v1 layout (with M_V2 in the code), so handlers read only v1 structures.
+*/
+#define M_V2 0x80
+
+#define PROTOCOL_V1 1
+#define PROTOCOL_V2 2
+#define PROTOCOL_VERSION PROTOCOL_V2
+
+#define SZ_MESSAGE_V2_HEADER (sizeof(uint8) + sizeof(uint32))
+
+struct PeerDataTrailer
+{
+    char _magic[2];     // PEER_DATA_MAGIC
+    uint8 _version;     // max version of the peer
+    uint32 _token;      // session token of the peer (little-endian)
+};
+
+#define PEER_DATA_MAGIC "P2"
+
 #pragma pack(pop)
 
 #endif // MESSAGE_FORMATS_H
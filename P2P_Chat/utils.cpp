@@ -3,7 +3,12 @@
 #ifdef __linux__ 
 string to_string(const wstring& wstr)
 {
-    return utf_to_utf<char>(wstr.c_str(), wstr.c_str() + wstr.size());
+    return boost::locale::conv::utf_to_utf<char>(wstr.c_str(), wstr.c_str() + wstr.size());
+}
+
+wstring to_wstring(const string& str)
+{
+    return boost::locale::conv::utf_to_utf<wchar_t>(str.c_str(), str.c_str() + str.size());
 }
 #elif _WIN32
 string to_string(const wstring& wstr)
@@ -13,8 +18,67 @@ string to_string(const wstring& wstr)
 
     return converterX.to_bytes(wstr);
 }
+
+// received strings can be broken, they are replaced by "?" instead of exception
+wstring to_wstring(const string& str)
+{
+    typedef std::codecvt_utf8<wchar_t> convert_typeX;
+    std::wstring_convert<convert_typeX, wchar_t> converterX("?", L"?");
+
+    return converterX.from_bytes(str);
+}
 #endif
 
+// characters out of the 16-bit range are sent as surrogate pairs (only Linux wchar_t has them)
+
+vector<uint16> to_utf16(const wstring& wstr)
+{
+    vector<uint16> units;
+    units.reserve(wstr.length());
+    for (size_t i = 0; i < wstr.length(); ++i)
+    {
+        uint32 c = (uint32)wstr[i];
+        if (c >= 0x10000 && c <= 0x10FFFF)
+        {
+            c -= 0x10000;
+            units.push_back((uint16)(0xD800 + (c >> 10)));
+            units.push_back((uint16)(0xDC00 + (c & 0x3FF)));
+        }
+        else
+        {
+            units.push_back(c <= 0xFFFF ? (uint16)c : (uint16)'?');
+        }
+    }
+    return units;
+}
+
+// surrogate pairs are joined, if wchar_t can keep them (Windows keeps them as they are)
+
+wstring from_utf16(cc_string data, size_t length)
+{
+    wstring wstr;
+    wstr.reserve(length);
+    for (size_t i = 0; i < length; ++i)
+    {
+        uint16 unit;
+        memcpy(&unit, data + i * sizeof(uint16), sizeof(unit));
+
+        if (sizeof(wchar_t) > sizeof(uint16) && unit >= 0xD800 && unit < 0xDC00 && i + 1 < length)
+        {
+            uint16 low;
+            memcpy(&low, data + (i + 1) * sizeof(uint16), sizeof(low));
+            if (low >= 0xDC00 && low < 0xE000)
+            {
+                wstr += (wchar_t)(0x10000 + ((uint32)(unit - 0xD800) << 10) + (low - 0xDC00));
+                i += 1;
+                continue;
+            }
+        }
+        wstr += (wchar_t)unit;
+    }
+    return wstr;
+}
+
 bool IsIpV4(const string& ip)
 {
     ErrorCode err;
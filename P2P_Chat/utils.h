@@ -9,9 +9,11 @@
 #include <ctime>
 #include <memory>
 #include <map>
+#include <unordered_map>
 #include <vector>
 #include <iostream>
 #include <fstream>
+#include <chrono>
 
 #ifdef __linux__
 #include <boost/locale/encoding_utf.hpp>
@@ -20,16 +22,22 @@
 #endif
 
 #include <boost/asio.hpp>
+#include <boost/asio/steady_timer.hpp>
 #include <boost/array.hpp>
+#include <boost/circular_buffer.hpp>
 #include <boost/thread.hpp>
 #include <boost/thread/mutex.hpp>
 #include <boost/filesystem.hpp>
+#include <boost/interprocess/file_mapping.hpp>
+#include <boost/interprocess/mapped_region.hpp>
 
 #define SIMULATE_PACKET_LOOSING 1
+#define COMPRESS_FILE_BLOCKS 1  // blocks are compressed (LZ4), if the receiver supports it
+#define FEC_FILE_BLOCKS 1       // parity of blocks is sent, if the receiver sees losses
+#define DELTA_FILE_BLOCKS 1     // only changed blocks are downloaded, if the receiver has an old copy of the file
 
 #define LOG_THREAD "LoggerThread"
 #define BOOST_SERVICE_THREAD "BoostServiceThread"
-#define FILESWATCHER_THREAD "FilesThread"
 
 #define PEER_ID_SIZE 20
 
@@ -40,6 +48,13 @@ typedef boost::asio::ip::udp::endpoint UdpEndpoint;
 typedef boost::asio::ip::udp::resolver UdpResolver;
 typedef boost::asio::ip::address IpAddress;
 typedef boost::asio::ip::address_v4 Ipv4Address;
+typedef boost::asio::ip::address_v6 Ipv6Address;
+
+typedef boost::asio::io_service::strand Strand;
+typedef boost::asio::steady_timer SteadyTimer;
+typedef SteadyTimer::clock_type Clock;
+typedef Clock::time_point TimePoint;
+typedef Clock::duration Duration;
 
 typedef boost::thread Thread;
 typedef boost::mutex Mutex;
@@ -50,13 +65,19 @@ typedef boost::system::error_code ErrorCode;
 typedef ofstream OutFile;
 typedef ifstream InFile;
 
+typedef boost::interprocess::file_mapping FileMapping;
+typedef boost::interprocess::mapped_region MappedRegion;
+
 typedef char* c_string;
 typedef const char* cc_string;
 
-typedef unsigned char uint8;
-typedef unsigned short uint16;
-typedef unsigned long uint32;
-typedef unsigned long uint64;
+// fixed sizes: they are sent in messages (long is 8 bytes on Linux and 4 bytes on Windows)
+typedef uint8_t uint8;
+typedef uint16_t uint16;
+typedef uint32_t uint32;
+typedef uint64_t uint64;
+
+typedef vector< pair<uint32, uint32> > BlockRanges; // [first, last] ranges of file blocks
 
 // Global variables
 static uint16 Port = 54321;
@@ -64,6 +85,9 @@ static bool DoShutdown = false;
 static map<string, auto_ptr<Thread>> ThreadsMap;
 
 bool IsIpV4(const string& ip);
-string to_string(const wstring& wstr);
+string to_string(const wstring& wstr);   // to UTF-8
+wstring to_wstring(const string& str);  // from UTF-8
+vector<uint16> to_utf16(const wstring& wstr);           // text of v1 messages (wchar_t is 2 bytes on Windows, 4 bytes on Linux)
+wstring from_utf16(cc_string data, size_t length);      // length in UTF-16 units
 
 #endif // UTILS_H